@@ -0,0 +1,53 @@
+# Copyright (c) MONAI Consortium
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#     http://www.apache.org/licenses/LICENSE-2.0
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Thread scaling of the CPU permutohedral lattice filter (BilateralFilter with the "phl" algorithm)
+# on 2D and 3D inputs. Batches are split between concurrent batch elements and parallel lattices.
+#
+#   python benchmarks/benchmark_phl_filter_threads.py --threads 1 2 4 8
+#   python benchmarks/benchmark_phl_filter_threads.py --threads 1 2 4 8 --batch 6 --size-3d 64
+
+import argparse
+import time
+
+import torch
+
+from monai.networks.layers.filtering import BilateralFilter
+
+parser = argparse.ArgumentParser(description="Permutohedral filter thread scaling")
+parser.add_argument("--threads", type=int, nargs="+", default=[1, 2, 4, 8])
+parser.add_argument("--size-2d", type=int, default=1024)
+parser.add_argument("--size-3d", type=int, default=128)
+parser.add_argument("--batch", type=int, default=1)
+parser.add_argument("--channels", type=int, default=1)
+parser.add_argument("--spatial-sigma", type=float, default=5.0)
+parser.add_argument("--color-sigma", type=float, default=0.2)
+parser.add_argument("--repeats", type=int, default=3)
+args = parser.parse_args()
+
+torch.manual_seed(0)
+inputs = {
+    "2d": torch.rand(args.batch, args.channels, args.size_2d, args.size_2d),
+    "3d": torch.rand(args.batch, args.channels, args.size_3d, args.size_3d, args.size_3d),
+}
+
+for name, input in inputs.items():
+    print(f"{name} input {tuple(input.shape)}")
+    baseline = None
+    for threads in args.threads:
+        torch.set_num_threads(threads)
+        BilateralFilter.apply(input, args.spatial_sigma, args.color_sigma, "phl")  # warmup
+        start = time.perf_counter()
+        for _ in range(args.repeats):
+            BilateralFilter.apply(input, args.spatial_sigma, args.color_sigma, "phl")
+        elapsed = (time.perf_counter() - start) / args.repeats
+        baseline = baseline or elapsed
+        print(f"  threads {threads:3d}: {elapsed * 1000:9.1f} ms  speedup {baseline / elapsed:5.2f}x")
@@ -0,0 +1,80 @@
+# Copyright (c) MONAI Consortium
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#     http://www.apache.org/licenses/LICENSE-2.0
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Forward time and accuracy of the CPU exact, trainable and joint bilateral filters for a sweep of
+# range kernel lookup table errors (set_range_lut_max_error). Each row reports the time and speedup
+# against the exact range kernel (max error 0) and the maximum absolute difference of the output.
+#
+#   python benchmarks/benchmark_range_lut.py
+#   python benchmarks/benchmark_range_lut.py --max-errors 1e-4 1e-3 1e-2 --dtype float64 --threads 1
+
+import argparse
+import time
+
+import torch
+
+from monai.networks.layers.filtering import (
+    BilateralFilter,
+    TrainableBilateralFilterFunction,
+    TrainableJointBilateralFilterFunction,
+    set_range_lut_max_error,
+)
+
+parser = argparse.ArgumentParser(description="Bilateral filter range kernel lookup table sweep")
+parser.add_argument("--max-errors", type=float, nargs="+", default=[1e-5, 1e-4, 1e-3, 1e-2])
+parser.add_argument("--size", type=int, default=64, help="edge length of the cubic input")
+parser.add_argument("--dtype", choices=["float32", "float64"], default="float32")
+parser.add_argument("--spatial-sigma", type=float, default=1.5)
+parser.add_argument("--color-sigma", type=float, default=0.2)
+parser.add_argument("--threads", type=int, default=None)
+parser.add_argument("--repeats", type=int, default=3)
+args = parser.parse_args()
+
+if args.threads is not None:
+    torch.set_num_threads(args.threads)
+torch.manual_seed(0)
+dtype = getattr(torch, args.dtype)
+input = torch.rand(1, 1, args.size, args.size, args.size, dtype=dtype)
+guidance = torch.rand_like(input)
+sigmas = [torch.tensor(args.spatial_sigma, dtype=dtype) for _ in range(3)]
+sigmas.append(torch.tensor(args.color_sigma, dtype=dtype))
+
+filters = {
+    "exact": lambda: BilateralFilter.apply(input, args.spatial_sigma, args.color_sigma, "exact"),
+    "trainable": lambda: TrainableBilateralFilterFunction.apply(input, *sigmas),
+    "joint": lambda: TrainableJointBilateralFilterFunction.apply(input, guidance, *sigmas),
+}
+
+
+def measure(run):
+    run()  # warmup, also builds the table
+    start = time.perf_counter()
+    for _ in range(args.repeats):
+        output = run()
+    return output, (time.perf_counter() - start) / args.repeats
+
+
+print(f"input {tuple(input.shape)} {args.dtype}, threads {torch.get_num_threads()}")
+with torch.no_grad():
+    for name, run in filters.items():
+        print(name)
+        set_range_lut_max_error(0.0)
+        reference, baseline = measure(run)
+        print(f"  max error {0.0:8.0e}: {baseline * 1000:9.1f} ms  speedup {1.0:5.2f}x")
+        for max_error in args.max_errors:
+            set_range_lut_max_error(max_error)
+            output, elapsed = measure(run)
+            difference = (output - reference).abs().max().item()
+            print(
+                f"  max error {max_error:8.0e}: {elapsed * 1000:9.1f} ms  speedup {baseline / elapsed:5.2f}x"
+                f"  max abs difference {difference:.2e}"
+            )
+set_range_lut_max_error(0.0)
@@ -0,0 +1,66 @@
+# Copyright (c) MONAI Consortium
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#     http://www.apache.org/licenses/LICENSE-2.0
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Thread scaling of the CPU trainable bilateral filter (forward and backward) on a cube, a volume
+# with few rows per slice and a batch of small volumes. The kernels split the rows of all batch
+# elements and slices between the threads; run on an earlier revision to compare against kernels
+# that only parallelized the rows of one slice at a time.
+#
+#   python benchmarks/benchmark_trainable_bilateral_threads.py --threads 1 2 4 8
+#   python benchmarks/benchmark_trainable_bilateral_threads.py --threads 1 8 --spatial-sigma 1.5 --joint
+
+import argparse
+import time
+
+import torch
+
+from monai.networks.layers.filtering import TrainableBilateralFilterFunction, TrainableJointBilateralFilterFunction
+
+parser = argparse.ArgumentParser(description="Trainable bilateral filter thread scaling")
+parser.add_argument("--threads", type=int, nargs="+", default=[1, 2, 4, 8])
+parser.add_argument("--spatial-sigma", type=float, default=1.0)
+parser.add_argument("--color-sigma", type=float, default=0.2)
+parser.add_argument("--repeats", type=int, default=3)
+parser.add_argument("--joint", action="store_true", help="benchmark the joint filter")
+args = parser.parse_args()
+
+torch.manual_seed(0)
+inputs = {
+    "cube": torch.rand(1, 1, 64, 64, 64),
+    "few rows": torch.rand(1, 1, 256, 4, 64),
+    "batch": torch.rand(8, 1, 32, 32, 32),
+}
+sigmas = [torch.tensor(args.spatial_sigma, requires_grad=True) for _ in range(3)]
+sigmas.append(torch.tensor(args.color_sigma, requires_grad=True))
+
+
+def run(input, guidance):
+    if guidance is None:
+        output = TrainableBilateralFilterFunction.apply(input, *sigmas)
+    else:
+        output = TrainableJointBilateralFilterFunction.apply(input, guidance, *sigmas)
+    output.sum().backward()
+
+
+for name, input in inputs.items():
+    input.requires_grad_(True)
+    guidance = torch.rand_like(input) if args.joint else None
+    print(f"{name} input {tuple(input.shape)}")
+    baseline = None
+    for threads in args.threads:
+        torch.set_num_threads(threads)
+        run(input, guidance)  # warmup
+        start = time.perf_counter()
+        for _ in range(args.repeats):
+            run(input, guidance)
+        elapsed = (time.perf_counter() - start) / args.repeats
+        baseline = baseline or elapsed
+        print(f"  threads {threads:3d}: {elapsed * 1000:9.1f} ms  speedup {baseline / elapsed:5.2f}x")
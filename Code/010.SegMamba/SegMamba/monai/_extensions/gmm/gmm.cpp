@@ -13,12 +13,20 @@ limitations under the License.
 
 #include <torch/extension.h>
 
+#include <stdexcept>
+
 #include "gmm.h"
 
 py::tuple init() {
+#ifdef WITH_CUDA
+  c10::DeviceType device_type = torch::cuda::is_available() ? torch::kCUDA : torch::kCPU;
+#else
+  c10::DeviceType device_type = torch::kCPU;
+#endif
+
   torch::Tensor gmm_tensor =
-      torch::zeros({GMM_COUNT, GMM_COMPONENT_COUNT}, torch::dtype(torch::kFloat32).device(torch::kCUDA));
-  torch::Tensor scratch_tensor = torch::empty({1}, torch::dtype(torch::kFloat32).device(torch::kCUDA));
+      torch::zeros({GMM_COUNT, GMM_COMPONENT_COUNT}, torch::dtype(torch::kFloat32).device(device_type));
+  torch::Tensor scratch_tensor = torch::empty({1}, torch::dtype(torch::kFloat32).device(device_type));
   return py::make_tuple(gmm_tensor, scratch_tensor);
 }
 
@@ -45,7 +53,11 @@ void learn(
   int* labels = label_tensor.data_ptr<int>();
 
   if (device_type == torch::kCUDA) {
+#ifdef WITH_CUDA
     learn_cuda(input, labels, gmm, scratch, batch_count, element_count);
+#else
+    throw std::runtime_error("GMM received a cuda tensor but was not compiled with GPU support");
+#endif
   } else {
     learn_cpu(input, labels, gmm, scratch, batch_count, element_count);
   }
@@ -68,7 +80,11 @@ torch::Tensor apply(torch::Tensor gmm_tensor, torch::Tensor input_tensor) {
   float* output = output_tensor.data_ptr<float>();
 
   if (device_type == torch::kCUDA) {
+#ifdef WITH_CUDA
     apply_cuda(gmm, input, output, batch_count, element_count);
+#else
+    throw std::runtime_error("GMM received a cuda tensor but was not compiled with GPU support");
+#endif
   } else {
     apply_cpu(gmm, input, output, batch_count, element_count);
   }
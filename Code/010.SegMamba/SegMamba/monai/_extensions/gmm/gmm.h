@@ -38,6 +38,7 @@ void apply_cpu(
     unsigned int batch_count,
     unsigned int element_count);
 
+#ifdef WITH_CUDA
 void learn_cuda(
     const float* input,
     const int* labels,
@@ -51,3 +52,4 @@ void apply_cuda(
     float* output,
     unsigned int batch_count,
     unsigned int element_count);
+#endif
@@ -11,10 +11,281 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
-#include <stdexcept>
+#include <ATen/Parallel.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 
 #include "gmm.h"
 
+#include "gmm_fast_exp.h"
+#include "gmm_linalg.h"
+
+#define EPSILON 1e-5
+#define TILE(SIZE, STRIDE) ((((SIZE)-1) / (STRIDE)) + 1)
+
+// Number of elements per slab of the covariance reduction. It does not depend on the thread count,
+// so neither do the summation order and the result.
+#define GMM_CPU_SLAB_SIZE 16384
+
+// Elements evaluated together by apply_cpu, one per SIMD lane.
+#define GMM_CPU_APPLY_WIDTH 16
+
+struct GMMSplit_t {
+  int idx;
+  float threshold;
+  float eigenvector[CHANNEL_COUNT];
+};
+
+// Gaussian of an element label, -1 for unlabelled elements. Labels hold the class in their low
+// 4 bits and the component of the class above them.
+static inline int GMMGaussianIndex(int alpha) {
+  return alpha == -1 ? -1 : (alpha & 15) + (alpha >> 4) * MIXTURE_COUNT;
+}
+
+// Sums of the outer products of the (1, feature) vectors of the elements of every gaussian, upper
+// triangles as in CovarianceReductionKernel, for all gaussians in a single pass. The elements of
+// every batch element are summed in fixed size slabs in parallel, the slabs are added up in order.
+static void CovarianceReductionCPU(
+    const float* image,
+    const int* alpha,
+    double* matrices,
+    unsigned int batch_count,
+    unsigned int element_count) {
+  constexpr int matrix_size = GMM_COUNT * MATRIX_COMPONENT_COUNT;
+
+  int slab_count = TILE(element_count, GMM_CPU_SLAB_SIZE);
+
+  double* slab_matrices = new double[batch_count * slab_count * matrix_size];
+
+  at::parallel_for(0, batch_count * slab_count, 1, [&](int64_t start, int64_t end) {
+    for (int64_t task = start; task < end; task++) {
+      int batch_index = task / slab_count;
+      int slab_index = task % slab_count;
+
+      const float* batch_image = image + batch_index * element_count * CHANNEL_COUNT;
+      const int* batch_alpha = alpha + batch_index * element_count;
+      double* slab_matrix = slab_matrices + task * matrix_size;
+
+      std::fill(slab_matrix, slab_matrix + matrix_size, 0.0);
+
+      int element_start = slab_index * GMM_CPU_SLAB_SIZE;
+      int element_end = std::min<int>(element_count, element_start + GMM_CPU_SLAB_SIZE);
+
+      for (int element = element_start; element < element_end; element++) {
+        int gaussian_index = GMMGaussianIndex(batch_alpha[element]);
+
+        if (gaussian_index < 0 || gaussian_index >= GMM_COUNT) {
+          continue;
+        }
+
+        float feature[CHANNEL_COUNT + 1];
+
+        feature[0] = 1;
+
+        for (int i = 0; i < CHANNEL_COUNT; i++) {
+          feature[i + 1] = batch_image[element + i * element_count];
+        }
+
+        double* matrix = slab_matrix + gaussian_index * MATRIX_COMPONENT_COUNT;
+
+        for (int index = 0, i = 0; i < CHANNEL_COUNT + 1; i++) {
+          for (int j = i; j < CHANNEL_COUNT + 1; j++, index++) {
+            matrix[index] += feature[i] * feature[j];
+          }
+        }
+      }
+    }
+  });
+
+  for (unsigned int batch_index = 0; batch_index < batch_count; batch_index++) {
+    double* batch_matrices = matrices + batch_index * matrix_size;
+    const double* batch_slab_matrices = slab_matrices + batch_index * slab_count * matrix_size;
+
+    std::copy(batch_slab_matrices, batch_slab_matrices + matrix_size, batch_matrices);
+
+    for (int slab_index = 1; slab_index < slab_count; slab_index++) {
+      for (int i = 0; i < matrix_size; i++) {
+        batch_matrices[i] += batch_slab_matrices[slab_index * matrix_size + i];
+      }
+    }
+  }
+
+  delete[] slab_matrices;
+}
+
+// Element count, mean, covariance (or its inverse) and covariance determinant of the first
+// gmm_count gaussians, as in CovarianceFinalizationKernel.
+static void CovarianceFinalizationCPU(
+    const double* matrices,
+    float* gmm,
+    int gmm_count,
+    bool invert_matrix,
+    unsigned int batch_count) {
+  at::parallel_for(0, batch_count * gmm_count, 1, [&](int64_t start, int64_t end) {
+    for (int64_t task = start; task < end; task++) {
+      int batch_index = task / gmm_count;
+      int gmm_index = task % gmm_count;
+
+      const double* matrix_sums = matrices + (batch_index * GMM_COUNT + gmm_index) * MATRIX_COMPONENT_COUNT;
+      float* s_gmm = gmm + (batch_index * GMM_COUNT + gmm_index) * GMM_COMPONENT_COUNT;
+
+      float norm_factor = 1.0f;
+
+      for (int index = 0, i = 0; i < CHANNEL_COUNT + 1; i++) {
+        for (int j = i; j < CHANNEL_COUNT + 1; j++, index++) {
+          float matrix_component = matrix_sums[index];
+          float constant = i == 0 ? 0.0f : s_gmm[i] * s_gmm[j];
+
+          if (i != 0 && i == j) {
+            constant -= EPSILON;
+          }
+
+          s_gmm[index] = norm_factor * matrix_component - constant;
+
+          if (index == 0 && matrix_component > 0) {
+            norm_factor = 1.0f / matrix_component;
+          }
+        }
+      }
+
+      float* matrix = s_gmm + (CHANNEL_COUNT + 1);
+      float* det_ptr = s_gmm + MATRIX_COMPONENT_COUNT;
+
+      float square_mat[CHANNEL_COUNT][CHANNEL_COUNT];
+      float cholesky_mat[CHANNEL_COUNT][CHANNEL_COUNT];
+
+      for (int i = 0; i < CHANNEL_COUNT; i++) {
+        for (int j = 0; j < CHANNEL_COUNT; j++) {
+          square_mat[i][j] = 0.0f;
+          cholesky_mat[i][j] = 0.0f;
+        }
+      }
+
+      to_square(matrix, square_mat);
+      cholesky(square_mat, cholesky_mat);
+
+      *det_ptr = chol_det(cholesky_mat);
+
+      if (invert_matrix) {
+        chol_inv(cholesky_mat, square_mat);
+        to_triangle(square_mat, matrix);
+      }
+    }
+  });
+}
+
+// Picks, for every class, the component among its first gmmK ones with the largest covariance
+// eigenvalue, to be split along its eigenvector through its mean. Ties go to the lowest component.
+static void GMMFindSplitCPU(GMMSplit_t* gmmSplit, int gmmK, const float* gmm, unsigned int batch_count) {
+  for (unsigned int batch_index = 0; batch_index < batch_count; batch_index++) {
+    const float* batch_gmm = gmm + batch_index * GMM_COUNT * GMM_COMPONENT_COUNT;
+
+    for (int mixture_index = 0; mixture_index < MIXTURE_COUNT; mixture_index++) {
+      GMMSplit_t& split = gmmSplit[batch_index * MIXTURE_COUNT + mixture_index];
+
+      float max_value = -1.0f;
+
+      split.idx = -1;
+
+      for (int component_index = 0; component_index < gmmK; component_index++) {
+        const float* component = batch_gmm + (component_index * MIXTURE_COUNT + mixture_index) * GMM_COMPONENT_COUNT;
+
+        float eigenvalue = 0;
+        float eigenvector[CHANNEL_COUNT];
+
+        largest_eigenpair(component + (CHANNEL_COUNT + 1), eigenvector, &eigenvalue);
+
+        if (eigenvalue > max_value) {
+          float average_feature[CHANNEL_COUNT];
+
+          for (int i = 0; i < CHANNEL_COUNT; i++) {
+            average_feature[i] = component[i + 1];
+            split.eigenvector[i] = eigenvector[i];
+          }
+
+          max_value = eigenvalue;
+          split.idx = component_index;
+          split.threshold = scalar_prod(average_feature, eigenvector);
+        }
+      }
+    }
+  }
+}
+
+// Moves the elements of every split component beyond its threshold to the new component k of
+// their class (k given shifted into the component bits), as in GMMDoSplit.
+static void GMMDoSplitCPU(
+    const GMMSplit_t* gmmSplit,
+    int k,
+    const float* image,
+    int* alpha,
+    unsigned int batch_count,
+    unsigned int element_count) {
+  for (unsigned int batch_index = 0; batch_index < batch_count; batch_index++) {
+    const GMMSplit_t* batch_gmmSplit = gmmSplit + batch_index * MIXTURE_COUNT;
+    const float* batch_image = image + batch_index * element_count * CHANNEL_COUNT;
+    int* batch_alpha = alpha + batch_index * element_count;
+
+    at::parallel_for(0, element_count, GMM_CPU_SLAB_SIZE, [&](int64_t start, int64_t end) {
+      for (int64_t index = start; index < end; index++) {
+        int my_alpha = batch_alpha[index];
+
+        if (my_alpha == -1) {
+          continue;
+        }
+
+        int select = my_alpha & 15;
+        int gmm_idx = my_alpha >> 4;
+
+        if (select < MIXTURE_COUNT && gmm_idx == batch_gmmSplit[select].idx) {
+          // in the split cluster now
+          float feature[CHANNEL_COUNT];
+          float eigenvector[CHANNEL_COUNT];
+
+          for (int i = 0; i < CHANNEL_COUNT; i++) {
+            feature[i] = batch_image[index + i * element_count];
+            eigenvector[i] = batch_gmmSplit[select].eigenvector[i];
+          }
+
+          float value = scalar_prod(eigenvector, feature);
+
+          if (value > batch_gmmSplit[select].threshold) {
+            // assign pixel to new cluster
+            batch_alpha[index] = k + select;
+          }
+        }
+      }
+    });
+  }
+}
+
+// Replaces the determinant of every component by its weight within its class over the square
+// root of the determinant, as in GMMcommonTerm.
+static void GMMcommonTermCPU(float* gmm, unsigned int batch_count) {
+  for (unsigned int batch_index = 0; batch_index < batch_count; batch_index++) {
+    float* batch_gmm = gmm + batch_index * GMM_COUNT * GMM_COMPONENT_COUNT;
+
+    for (int mixture_index = 0; mixture_index < MIXTURE_COUNT; mixture_index++) {
+      float sum = 0.0f;
+
+      for (int component_index = 0; component_index < MIXTURE_SIZE; component_index++) {
+        sum += batch_gmm[(component_index * MIXTURE_COUNT + mixture_index) * GMM_COMPONENT_COUNT];
+      }
+
+      for (int component_index = 0; component_index < MIXTURE_SIZE; component_index++) {
+        float* component = batch_gmm + (component_index * MIXTURE_COUNT + mixture_index) * GMM_COMPONENT_COUNT;
+
+        float gmm_n = component[0];
+        float det = component[MATRIX_COMPONENT_COUNT] + EPSILON;
+
+        component[MATRIX_COMPONENT_COUNT] = det > 0.0f ? gmm_n / (std::sqrt(det) * sum) : gmm_n / sum;
+      }
+    }
+  }
+}
+
 void learn_cpu(
     const float* input,
     const int* labels,
@@ -22,14 +293,196 @@ void learn_cpu(
     float* scratch_memory,
     unsigned int batch_count,
     unsigned int element_count) {
-  throw std::invalid_argument("GMM received a cpu tensor but is not yet implemented for the cpu");
+  int* alpha = (int*)scratch_memory;
+
+  std::memcpy(alpha, labels, batch_count * element_count * sizeof(int));
+
+  double* matrices = new double[batch_count * GMM_COUNT * MATRIX_COMPONENT_COUNT];
+  GMMSplit_t* gmm_split = new GMMSplit_t[batch_count * MIXTURE_COUNT];
+
+  // Splits one component of every class at a time until every class has MIXTURE_SIZE components.
+  for (int k = MIXTURE_COUNT; k < GMM_COUNT; k += MIXTURE_COUNT) {
+    CovarianceReductionCPU(input, alpha, matrices, batch_count, element_count);
+    CovarianceFinalizationCPU(matrices, gmm, k, false, batch_count);
+
+    GMMFindSplitCPU(gmm_split, k / MIXTURE_COUNT, gmm, batch_count);
+    GMMDoSplitCPU(gmm_split, (k / MIXTURE_COUNT) << 4, input, alpha, batch_count, element_count);
+  }
+
+  CovarianceReductionCPU(input, alpha, matrices, batch_count, element_count);
+  CovarianceFinalizationCPU(matrices, gmm, GMM_COUNT, true, batch_count);
+
+  GMMcommonTermCPU(gmm, batch_count);
+
+  delete[] matrices;
+  delete[] gmm_split;
 }
 
+// Component of apply_cpu, the learned parameters rearranged for the data term.
+struct GMMApplyComponent_t {
+  float mean[CHANNEL_COUNT];
+  // Upper triangle of -0.5 times the inverse covariance, off-diagonal entries doubled.
+  float quadratic[SUB_MATRIX_COMPONENT_COUNT];
+  // log of the common term, log(weight) - 0.5 * log(determinant).
+  float log_weight;
+  int mixture;
+};
+
+// Float bits mapped to integers that order like the floats, an involution. Integer selects
+// vectorise where float comparisons may not.
+static inline int GMMOrderedBits(float x) {
+  int i = GMMFloatBits(x);
+  return i ^ ((i >> 31) & 0x7fffffff);
+}
+
+static inline float GMMOrderedFloat(int i) {
+  return GMMBitsFloat(i ^ ((i >> 31) & 0x7fffffff));
+}
+
+// Same output as GMMDataTermKernel: the share of every mixture in the summed component terms of
+// each element. The terms are evaluated in the log domain for GMM_CPU_APPLY_WIDTH elements at a
+// time and normalised by a log-sum-exp over all components, so elements far from every component
+// keep their proportions where the float terms would all underflow (the CUDA kernel writes 0
+// there). Components with a zero common term contribute nothing and are skipped.
 void apply_cpu(
     const float* gmm,
     const float* input,
     float* output,
     unsigned int batch_count,
     unsigned int element_count) {
-  throw std::invalid_argument("GMM received a cpu tensor but is not yet implemented for the cpu");
+  GMMApplyComponent_t* components = new GMMApplyComponent_t[batch_count * GMM_COUNT];
+  int* component_counts = new int[batch_count];
+
+  for (unsigned int batch_index = 0; batch_index < batch_count; batch_index++) {
+    const float* batch_gmm = gmm + batch_index * GMM_COUNT * GMM_COMPONENT_COUNT;
+    GMMApplyComponent_t* batch_components = components + batch_index * GMM_COUNT;
+
+    int component_count = 0;
+
+    for (int gmm_index = 0; gmm_index < GMM_COUNT; gmm_index++) {
+      const float* component_gmm = batch_gmm + gmm_index * GMM_COMPONENT_COUNT;
+      float common_term = component_gmm[MATRIX_COMPONENT_COUNT];
+
+      if (!(common_term > 0.0f)) {
+        continue;
+      }
+
+      GMMApplyComponent_t& component = batch_components[component_count++];
+
+      for (int i = 0; i < CHANNEL_COUNT; i++) {
+        component.mean[i] = component_gmm[i + 1];
+      }
+
+      for (int index = 0, i = 0; i < CHANNEL_COUNT; i++) {
+        for (int j = i; j < CHANNEL_COUNT; j++, index++) {
+          float term = component_gmm[CHANNEL_COUNT + 1 + index];
+          component.quadratic[index] = i == j ? -0.5f * term : -term;
+        }
+      }
+
+      component.log_weight = std::log(common_term);
+      component.mixture = gmm_index % MIXTURE_COUNT;
+    }
+
+    component_counts[batch_index] = component_count;
+  }
+
+  unsigned int block_count = TILE(element_count, GMM_CPU_APPLY_WIDTH);
+
+  at::parallel_for(0, batch_count * block_count, 1, [&](int64_t start, int64_t end) {
+    for (int64_t task = start; task < end; task++) {
+      int batch_index = task / block_count;
+      int element_start = (task % block_count) * GMM_CPU_APPLY_WIDTH;
+      int lane_count = std::min<int>(GMM_CPU_APPLY_WIDTH, element_count - element_start);
+
+      const float* batch_image = input + batch_index * element_count * CHANNEL_COUNT + element_start;
+      float* batch_output = output + batch_index * element_count * MIXTURE_COUNT + element_start;
+      const GMMApplyComponent_t* batch_components = components + batch_index * GMM_COUNT;
+      int component_count = component_counts[batch_index];
+
+      if (component_count == 0) {
+        // protecting against pixels with 0 in all mixtures
+        for (int i = 0; i < MIXTURE_COUNT; i++) {
+          std::fill(batch_output + i * element_count, batch_output + i * element_count + lane_count, 0.0f);
+        }
+
+        continue;
+      }
+
+      float feature[CHANNEL_COUNT][GMM_CPU_APPLY_WIDTH];
+
+      for (int i = 0; i < CHANNEL_COUNT; i++) {
+        for (int l = 0; l < GMM_CPU_APPLY_WIDTH; l++) {
+          feature[i][l] = l < lane_count ? batch_image[l + i * element_count] : 0.0f;
+        }
+      }
+
+      float log_terms[GMM_COUNT][GMM_CPU_APPLY_WIDTH];
+      int max_bits[GMM_CPU_APPLY_WIDTH];
+
+      for (int l = 0; l < GMM_CPU_APPLY_WIDTH; l++) {
+        max_bits[l] = GMMOrderedBits(-INFINITY);
+      }
+
+      for (int k = 0; k < component_count; k++) {
+        const GMMApplyComponent_t& component = batch_components[k];
+
+        float diff[CHANNEL_COUNT][GMM_CPU_APPLY_WIDTH];
+        float* value = log_terms[k];
+
+        for (int i = 0; i < CHANNEL_COUNT; i++) {
+#pragma omp simd
+          for (int l = 0; l < GMM_CPU_APPLY_WIDTH; l++) {
+            diff[i][l] = feature[i][l] - component.mean[i];
+          }
+        }
+
+        for (int l = 0; l < GMM_CPU_APPLY_WIDTH; l++) {
+          value[l] = component.log_weight;
+        }
+
+        for (int index = 0, i = 0; i < CHANNEL_COUNT; i++) {
+          for (int j = i; j < CHANNEL_COUNT; j++, index++) {
+            float quadratic = component.quadratic[index];
+
+#pragma omp simd
+            for (int l = 0; l < GMM_CPU_APPLY_WIDTH; l++) {
+              value[l] += quadratic * diff[i][l] * diff[j][l];
+            }
+          }
+        }
+
+#pragma omp simd
+        for (int l = 0; l < GMM_CPU_APPLY_WIDTH; l++) {
+          int bits = GMMOrderedBits(value[l]);
+          max_bits[l] = bits > max_bits[l] ? bits : max_bits[l];
+        }
+      }
+
+      // Fused log-sum-exp: every term relative to the largest one of its element.
+      float weights[MIXTURE_COUNT][GMM_CPU_APPLY_WIDTH] = {};
+      float weight_total[GMM_CPU_APPLY_WIDTH] = {};
+
+      for (int k = 0; k < component_count; k++) {
+        float* mixture_weights = weights[batch_components[k].mixture];
+
+#pragma omp simd
+        for (int l = 0; l < GMM_CPU_APPLY_WIDTH; l++) {
+          float term = GMMExpNegative(GMMOrderedFloat(max_bits[l]) - log_terms[k][l]);
+
+          mixture_weights[l] += term;
+          weight_total[l] += term;
+        }
+      }
+
+      for (int i = 0; i < MIXTURE_COUNT; i++) {
+        for (int l = 0; l < lane_count; l++) {
+          batch_output[l + i * element_count] = weights[i][l] / weight_total[l];
+        }
+      }
+    }
+  });
+
+  delete[] components;
+  delete[] component_counts;
 }
@@ -16,7 +16,7 @@ limitations under the License.
 
 #include "gmm.h"
 
-#include "gmm_cuda_linalg.cuh"
+#include "gmm_linalg.h"
 
 #define EPSILON 1e-5
 #define BLOCK_SIZE 32
@@ -11,7 +11,18 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
-__device__ void to_square(float in[SUB_MATRIX_COMPONENT_COUNT], float out[CHANNEL_COUNT][CHANNEL_COUNT]) {
+#pragma once
+
+#include <math.h>
+
+// Small matrix helpers shared by the CPU and CUDA GMM implementations.
+#ifdef __CUDACC__
+#define GMM_HOST_DEVICE static inline __host__ __device__
+#else
+#define GMM_HOST_DEVICE static inline
+#endif
+
+GMM_HOST_DEVICE void to_square(float in[SUB_MATRIX_COMPONENT_COUNT], float out[CHANNEL_COUNT][CHANNEL_COUNT]) {
   for (int index = 0, i = 0; i < CHANNEL_COUNT; i++) {
     for (int j = i; j < CHANNEL_COUNT; j++, index++) {
       out[i][j] = in[index];
@@ -20,7 +31,7 @@ __device__ void to_square(float in[SUB_MATRIX_COMPONENT_COUNT], float out[CHANNE
   }
 }
 
-__device__ void to_triangle(float in[CHANNEL_COUNT][CHANNEL_COUNT], float out[SUB_MATRIX_COMPONENT_COUNT]) {
+GMM_HOST_DEVICE void to_triangle(float in[CHANNEL_COUNT][CHANNEL_COUNT], float out[SUB_MATRIX_COMPONENT_COUNT]) {
   for (int index = 0, i = 0; i < CHANNEL_COUNT; i++) {
     for (int j = i; j < CHANNEL_COUNT; j++, index++) {
       out[index] = in[j][i];
@@ -28,7 +39,7 @@ __device__ void to_triangle(float in[CHANNEL_COUNT][CHANNEL_COUNT], float out[SU
   }
 }
 
-__device__ void cholesky(float in[CHANNEL_COUNT][CHANNEL_COUNT], float out[CHANNEL_COUNT][CHANNEL_COUNT]) {
+GMM_HOST_DEVICE void cholesky(float in[CHANNEL_COUNT][CHANNEL_COUNT], float out[CHANNEL_COUNT][CHANNEL_COUNT]) {
   for (int i = 0; i < CHANNEL_COUNT; i++) {
     for (int j = 0; j < i + 1; j++) {
       float sum = 0.0f;
@@ -46,7 +57,7 @@ __device__ void cholesky(float in[CHANNEL_COUNT][CHANNEL_COUNT], float out[CHANN
   }
 }
 
-__device__ float chol_det(float in[CHANNEL_COUNT][CHANNEL_COUNT]) {
+GMM_HOST_DEVICE float chol_det(float in[CHANNEL_COUNT][CHANNEL_COUNT]) {
   float det = 1.0f;
 
   for (int i = 0; i < CHANNEL_COUNT; i++) {
@@ -56,7 +67,7 @@ __device__ float chol_det(float in[CHANNEL_COUNT][CHANNEL_COUNT]) {
   return det * det;
 }
 
-__device__ void chol_inv(float in[CHANNEL_COUNT][CHANNEL_COUNT], float out[CHANNEL_COUNT][CHANNEL_COUNT]) {
+GMM_HOST_DEVICE void chol_inv(float in[CHANNEL_COUNT][CHANNEL_COUNT], float out[CHANNEL_COUNT][CHANNEL_COUNT]) {
   // Invert cholesky matrix
   for (int i = 0; i < CHANNEL_COUNT; i++) {
     in[i][i] = 1.0f / (in[i][i] + 0.0001f);
@@ -77,14 +88,14 @@ __device__ void chol_inv(float in[CHANNEL_COUNT][CHANNEL_COUNT], float out[CHANN
     for (int j = 0; j < CHANNEL_COUNT; j++) {
       out[i][j] = 0.0f;
 
-      for (int k = max(i, j); k < CHANNEL_COUNT; k++) {
+      for (int k = i > j ? i : j; k < CHANNEL_COUNT; k++) {
         out[i][j] += in[k][i] * in[k][j];
       }
     }
   }
 }
 
-__device__ void normalize(float* v) {
+GMM_HOST_DEVICE void normalize(float* v) {
   float norm = 0.0f;
 
   for (int i = 0; i < CHANNEL_COUNT; i++) {
@@ -98,7 +109,7 @@ __device__ void normalize(float* v) {
   }
 }
 
-__device__ float scalar_prod(float* a, float* b) {
+GMM_HOST_DEVICE float scalar_prod(float* a, float* b) {
   float product = 0.0f;
 
   for (int i = 0; i < CHANNEL_COUNT; i++) {
@@ -108,7 +119,7 @@ __device__ float scalar_prod(float* a, float* b) {
   return product;
 }
 
-__device__ void largest_eigenpair(const float* M, float* evec, float* eval) {
+GMM_HOST_DEVICE void largest_eigenpair(const float* M, float* evec, float* eval) {
   float scratch[CHANNEL_COUNT];
 
   for (int i = 0; i < CHANNEL_COUNT; i++) {
@@ -133,7 +144,7 @@ __device__ void largest_eigenpair(const float* M, float* evec, float* eval) {
         }
       }
 
-      *eval = max(*eval, evec[i]);
+      *eval = fmaxf(*eval, evec[i]);
     }
 
     for (int i = 0; i < CHANNEL_COUNT; i++) {
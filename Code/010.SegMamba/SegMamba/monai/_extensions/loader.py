@@ -79,6 +79,8 @@ def load_module(
 
     # Constructing compilation argument list.
     define_args = [] if not defines else [f"-D {key}={defines[key]}" for key in defines]
+    if torch.cuda.is_available():
+        define_args.append("-D WITH_CUDA")
 
     # Ninja may be blocked by something out of our control.
     # This will error if the build takes longer than expected.
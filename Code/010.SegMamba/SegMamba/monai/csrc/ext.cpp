@@ -20,16 +20,53 @@ limitations under the License.
 
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
   // filtering
-  m.def("bilateral_filter", &BilateralFilter, "Bilateral Filter");
+  py::enum_<BilateralFilterAlgorithm>(m, "BilateralFilterAlgorithm")
+      .value("exact", BilateralFilterAlgorithm::Exact)
+      .value("phl", BilateralFilterAlgorithm::Permutohedral)
+      .value("grid", BilateralFilterAlgorithm::Grid)
+      .value("auto", BilateralFilterAlgorithm::Auto);
+  m.def(
+      "bilateral_filter",
+      static_cast<torch::Tensor (*)(torch::Tensor, float, float, BilateralFilterAlgorithm)>(&BilateralFilter),
+      "Bilateral Filter");
+  m.def(
+      "bilateral_filter",
+      static_cast<torch::Tensor (*)(torch::Tensor, float, float, bool)>(&BilateralFilter),
+      "Bilateral Filter");
+  m.def("bilateral_filter_cost", &BilateralFilterCost, "Bilateral Filter Estimated Cost");
+  m.def("bilateral_filter_select_algorithm", &SelectBilateralFilterAlgorithm, "Bilateral Filter Select Algorithm");
+  m.def("get_bilateral_filter_cost_model", &GetBilateralFilterCostModel, "Get Bilateral Filter Cost Model");
+  m.def("set_bilateral_filter_cost_model", &SetBilateralFilterCostModel, "Set Bilateral Filter Cost Model");
+  m.def(
+      "calibrate_bilateral_filter_cost_model",
+      &CalibrateBilateralFilterCostModel,
+      "Calibrate Bilateral Filter Cost Model");
   m.def("phl_filter", &PermutohedralFilter, "Permutohedral Filter");
+  m.def("phl_filter_backward", &PermutohedralFilterBackward, "Permutohedral Filter Backward");
+  m.def("set_phl_compact_replay", &SetPermutohedralCompactReplay, "Set Permutohedral Lattice Compact Replay");
+  m.def("get_phl_compact_replay", &GetPermutohedralCompactReplay, "Get Permutohedral Lattice Compact Replay");
+  py::class_<PermutohedralLatticeHandle>(m, "PermutohedralLattice")
+      .def(py::init<torch::Tensor>(), "Build Permutohedral Lattice From Features")
+      .def("filter", &PermutohedralLatticeHandle::filter, "Permutohedral Lattice Filter");
+  m.def("dense_crf", &DenseCrf, "Dense CRF");
   m.def("tbf_forward", &TrainableBilateralFilterForward, "Trainable Bilateral Filter Forward");
   m.def("tbf_backward", &TrainableBilateralFilterBackward, "Trainable Bilateral Filter Backward");
+  m.def("tbf_inference", &TrainableBilateralFilterInference, "Trainable Bilateral Filter Inference");
   m.def("tjbf_forward", &TrainableJointBilateralFilterForward, "Trainable Joint Bilateral Filter Forward");
   m.def("tjbf_backward", &TrainableJointBilateralFilterBackward, "Trainable Joint Bilateral Filter Backward");
+  m.def("tjbf_inference", &TrainableJointBilateralFilterInference, "Trainable Joint Bilateral Filter Inference");
+  m.def(
+      "tjbf_multichannel_inference",
+      &TrainableJointBilateralFilterMultiChannelInference,
+      "Trainable Joint Bilateral Filter Multi-Channel Inference");
+  m.def("set_range_lut_max_error", &SetRangeKernelLutMaxError, "Set Bilateral Range Kernel Lookup Table Max Error");
+  m.def("get_range_lut_max_error", &GetRangeKernelLutMaxError, "Get Bilateral Range Kernel Lookup Table Max Error");
 
   // lltm
   m.def("lltm_forward", &lltm_forward, "LLTM forward");
   m.def("lltm_backward", &lltm_backward, "LLTM backward");
+  m.def("lltm_sequence_forward", &lltm_sequence_forward, "LLTM sequence forward");
+  m.def("lltm_sequence_backward", &lltm_sequence_backward, "LLTM sequence backward");
 
   // resample bound mode
   py::enum_<monai::BoundType>(m, "BoundType")
@@ -18,8 +18,29 @@ limitations under the License.
 #include "bilateral.h"
 #include "utils/common_utils.h"
 
-torch::Tensor BilateralFilter(torch::Tensor input, float spatial_sigma, float color_sigma, bool usePHL) {
-  torch::Tensor (*filterFunction)(torch::Tensor, float, float);
+typedef torch::Tensor (*BilateralFilterFunction)(torch::Tensor, float, float);
+
+static BilateralFilterFunction BilateralFilterCpuFunction(BilateralFilterAlgorithm algorithm) {
+  switch (algorithm) {
+    case BilateralFilterAlgorithm::Permutohedral:
+      return &BilateralFilterPHLCpu;
+    case BilateralFilterAlgorithm::Grid:
+      return &BilateralFilterGridCpu;
+    default:
+      return &BilateralFilterCpu;
+  }
+}
+
+torch::Tensor BilateralFilter(
+    torch::Tensor input,
+    float spatial_sigma,
+    float color_sigma,
+    BilateralFilterAlgorithm algorithm) {
+  BilateralFilterFunction filterFunction;
+
+  if (algorithm == BilateralFilterAlgorithm::Auto) {
+    algorithm = SelectBilateralFilterAlgorithm(input, spatial_sigma, color_sigma);
+  }
 
 #ifdef WITH_CUDA
 
@@ -37,13 +58,30 @@ torch::Tensor BilateralFilter(torch::Tensor input, float spatial_sigma, float co
           std::to_string(BF_CUDA_MAX_SPATIAL_DIMENSION));
     }
 
-    filterFunction = usePHL ? &BilateralFilterPHLCuda : &BilateralFilterCuda;
+    switch (algorithm) {
+      case BilateralFilterAlgorithm::Exact:
+        filterFunction = &BilateralFilterCuda;
+        break;
+      case BilateralFilterAlgorithm::Permutohedral:
+        filterFunction = &BilateralFilterPHLCuda;
+        break;
+      default:
+        throw std::runtime_error("Bilateral grid filtering not implemented for CUDA tensors");
+    }
   } else {
-    filterFunction = usePHL ? &BilateralFilterPHLCpu : &BilateralFilterCpu;
+    filterFunction = BilateralFilterCpuFunction(algorithm);
   }
 #else
-  filterFunction = usePHL ? &BilateralFilterPHLCpu : &BilateralFilterCpu;
+  filterFunction = BilateralFilterCpuFunction(algorithm);
 #endif
 
   return filterFunction(input, spatial_sigma, color_sigma);
 }
+
+torch::Tensor BilateralFilter(torch::Tensor input, float spatial_sigma, float color_sigma, bool usePHL) {
+  return BilateralFilter(
+      input,
+      spatial_sigma,
+      color_sigma,
+      usePHL ? BilateralFilterAlgorithm::Permutohedral : BilateralFilterAlgorithm::Exact);
+}
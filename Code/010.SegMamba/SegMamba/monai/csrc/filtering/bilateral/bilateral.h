@@ -14,16 +14,47 @@ limitations under the License.
 #pragma once
 
 #include <torch/extension.h>
+#include <vector>
 
 #define BF_CUDA_MAX_CHANNELS 16
 #define BF_CUDA_MAX_SPATIAL_DIMENSION 3
 
+// Number of consecutive home elements the CPU filter processes in SIMD lanes.
+#define BF_CPU_VECTOR_WIDTH 16
+
+// The bilateral grid has one axis per spatial dimension and one per channel.
+#define BF_GRID_MAX_DIMENSION 6
+
+// Number of constants of the CPU cost model, an overhead and a cost per unit of work per algorithm.
+#define BF_COST_MODEL_SIZE 6
+
+// Algorithms available to BilateralFilter. Auto selects the algorithm with the lowest
+// estimated cost (see bilateralfilter_cost_model.cpp).
+enum class BilateralFilterAlgorithm { Exact, Permutohedral, Grid, Auto };
+
 torch::Tensor BilateralFilterCpu(torch::Tensor input, float spatial_sigma, float color_sigma);
 torch::Tensor BilateralFilterPHLCpu(torch::Tensor input, float spatial_sigma, float color_sigma);
+torch::Tensor BilateralFilterGridCpu(torch::Tensor input, float spatial_sigma, float color_sigma);
 
 #ifdef WITH_CUDA
 torch::Tensor BilateralFilterCuda(torch::Tensor input, float spatial_sigma, float color_sigma);
 torch::Tensor BilateralFilterPHLCuda(torch::Tensor input, float spatial_sigma, float color_sigma);
 #endif
 
+std::vector<double> GetBilateralFilterCostModel();
+void SetBilateralFilterCostModel(std::vector<double> constants);
+std::vector<double> CalibrateBilateralFilterCostModel();
+
+double BilateralFilterCost(
+    torch::Tensor input,
+    float spatial_sigma,
+    float color_sigma,
+    BilateralFilterAlgorithm algorithm);
+BilateralFilterAlgorithm SelectBilateralFilterAlgorithm(torch::Tensor input, float spatial_sigma, float color_sigma);
+
 torch::Tensor BilateralFilter(torch::Tensor input, float spatial_sigma, float color_sigma, bool usePHL);
+torch::Tensor BilateralFilter(
+    torch::Tensor input,
+    float spatial_sigma,
+    float color_sigma,
+    BilateralFilterAlgorithm algorithm);
@@ -0,0 +1,193 @@
+/*
+Copyright (c) MONAI Consortium
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <math.h>
+#include <torch/extension.h>
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "bilateral.h"
+
+// Cost model used by BilateralFilterAlgorithm::Auto. The runtime of each CPU algorithm is
+// modelled as overhead + perWork * work, in seconds, where work counts the inner loop
+// iterations of the algorithm:
+//   exact:         elements * window^dimensions * (channels + 1)
+//   permutohedral: elements * (dimensions + channels + 1)^2 * (channels + 1)
+//   grid:          (elements * 2^gridDimensions + gridCells * gridDimensions * blurTaps) * (channels + 1)
+// The constants below were measured with CalibrateBilateralFilterCostModel on a single core.
+// CUDA inputs are ranked with the same CPU constants and never select the grid.
+static double bilateralFilterCostModel[BF_COST_MODEL_SIZE] = {
+    // exact: overhead, perWork
+    2.0e-4,
+    3.3e-9,
+    // permutohedral: overhead, perWork
+    2.3e-4,
+    2.0e-8,
+    // grid: overhead, perWork
+    5.0e-5,
+    3.3e-9,
+};
+
+std::vector<double> GetBilateralFilterCostModel() {
+  return std::vector<double>(bilateralFilterCostModel, bilateralFilterCostModel + BF_COST_MODEL_SIZE);
+}
+
+void SetBilateralFilterCostModel(std::vector<double> constants) {
+  if (constants.size() != BF_COST_MODEL_SIZE) {
+    throw std::runtime_error(
+        "Bilateral filter cost model expects " + std::to_string(BF_COST_MODEL_SIZE) + " constants, got " +
+        std::to_string(constants.size()));
+  }
+
+  std::copy(constants.begin(), constants.end(), bilateralFilterCostModel);
+}
+
+// Work estimate of an algorithm, see above. Returns infinity for algorithms that cannot run the input.
+static double BilateralFilterWork(
+    torch::Tensor input,
+    float spatialSigma,
+    float colorSigma,
+    BilateralFilterAlgorithm algorithm) {
+  int dimensions = input.dim() - 2;
+  int channelCount = input.size(1);
+  double elementCount = input.numel() / channelCount;
+
+  // Only the exact filter handles half and bfloat16 tensors, the approximations are never selected for them.
+  bool reducedPrecision = input.scalar_type() != torch::kFloat && input.scalar_type() != torch::kDouble;
+
+  if (reducedPrecision && algorithm != BilateralFilterAlgorithm::Exact) {
+    return std::numeric_limits<double>::infinity();
+  }
+
+  switch (algorithm) {
+    case BilateralFilterAlgorithm::Exact: {
+      int windowSize = (int)ceil(5.0f * spatialSigma) | 1;
+      return elementCount * pow(windowSize, dimensions) * (channelCount + 1);
+    }
+    case BilateralFilterAlgorithm::Permutohedral: {
+      int featureChannels = dimensions + channelCount;
+      return elementCount * (featureChannels + 1) * (featureChannels + 1) * (channelCount + 1);
+    }
+    case BilateralFilterAlgorithm::Grid: {
+      int gridDimensions = dimensions + channelCount;
+
+      if (input.is_cuda() || gridDimensions > BF_GRID_MAX_DIMENSION) {
+        return std::numeric_limits<double>::infinity();
+      }
+
+      // Upper bound of the grid, the range extent of every channel is taken as the range of the whole input.
+      float colorRange = (input.max() - input.min()).item<float>();
+      double gridCells = 1;
+
+      for (int d = 0; d < dimensions; d++) {
+        gridCells *= (int)((input.size(d + 2) - 1) / spatialSigma) + 2;
+      }
+
+      for (int c = 0; c < channelCount; c++) {
+        gridCells *= (int)(colorRange / colorSigma) + 2;
+      }
+
+      if (gridCells * (channelCount + 1) > std::numeric_limits<int>::max()) {
+        return std::numeric_limits<double>::infinity();
+      }
+
+      return (elementCount * (1 << gridDimensions) + input.size(0) * gridCells * gridDimensions * 5) *
+          (channelCount + 1);
+    }
+    default:
+      throw std::runtime_error("Bilateral filter cost is only defined for concrete algorithms");
+  }
+}
+
+double BilateralFilterCost(
+    torch::Tensor input,
+    float spatial_sigma,
+    float color_sigma,
+    BilateralFilterAlgorithm algorithm) {
+  const double* constants = bilateralFilterCostModel + 2 * (int)algorithm;
+  return constants[0] + constants[1] * BilateralFilterWork(input, spatial_sigma, color_sigma, algorithm);
+}
+
+BilateralFilterAlgorithm SelectBilateralFilterAlgorithm(torch::Tensor input, float spatial_sigma, float color_sigma) {
+  BilateralFilterAlgorithm candidates[] = {
+      BilateralFilterAlgorithm::Exact, BilateralFilterAlgorithm::Permutohedral, BilateralFilterAlgorithm::Grid};
+
+  BilateralFilterAlgorithm selected = BilateralFilterAlgorithm::Exact;
+  double selectedCost = std::numeric_limits<double>::infinity();
+
+  for (BilateralFilterAlgorithm candidate : candidates) {
+    double cost = BilateralFilterCost(input, spatial_sigma, color_sigma, candidate);
+
+    if (cost < selectedCost) {
+      selected = candidate;
+      selectedCost = cost;
+    }
+  }
+
+  return selected;
+}
+
+// Fastest of a few runs of an algorithm on the CPU, in seconds.
+static double BilateralFilterTime(
+    torch::Tensor input,
+    float spatialSigma,
+    float colorSigma,
+    BilateralFilterAlgorithm algorithm) {
+  double best = std::numeric_limits<double>::infinity();
+
+  for (int run = 0; run < 3; run++) {
+    auto start = std::chrono::steady_clock::now();
+    BilateralFilter(input, spatialSigma, colorSigma, algorithm);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    best = std::min(best, elapsed.count());
+  }
+
+  return best;
+}
+
+// Micro-benchmark fitting the cost model to the current machine. Each algorithm is timed on
+// a tiny volume, which is dominated by the fixed overhead, and a larger one. The slope between
+// them gives the cost per unit of work and the intercept the overhead.
+std::vector<double> CalibrateBilateralFilterCostModel() {
+  torch::Tensor smallInput = torch::rand({1, 1, 4, 4, 4});
+  torch::Tensor largeInput = torch::rand({1, 1, 32, 32, 32});
+  float spatialSigma = 1.5f;
+  float colorSigma = 0.2f;
+
+  BilateralFilterAlgorithm algorithms[] = {
+      BilateralFilterAlgorithm::Exact, BilateralFilterAlgorithm::Permutohedral, BilateralFilterAlgorithm::Grid};
+
+  for (BilateralFilterAlgorithm algorithm : algorithms) {
+    double smallWork = BilateralFilterWork(smallInput, spatialSigma, colorSigma, algorithm);
+    double largeWork = BilateralFilterWork(largeInput, spatialSigma, colorSigma, algorithm);
+    double smallTime = BilateralFilterTime(smallInput, spatialSigma, colorSigma, algorithm);
+    double largeTime = BilateralFilterTime(largeInput, spatialSigma, colorSigma, algorithm);
+
+    double perWork = (largeTime - smallTime) / (largeWork - smallWork);
+
+    // Timing noise can make the small run look slower, fall back to a proportional model.
+    if (!(perWork > 0)) {
+      perWork = largeTime / largeWork;
+    }
+
+    double* constants = bilateralFilterCostModel + 2 * (int)algorithm;
+    constants[0] = std::max(0.0, smallTime - perWork * smallWork);
+    constants[1] = perWork;
+  }
+
+  return GetBilateralFilterCostModel();
+}
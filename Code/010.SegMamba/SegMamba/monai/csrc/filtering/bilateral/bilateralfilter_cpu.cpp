@@ -11,17 +11,26 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
+#include <ATen/AccumulateType.h>
 #include <math.h>
 #include <torch/extension.h>
+#include <algorithm>
 
+#include "bilateral.h"
+#include "utils/fast_exp.h"
+#include "utils/range_kernel_lut.h"
 #include "utils/tensor_description.h"
 #include "utils/tensor_indexing.h"
 
 template <typename scalar_t>
-void BilateralFilterCpu(torch::Tensor inputTensor, torch::Tensor outputTensor, float spatialSigma, float colorSigma) {
+void BilateralFilterCpuGeneric(torch::Tensor inputTensor, torch::Tensor outputTensor, float spatialSigma, float colorSigma) {
   // Getting tensor description.
   TensorDescription desc = TensorDescription(inputTensor);
 
+  // Values are stored as scalar_t (possibly half or bfloat16) and accumulated as accscalar_t. The
+  // CUDA accumulation types are used as they keep float sums in float (the CPU ones use double).
+  using accscalar_t = at::acc_type<scalar_t, true>;
+
   // Raw tensor data pointers.
   scalar_t* inputTensorData = inputTensor.data_ptr<scalar_t>();
   scalar_t* outputTensorData = outputTensor.data_ptr<scalar_t>();
@@ -29,8 +38,9 @@ void BilateralFilterCpu(torch::Tensor inputTensor, torch::Tensor outputTensor, f
   // Pre-calculate common values
   int windowSize = (int)ceil(5.0f * spatialSigma) | 1; // ORing last bit to ensure odd window size
   int halfWindowSize = floor(0.5f * windowSize);
-  scalar_t spatialExpConstant = -1.0f / (2 * spatialSigma * spatialSigma);
-  scalar_t colorExpConstant = -1.0f / (2 * colorSigma * colorSigma);
+  accscalar_t spatialExpConstant = -1.0f / (2 * spatialSigma * spatialSigma);
+  accscalar_t colorExpConstant = -1.0f / (2 * colorSigma * colorSigma);
+  RangeKernelLut<accscalar_t> rangeKernel(colorExpConstant, GetRangeKernelLutMaxError());
 
   // Kernel sizes.
   int* kernelSizes = new int[desc.dimensions];
@@ -40,7 +50,7 @@ void BilateralFilterCpu(torch::Tensor inputTensor, torch::Tensor outputTensor, f
   }
 
   // Pre-calculate gaussian kernel in 1D.
-  scalar_t* gaussianKernel = new scalar_t[windowSize];
+  accscalar_t* gaussianKernel = new accscalar_t[windowSize];
 
   for (int i = 0; i < windowSize; i++) {
     int distance = i - halfWindowSize;
@@ -49,8 +59,8 @@ void BilateralFilterCpu(torch::Tensor inputTensor, torch::Tensor outputTensor, f
 
   // Kernel aggregates used to calculate
   // the output value.
-  scalar_t* valueSum = new scalar_t[desc.channelCount];
-  scalar_t weightSum = 0;
+  accscalar_t* valueSum = new accscalar_t[desc.channelCount];
+  accscalar_t weightSum = 0;
 
   // Looping over the batches
   for (int b = 0; b < desc.batchCount; b++) {
@@ -89,24 +99,24 @@ void BilateralFilterCpu(torch::Tensor inputTensor, torch::Tensor outputTensor, f
         }
 
         // Euclidean color distance.
-        scalar_t colorDistanceSquared = 0;
+        accscalar_t colorDistanceSquared = 0;
 
         for (int i = 0; i < desc.channelCount; i++) {
-          scalar_t diff = inputTensorData[homeOffset + i * desc.channelStride] -
+          accscalar_t diff = static_cast<accscalar_t>(inputTensorData[homeOffset + i * desc.channelStride]) -
               inputTensorData[neighbourOffset + i * desc.channelStride];
           colorDistanceSquared += diff * diff;
         }
 
         // Calculating and combining the spatial
         // and color weights.
-        scalar_t spatialWeight = 1;
+        accscalar_t spatialWeight = 1;
 
         for (int i = 0; i < desc.dimensions; i++) {
           spatialWeight *= gaussianKernel[kernelIndex[i]];
         }
 
-        scalar_t colorWeight = exp(colorDistanceSquared * colorExpConstant);
-        scalar_t totalWeight = spatialWeight * colorWeight;
+        accscalar_t colorWeight = rangeKernel(colorDistanceSquared);
+        accscalar_t totalWeight = spatialWeight * colorWeight;
 
         // Aggregating values.
         for (int i = 0; i < desc.channelCount; i++) {
@@ -123,14 +133,411 @@ void BilateralFilterCpu(torch::Tensor inputTensor, torch::Tensor outputTensor, f
   }
 }
 
+// Window loops for the dimension specialised kernels. The neighbour offset of each
+// window element is the home offset plus one entry of each per-axis offset array,
+// so the same loop serves the interior (constant offsets) and the border shell
+// (offsets clamped to the image). The visitor is called with the neighbour offset
+// relative to the home element and its spatial weight.
+template <typename scalar_t, typename Visitor>
+inline void BilateralFilterCpuWindow1D(int** axisOffsets, scalar_t* spatialWeights, int windowSize, Visitor& visitor) {
+  for (int kernelX = 0; kernelX < windowSize; kernelX++) {
+    visitor(axisOffsets[0][kernelX], spatialWeights[kernelX]);
+  }
+}
+
+template <typename scalar_t, typename Visitor>
+inline void BilateralFilterCpuWindow2D(int** axisOffsets, scalar_t* spatialWeights, int windowSize, Visitor& visitor) {
+  for (int kernelX = 0; kernelX < windowSize; kernelX++) {
+    int offsetX = axisOffsets[0][kernelX];
+    scalar_t* spatialWeightsX = spatialWeights + kernelX * windowSize;
+
+    for (int kernelY = 0; kernelY < windowSize; kernelY++) {
+      visitor(offsetX + axisOffsets[1][kernelY], spatialWeightsX[kernelY]);
+    }
+  }
+}
+
+template <typename scalar_t, typename Visitor>
+inline void BilateralFilterCpuWindow3D(int** axisOffsets, scalar_t* spatialWeights, int windowSize, Visitor& visitor) {
+  for (int kernelX = 0; kernelX < windowSize; kernelX++) {
+    int offsetX = axisOffsets[0][kernelX];
+
+    for (int kernelY = 0; kernelY < windowSize; kernelY++) {
+      int offsetXY = offsetX + axisOffsets[1][kernelY];
+      scalar_t* spatialWeightsXY = spatialWeights + (kernelX * windowSize + kernelY) * windowSize;
+
+      for (int kernelZ = 0; kernelZ < windowSize; kernelZ++) {
+        visitor(offsetXY + axisOffsets[2][kernelZ], spatialWeightsXY[kernelZ]);
+      }
+    }
+  }
+}
+
+template <int D, typename scalar_t, typename Visitor>
+inline void BilateralFilterCpuWindow(int** axisOffsets, scalar_t* spatialWeights, int windowSize, Visitor& visitor) {
+  switch (D) {
+    case (1):
+      BilateralFilterCpuWindow1D(axisOffsets, spatialWeights, windowSize, visitor);
+      break;
+    case (2):
+      BilateralFilterCpuWindow2D(axisOffsets, spatialWeights, windowSize, visitor);
+      break;
+    default:
+      BilateralFilterCpuWindow3D(axisOffsets, spatialWeights, windowSize, visitor);
+      break;
+  }
+}
+
+// Aggregates the filter sums of a single home element, in the accumulation type of scalar_t.
+template <typename scalar_t>
+struct BilateralFilterCpuElement {
+  using accscalar_t = at::acc_type<scalar_t, true>;
+
+  scalar_t* inputTensorData;
+  accscalar_t* valueSum;
+  accscalar_t weightSum;
+  int homeOffset;
+  int channelCount;
+  int channelStride;
+  const RangeKernelLut<accscalar_t>& rangeKernel;
+
+  inline void operator()(int neighbourDelta, accscalar_t spatialWeight) {
+    int neighbourOffset = homeOffset + neighbourDelta;
+
+    // Euclidean color distance.
+    accscalar_t colorDistanceSquared = 0;
+
+    for (int c = 0; c < channelCount; c++) {
+      accscalar_t diff = static_cast<accscalar_t>(inputTensorData[homeOffset + c * channelStride]) -
+          inputTensorData[neighbourOffset + c * channelStride];
+      colorDistanceSquared += diff * diff;
+    }
+
+    accscalar_t colorWeight = rangeKernel(colorDistanceSquared);
+    accscalar_t totalWeight = spatialWeight * colorWeight;
+
+    // Aggregating values.
+    for (int c = 0; c < channelCount; c++) {
+      valueSum[c] += inputTensorData[neighbourOffset + c * channelStride] * totalWeight;
+    }
+
+    weightSum += totalWeight;
+  }
+};
+
+// Aggregates the filter sums of BF_CPU_VECTOR_WIDTH consecutive home elements along the
+// contiguous axis, one per SIMD lane. Home and neighbour values of a channel are then
+// contiguous vectors. The range kernel is interpolated from the range kernel lookup table
+// (rangeTable, see RangeKernelLut) lane by lane when it is enabled, so interior and border
+// elements see the same kernel, and evaluated with a vectorised exp otherwise. Values are
+// stored as scalar_t (float, half or bfloat16) and accumulated in float.
+template <typename scalar_t>
+struct BilateralFilterCpuVector {
+  scalar_t* inputTensorData;
+  float* valueSum; // [channel][lane]
+  float* weightSum; // [lane]
+  int homeOffset;
+  int channelCount;
+  int channelStride;
+  float colorExpConstant;
+  const float* rangeTable;
+  float rangeInverseStep;
+  int maxPositionBits;
+
+  inline void operator()(int neighbourDelta, float spatialWeight) {
+    float colorDistanceSquared[BF_CPU_VECTOR_WIDTH];
+    float totalWeight[BF_CPU_VECTOR_WIDTH];
+
+    for (int l = 0; l < BF_CPU_VECTOR_WIDTH; l++) {
+      colorDistanceSquared[l] = 0;
+    }
+
+    // Euclidean color distance.
+    for (int c = 0; c < channelCount; c++) {
+      const scalar_t* home = inputTensorData + homeOffset + c * channelStride;
+      const scalar_t* neighbour = home + neighbourDelta;
+
+#pragma omp simd
+      for (int l = 0; l < BF_CPU_VECTOR_WIDTH; l++) {
+        float diff = static_cast<float>(home[l]) - neighbour[l];
+        colorDistanceSquared[l] += diff * diff;
+      }
+    }
+
+    if (rangeTable != NULL) {
+      // Interpolates the table as RangeKernelLut::operator() does, clamping the (non-negative)
+      // table position through its bits like ExpNegative clamps its argument.
+#pragma omp simd
+      for (int l = 0; l < BF_CPU_VECTOR_WIDTH; l++) {
+        int positionBits = FloatBits(colorDistanceSquared[l] * rangeInverseStep);
+        float position = BitsFloat(positionBits < maxPositionBits ? positionBits : maxPositionBits);
+
+        int index = (int)position;
+        float fraction = position - index;
+
+        totalWeight[l] = spatialWeight * (rangeTable[index] + fraction * (rangeTable[index + 1] - rangeTable[index]));
+        weightSum[l] += totalWeight[l];
+      }
+    } else {
+      exponentialWeights(colorDistanceSquared, spatialWeight, totalWeight);
+    }
+
+    // Aggregating values.
+    for (int c = 0; c < channelCount; c++) {
+      const scalar_t* neighbour = inputTensorData + homeOffset + neighbourDelta + c * channelStride;
+      float* channelSum = valueSum + c * BF_CPU_VECTOR_WIDTH;
+
+#pragma omp simd
+      for (int l = 0; l < BF_CPU_VECTOR_WIDTH; l++) {
+        channelSum[l] += neighbour[l] * totalWeight[l];
+      }
+    }
+  }
+
+  // exp() of the (non-positive) color exponent, vectorised across lanes by ExpNegative.
+  inline void exponentialWeights(float* colorDistanceSquared, float spatialWeight, float* totalWeight) {
+#pragma omp simd
+    for (int l = 0; l < BF_CPU_VECTOR_WIDTH; l++) {
+      totalWeight[l] = spatialWeight * ExpNegative(-colorExpConstant * colorDistanceSquared[l]);
+      weightSum[l] += totalWeight[l];
+    }
+  }
+};
+
+// Filters BF_CPU_VECTOR_WIDTH consecutive interior home elements. Only data accumulated in
+// float (float, half and bfloat16) is vectorised, double takes the scalar path and this
+// overload reports false.
+template <int D, typename scalar_t>
+inline bool BilateralFilterCpuVectorBlock(
+    scalar_t* inputTensorData,
+    scalar_t* outputTensorData,
+    float* valueSum,
+    int homeOffset,
+    int** axisOffsets,
+    double* spatialWeights,
+    int windowSize,
+    int channelCount,
+    int channelStride,
+    double colorExpConstant,
+    const RangeKernelLut<double>& rangeKernel) {
+  return false;
+}
+
+template <int D, typename scalar_t>
+inline bool BilateralFilterCpuVectorBlock(
+    scalar_t* inputTensorData,
+    scalar_t* outputTensorData,
+    float* valueSum,
+    int homeOffset,
+    int** axisOffsets,
+    float* spatialWeights,
+    int windowSize,
+    int channelCount,
+    int channelStride,
+    float colorExpConstant,
+    const RangeKernelLut<float>& rangeKernel) {
+  float weightSum[BF_CPU_VECTOR_WIDTH];
+
+  for (int i = 0; i < channelCount * BF_CPU_VECTOR_WIDTH; i++) {
+    valueSum[i] = 0;
+  }
+
+  for (int l = 0; l < BF_CPU_VECTOR_WIDTH; l++) {
+    weightSum[l] = 0;
+  }
+
+
+  BilateralFilterCpuVector<scalar_t> vector = {
+      inputTensorData,
+      valueSum,
+      weightSum,
+      homeOffset,
+      channelCount,
+      channelStride,
+      colorExpConstant,
+      rangeKernel.data(),
+      rangeKernel.inverseStep(),
+      FloatBits(rangeKernel.lastPosition())};
+  BilateralFilterCpuWindow<D>(axisOffsets, spatialWeights, windowSize, vector);
+
+  for (int c = 0; c < channelCount; c++) {
+    for (int l = 0; l < BF_CPU_VECTOR_WIDTH; l++) {
+      outputTensorData[homeOffset + c * channelStride + l] = valueSum[c * BF_CPU_VECTOR_WIDTH + l] / weightSum[l];
+    }
+  }
+
+  return true;
+}
+
+template <typename scalar_t, int D>
+void BilateralFilterCpu(torch::Tensor inputTensor, torch::Tensor outputTensor, float spatialSigma, float colorSigma) {
+  // Getting tensor description.
+  TensorDescription desc = TensorDescription(inputTensor);
+
+  using accscalar_t = at::acc_type<scalar_t, true>;
+
+  // Raw tensor data pointers.
+  scalar_t* inputTensorData = inputTensor.data_ptr<scalar_t>();
+  scalar_t* outputTensorData = outputTensor.data_ptr<scalar_t>();
+
+  // Pre-calculate common values
+  int windowSize = (int)ceil(5.0f * spatialSigma) | 1; // ORing last bit to ensure odd window size
+  int halfWindowSize = floor(0.5f * windowSize);
+  accscalar_t spatialExpConstant = -1.0f / (2 * spatialSigma * spatialSigma);
+  accscalar_t colorExpConstant = -1.0f / (2 * colorSigma * colorSigma);
+  RangeKernelLut<accscalar_t> rangeKernel(colorExpConstant, GetRangeKernelLutMaxError());
+
+  // Pre-calculate the spatial weights of the full window, last axis fastest.
+  int windowVolume = 1;
+
+  for (int i = 0; i < D; i++) {
+    windowVolume *= windowSize;
+  }
+
+  accscalar_t* spatialWeights = new accscalar_t[windowVolume];
+
+  for (int k = 0; k < windowVolume; k++) {
+    int distanceSquared = 0;
+
+    for (int i = 0, remainder = k; i < D; i++, remainder /= windowSize) {
+      int distance = remainder % windowSize - halfWindowSize;
+      distanceSquared += distance * distance;
+    }
+
+    spatialWeights[k] = exp(distanceSquared * spatialExpConstant);
+  }
+
+  // Per-axis neighbour offsets. Offsets along the outer axes are clamped once per row and
+  // shared by every element of it. Along the last axis, elements whose window lies inside
+  // the row use constant interior offsets, only the border elements are clamped.
+  int* interiorOffsets = new int[windowSize];
+  int* clampedOffsetData = new int[D * windowSize];
+  int* axisOffsets[D];
+
+  for (int k = 0; k < windowSize; k++) {
+    interiorOffsets[k] = (k - halfWindowSize) * desc.strides[D - 1];
+  }
+
+  // Kernel aggregates used to calculate
+  // the output value.
+  accscalar_t* valueSum = new accscalar_t[desc.channelCount];
+  float* vectorValueSum = new float[desc.channelCount * BF_CPU_VECTOR_WIDTH];
+
+  // Home elements are visited row by row along the last axis. Interior runs of a
+  // contiguous row are filtered BF_CPU_VECTOR_WIDTH elements at a time.
+  int rowLength = desc.sizes[D - 1];
+  int rowCount = 1;
+
+  for (int i = 0; i < D - 1; i++) {
+    rowCount *= desc.sizes[i];
+  }
+
+  bool rowContiguous = desc.strides[D - 1] == 1;
+
+  // Looping over the batches
+  for (int b = 0; b < desc.batchCount; b++) {
+    int batchOffset = b * desc.batchStride;
+
+    for (int row = 0; row < rowCount; row++) {
+      int rowOffset = batchOffset;
+
+      for (int i = D - 2, remainder = row; i >= 0; i--) {
+        int homeIndex = remainder % desc.sizes[i];
+        remainder /= desc.sizes[i];
+
+        rowOffset += homeIndex * desc.strides[i];
+        axisOffsets[i] = clampedOffsetData + i * windowSize;
+
+        for (int k = 0; k < windowSize; k++) {
+          int neighbourIndex = homeIndex + k - halfWindowSize;
+          int neighbourIndexClamped = std::min(desc.sizes[i] - 1, std::max(0, neighbourIndex));
+          axisOffsets[i][k] = (neighbourIndexClamped - homeIndex) * desc.strides[i];
+        }
+      }
+
+      int x = 0;
+
+      while (x < rowLength) {
+        int homeOffset = rowOffset + x * desc.strides[D - 1];
+        bool interior = x >= halfWindowSize && x < rowLength - halfWindowSize;
+
+        axisOffsets[D - 1] = interiorOffsets;
+
+        if (interior && rowContiguous && x + BF_CPU_VECTOR_WIDTH <= rowLength - halfWindowSize &&
+            BilateralFilterCpuVectorBlock<D>(
+                inputTensorData,
+                outputTensorData,
+                vectorValueSum,
+                homeOffset,
+                axisOffsets,
+                spatialWeights,
+                windowSize,
+                desc.channelCount,
+                desc.channelStride,
+                colorExpConstant,
+                rangeKernel)) {
+          x += BF_CPU_VECTOR_WIDTH;
+          continue;
+        }
+
+        // Only the border shell pays for clamped indexing.
+        if (!interior) {
+          axisOffsets[D - 1] = clampedOffsetData + (D - 1) * windowSize;
+
+          for (int k = 0; k < windowSize; k++) {
+            int neighbourIndex = x + k - halfWindowSize;
+            int neighbourIndexClamped = std::min(rowLength - 1, std::max(0, neighbourIndex));
+            axisOffsets[D - 1][k] = (neighbourIndexClamped - x) * desc.strides[D - 1];
+          }
+        }
+
+        // Zero kernel aggregates.
+        for (int c = 0; c < desc.channelCount; c++) {
+          valueSum[c] = 0;
+        }
+
+        BilateralFilterCpuElement<scalar_t> element = {
+            inputTensorData, valueSum, 0, homeOffset, desc.channelCount, desc.channelStride, rangeKernel};
+        BilateralFilterCpuWindow<D>(axisOffsets, spatialWeights, windowSize, element);
+
+        for (int c = 0; c < desc.channelCount; c++) {
+          outputTensorData[homeOffset + c * desc.channelStride] = valueSum[c] / element.weightSum;
+        }
+
+        x++;
+      }
+    }
+  }
+
+  delete[] spatialWeights;
+  delete[] interiorOffsets;
+  delete[] clampedOffsetData;
+  delete[] valueSum;
+  delete[] vectorValueSum;
+}
+
 torch::Tensor BilateralFilterCpu(torch::Tensor inputTensor, float spatialSigma, float colorSigma) {
-  // Preparing output tensor.
+  // Preparing output tensor. The kernels write the output at the offsets of the input elements.
+  inputTensor = inputTensor.contiguous();
   torch::Tensor outputTensor = torch::zeros_like(inputTensor);
 
-  AT_DISPATCH_FLOATING_TYPES_AND_HALF(inputTensor.scalar_type(), "BilateralFilterCpu", ([&] {
-                                        BilateralFilterCpu<scalar_t>(
-                                            inputTensor, outputTensor, spatialSigma, colorSigma);
-                                      }));
+  // Dimension specialised kernels for 1D, 2D and 3D, generic indexing otherwise.
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half, at::ScalarType::BFloat16, inputTensor.scalar_type(), "BilateralFilterCpu", ([&] {
+        switch (inputTensor.dim() - 2) {
+          case (1):
+            BilateralFilterCpu<scalar_t, 1>(inputTensor, outputTensor, spatialSigma, colorSigma);
+            break;
+          case (2):
+            BilateralFilterCpu<scalar_t, 2>(inputTensor, outputTensor, spatialSigma, colorSigma);
+            break;
+          case (3):
+            BilateralFilterCpu<scalar_t, 3>(inputTensor, outputTensor, spatialSigma, colorSigma);
+            break;
+          default:
+            BilateralFilterCpuGeneric<scalar_t>(inputTensor, outputTensor, spatialSigma, colorSigma);
+        }
+      }));
 
   return outputTensor;
 }
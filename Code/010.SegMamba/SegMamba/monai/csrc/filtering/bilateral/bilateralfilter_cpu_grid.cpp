@@ -0,0 +1,296 @@
+/*
+Copyright (c) MONAI Consortium
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <math.h>
+#include <torch/extension.h>
+#include <ATen/Parallel.h>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+#include "bilateral.h"
+#include "utils/tensor_description.h"
+
+// Bilateral grid approximation of the bilateral filter (Paris & Durand 2006, Chen et al. 2007).
+//
+// Each element is splatted with multilinear weights into a grid with one axis per spatial
+// dimension and one per channel, sampled at one cell per sigma. Every cell holds the
+// weighted channel sums and the weight itself (homogeneous coordinates). The grid is blurred
+// separably and the output is sliced back with multilinear interpolation and normalised.
+// The linear splat and slice each add a variance of 1/6 cell^2, so the blur kernel only
+// contributes the remaining 2/3 cell^2 for a total standard deviation of one cell.
+
+#define BF_GRID_BLUR_RADIUS 2
+
+// Grid coordinate and interpolation fraction of an element along every grid axis.
+template <typename scalar_t>
+struct BilateralGridPosition {
+  int base[BF_GRID_MAX_DIMENSION];
+  scalar_t fraction[BF_GRID_MAX_DIMENSION];
+};
+
+template <typename scalar_t>
+struct BilateralGridDescription {
+  int dimensions;
+  int cellChannels;
+  int sizes[BF_GRID_MAX_DIMENSION];
+  int64_t strides[BF_GRID_MAX_DIMENSION];
+  int64_t elementCount;
+
+  float invSpatialSigma;
+  float invColorSigma;
+  scalar_t colorMin[BF_GRID_MAX_DIMENSION];
+};
+
+template <typename scalar_t>
+inline void BilateralGridLocate(
+    const BilateralGridDescription<scalar_t>& grid,
+    const TensorDescription& desc,
+    const scalar_t* inputTensorData,
+    int batchOffset,
+    int elementOffset,
+    BilateralGridPosition<scalar_t>& position) {
+  int offsetRemainder = elementOffset;
+
+  for (int d = 0; d < desc.dimensions; d++) {
+    int coord = offsetRemainder / desc.strides[d];
+    offsetRemainder -= coord * desc.strides[d];
+
+    float gridCoord = coord * grid.invSpatialSigma;
+    position.base[d] = (int)gridCoord;
+    position.fraction[d] = gridCoord - position.base[d];
+  }
+
+  for (int c = 0; c < desc.channelCount; c++) {
+    scalar_t value = inputTensorData[batchOffset + elementOffset + c * desc.channelStride];
+    float gridCoord = (float)(value - grid.colorMin[c]) * grid.invColorSigma;
+    position.base[desc.dimensions + c] = (int)gridCoord;
+    position.fraction[desc.dimensions + c] = gridCoord - position.base[desc.dimensions + c];
+  }
+}
+
+// Offset and multilinear weight of one of the 2^dimensions cells surrounding a position.
+template <typename scalar_t>
+inline int64_t BilateralGridCorner(
+    const BilateralGridDescription<scalar_t>& grid,
+    const BilateralGridPosition<scalar_t>& position,
+    int corner,
+    scalar_t& weight) {
+  int64_t offset = 0;
+  weight = 1;
+
+  for (int d = 0; d < grid.dimensions; d++) {
+    int upper = (corner >> d) & 1;
+    offset += (position.base[d] + upper) * grid.strides[d];
+    weight *= upper ? position.fraction[d] : 1 - position.fraction[d];
+  }
+
+  return offset;
+}
+
+template <typename scalar_t>
+void BilateralFilterGridCpu(
+    torch::Tensor inputTensor,
+    torch::Tensor outputTensor,
+    float spatialSigma,
+    float colorSigma) {
+  // Getting tensor description.
+  TensorDescription desc = TensorDescription(inputTensor);
+
+  // Preparing memory
+  scalar_t* inputTensorData = inputTensor.data_ptr<scalar_t>();
+  scalar_t* outputTensorData = outputTensor.data_ptr<scalar_t>();
+
+  BilateralGridDescription<scalar_t> grid;
+  grid.dimensions = desc.dimensions + desc.channelCount;
+  grid.cellChannels = desc.channelCount + 1;
+  grid.invSpatialSigma = 1.0f / spatialSigma;
+  grid.invColorSigma = 1.0f / colorSigma;
+
+  // Blur kernel in grid cells, variance 2/3 (see above). Normalisation is not
+  // needed as the homogeneous weight is blurred alongside the values.
+  scalar_t blurWeights[2 * BF_GRID_BLUR_RADIUS + 1];
+
+  for (int k = -BF_GRID_BLUR_RADIUS; k <= BF_GRID_BLUR_RADIUS; k++) {
+    blurWeights[k + BF_GRID_BLUR_RADIUS] = exp(-0.75 * k * k);
+  }
+
+  // Looping over batches
+  for (int b = 0; b < desc.batchCount; b++) {
+    int batchOffset = b * desc.batchStride;
+
+    // Spatial extent of the grid, the extra cell holds the upper interpolation corner.
+    for (int d = 0; d < desc.dimensions; d++) {
+      grid.sizes[d] = (int)((desc.sizes[d] - 1) * grid.invSpatialSigma) + 2;
+    }
+
+    // Range extent of the grid, per channel.
+    for (int c = 0; c < desc.channelCount; c++) {
+      scalar_t* channelData = inputTensorData + batchOffset + c * desc.channelStride;
+      scalar_t colorMin = channelData[0];
+      scalar_t colorMax = channelData[0];
+
+      for (int i = 1; i < desc.channelStride; i++) {
+        colorMin = std::min(colorMin, channelData[i]);
+        colorMax = std::max(colorMax, channelData[i]);
+      }
+
+      grid.colorMin[c] = colorMin;
+      grid.sizes[desc.dimensions + c] = (int)((float)(colorMax - colorMin) * grid.invColorSigma) + 2;
+    }
+
+    // Row-major cell layout with the cell channels innermost.
+    grid.elementCount = grid.cellChannels;
+
+    for (int d = grid.dimensions - 1; d >= 0; d--) {
+      grid.strides[d] = grid.elementCount;
+      grid.elementCount *= grid.sizes[d];
+
+      if (grid.elementCount > std::numeric_limits<int>::max()) {
+        throw std::runtime_error(
+            "Bilateral grid too large, increase spatial_sigma or color_sigma or use another algorithm");
+      }
+    }
+
+    scalar_t* gridData = new scalar_t[grid.elementCount]();
+
+    // Splat. Elements are grouped by their cell along the first spatial axis, the elements
+    // of cell g only write to cells g and g + 1, so all even (then all odd) cells can be
+    // splatted concurrently without write conflicts.
+    int* sliceStart = new int[grid.sizes[0] + 1];
+    int sliceCount = desc.sizes[0];
+
+    for (int g = 0, x = 0; g <= grid.sizes[0]; g++) {
+      while (x < sliceCount && (int)(x * grid.invSpatialSigma) < g) {
+        x++;
+      }
+
+      sliceStart[g] = x;
+    }
+
+    for (int parity = 0; parity < 2; parity++) {
+      at::parallel_for(0, (grid.sizes[0] - parity + 1) / 2, 1, [&](int64_t start, int64_t end) {
+        BilateralGridPosition<scalar_t> position;
+
+        for (int64_t j = start; j < end; j++) {
+          int g = 2 * j + parity;
+
+          for (int i = sliceStart[g] * desc.strides[0]; i < sliceStart[g + 1] * desc.strides[0]; i++) {
+            BilateralGridLocate(grid, desc, inputTensorData, batchOffset, i, position);
+
+            for (int corner = 0; corner < (1 << grid.dimensions); corner++) {
+              scalar_t weight;
+              scalar_t* cell = gridData + BilateralGridCorner(grid, position, corner, weight);
+
+              for (int c = 0; c < desc.channelCount; c++) {
+                cell[c] += weight * inputTensorData[batchOffset + i + c * desc.channelStride];
+              }
+
+              cell[desc.channelCount] += weight;
+            }
+          }
+        }
+      });
+    }
+
+    delete[] sliceStart;
+
+    // Separable blur, one pass per grid axis. Lines along the axis are independent.
+    for (int d = 0; d < grid.dimensions; d++) {
+      int lineLength = grid.sizes[d];
+      int64_t innerCount = grid.strides[d] / grid.cellChannels;
+      int64_t lineCount = grid.elementCount / (grid.cellChannels * lineLength);
+
+      at::parallel_for(0, lineCount, 1, [&](int64_t start, int64_t end) {
+        scalar_t* line = new scalar_t[lineLength * grid.cellChannels];
+
+        for (int64_t l = start; l < end; l++) {
+          scalar_t* lineData =
+              gridData + (l / innerCount) * grid.strides[d] * lineLength + (l % innerCount) * grid.cellChannels;
+
+          for (int k = 0; k < lineLength; k++) {
+            for (int c = 0; c < grid.cellChannels; c++) {
+              line[k * grid.cellChannels + c] = lineData[k * grid.strides[d] + c];
+            }
+          }
+
+          for (int k = 0; k < lineLength; k++) {
+            int tapStart = std::max(-BF_GRID_BLUR_RADIUS, -k);
+            int tapEnd = std::min(BF_GRID_BLUR_RADIUS, lineLength - 1 - k);
+
+            for (int c = 0; c < grid.cellChannels; c++) {
+              scalar_t sum = 0;
+
+              for (int t = tapStart; t <= tapEnd; t++) {
+                sum += blurWeights[t + BF_GRID_BLUR_RADIUS] * line[(k + t) * grid.cellChannels + c];
+              }
+
+              lineData[k * grid.strides[d] + c] = sum;
+            }
+          }
+        }
+
+        delete[] line;
+      });
+    }
+
+    // Slice. Every element only reads the grid.
+    at::parallel_for(0, desc.channelStride, at::internal::GRAIN_SIZE, [&](int64_t start, int64_t end) {
+      BilateralGridPosition<scalar_t> position;
+      scalar_t* cellSum = new scalar_t[grid.cellChannels];
+
+      for (int64_t i = start; i < end; i++) {
+        BilateralGridLocate(grid, desc, inputTensorData, batchOffset, i, position);
+
+        for (int c = 0; c < grid.cellChannels; c++) {
+          cellSum[c] = 0;
+        }
+
+        for (int corner = 0; corner < (1 << grid.dimensions); corner++) {
+          scalar_t weight;
+          scalar_t* cell = gridData + BilateralGridCorner(grid, position, corner, weight);
+
+          for (int c = 0; c < grid.cellChannels; c++) {
+            cellSum[c] += weight * cell[c];
+          }
+        }
+
+        for (int c = 0; c < desc.channelCount; c++) {
+          outputTensorData[batchOffset + i + c * desc.channelStride] = cellSum[c] / cellSum[desc.channelCount];
+        }
+      }
+
+      delete[] cellSum;
+    });
+
+    delete[] gridData;
+  }
+}
+
+// Function to choose template implementation based on dynamic, channels and dimensions
+torch::Tensor BilateralFilterGridCpu(torch::Tensor inputTensor, float spatialSigma, float colorSigma) {
+  if (inputTensor.dim() - 2 + inputTensor.size(1) > BF_GRID_MAX_DIMENSION) {
+    throw std::runtime_error(
+        "Bilateral grid filtering not implemented for spatial dimension + channel count > " +
+        std::to_string(BF_GRID_MAX_DIMENSION));
+  }
+
+  inputTensor = inputTensor.contiguous();
+  torch::Tensor outputTensor = torch::zeros_like(inputTensor);
+
+  AT_DISPATCH_FLOATING_TYPES(inputTensor.scalar_type(), "BilateralFilterGridCpu", ([&] {
+                               BilateralFilterGridCpu<scalar_t>(inputTensor, outputTensor, spatialSigma, colorSigma);
+                             }));
+
+  return outputTensor;
+}
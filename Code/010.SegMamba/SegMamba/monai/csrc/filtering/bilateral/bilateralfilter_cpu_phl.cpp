@@ -25,60 +25,41 @@ void BilateralFilterPHLCpu(
   // Getting tensor description.
   TensorDescription desc = TensorDescription(inputTensor);
 
-  int featureChannels = desc.channelCount + desc.dimensions;
-
-  // Preparing memory
   scalar_t* inputTensorData = inputTensor.data_ptr<scalar_t>();
   scalar_t* outputTensorData = outputTensor.data_ptr<scalar_t>();
-  scalar_t* data = new scalar_t[desc.channelStride * desc.channelCount];
-  scalar_t* features = new scalar_t[desc.channelStride * featureChannels];
-
-  // Precalculating inverse sigmas
-  float invSpatialSigma = 1.0f / spatialSigma;
-  float invColorSigma = 1.0f / colorSigma;
 
-  // Looping over batches
-  for (int b = 0; b < desc.batchCount; b++) {
+  // The lattice reads the color features straight from the channel first input and
+  // derives the spatial features from the element index.
+  PermutohedralFeatures<scalar_t> features;
+  features.channels = desc.channelCount;
+  features.channelStride = desc.channelStride;
+  features.scale = 1.0f / colorSigma;
+  features.spatialDimensions = desc.dimensions;
+  features.spatialStrides = desc.strides;
+  features.spatialScale = 1.0f / spatialSigma;
+  features.spatialFirst = false;
+
+  // Filtering the batches, concurrently where the thread budget allows.
+  PermutohedralBatchCPU(desc.batchCount, desc.channelStride, [&](int b) {
     int batchOffset = b * desc.batchStride;
-
-    // Creating features (also permuting input data to be channel last. Permutohedral
-    // implementation should be changed to channel first to avoid this)
-    for (int i = 0; i < desc.channelStride; i++) {
-      // Color features (and permutation)
-      for (int c = 0; c < desc.channelCount; c++) {
-        features[i * featureChannels + c] = invColorSigma * inputTensorData[batchOffset + i + c * desc.channelStride];
-        data[i * desc.channelCount + c] = inputTensorData[batchOffset + i + c * desc.channelStride];
-      }
-
-      // Spatial features
-      int offsetRemainder = i;
-
-      for (int d = 0; d < desc.dimensions; d++) {
-        int coord = offsetRemainder / desc.strides[d];
-        offsetRemainder -= coord * desc.strides[d];
-
-        features[i * featureChannels + desc.channelCount + d] = (scalar_t)invSpatialSigma * coord;
-      }
-    }
+    PermutohedralFeatures<scalar_t> batchFeatures = features;
+    batchFeatures.data = inputTensorData + batchOffset;
 
     // Filtering data with respect to the features.
-    PermutohedralCPU<scalar_t>(data, features, desc.channelCount, featureChannels, desc.channelStride);
-
-    // Writing output tensor.
-    for (int i = 0; i < desc.channelStride; i++) {
-      for (int c = 0; c < desc.channelCount; c++) {
-        outputTensorData[batchOffset + i + c * desc.channelStride] = data[i * desc.channelCount + c];
-      }
-    }
-  }
-
-  delete[] data;
-  delete[] features;
+    PermutohedralCPU<scalar_t>(
+        inputTensorData + batchOffset,
+        outputTensorData + batchOffset,
+        desc.channelCount,
+        desc.channelStride,
+        batchFeatures,
+        desc.channelStride);
+  });
 }
 
 // Function to choose template implementation based on dynamic, channels and dimensions
 torch::Tensor BilateralFilterPHLCpu(torch::Tensor inputTensor, float spatialSigma, float colorSigma) {
-  torch::Tensor outputTensor = torch::zeros_like(inputTensor);
+  inputTensor = inputTensor.contiguous();
+  torch::Tensor outputTensor = torch::empty_like(inputTensor);
 
   AT_DISPATCH_FLOATING_TYPES(inputTensor.scalar_type(), "BilateralFilterPhlCpu", ([&] {
                                BilateralFilterPHLCpu<scalar_t>(inputTensor, outputTensor, spatialSigma, colorSigma);
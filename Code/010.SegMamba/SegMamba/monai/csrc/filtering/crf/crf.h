@@ -0,0 +1,35 @@
+/*
+Copyright (c) MONAI Consortium
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include <torch/extension.h>
+
+// Mean field inference of a fully connected CRF (Krähenbühl & Koltun 2011) on the CPU, the
+// fused equivalent of monai.networks.blocks.CRF. The bilateral (spatial and reference) and
+// gaussian (spatial) permutohedral lattices are built once per batch element and reused by
+// every iteration. input holds the class logits (batch, classes, spatial...), reference the
+// guidance (batch, channels, spatial...) and compatibilityMatrix, if given, is a
+// (classes, classes) matrix applied to the combined messages. Returns the class
+// probabilities after the given number of iterations.
+torch::Tensor DenseCrf(
+    torch::Tensor input,
+    torch::Tensor reference,
+    int iterations,
+    float bilateralWeight,
+    float gaussianWeight,
+    float bilateralSpatialSigma,
+    float bilateralColorSigma,
+    float gaussianSpatialSigma,
+    float updateFactor,
+    c10::optional<torch::Tensor> compatibilityMatrix);
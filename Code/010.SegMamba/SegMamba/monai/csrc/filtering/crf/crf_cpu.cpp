@@ -0,0 +1,236 @@
+/*
+Copyright (c) MONAI Consortium
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <math.h>
+#include <torch/extension.h>
+#include <ATen/Parallel.h>
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include "crf.h"
+#include "filtering/permutohedral/permutohedral.h"
+#include "utils/tensor_description.h"
+
+// Mean field update of every element, fused into a single pass over the channel first
+// buffers: combines the bilateral and gaussian messages, applies the compatibility
+// transform and writes softmax(unary + updateFactor * message) to output. Without
+// messages (bilateralMessage NULL) this is softmax(unary), the initial estimate.
+template <typename scalar_t>
+void DenseCrfUpdateCpu(
+    const scalar_t* unary,
+    const scalar_t* bilateralMessage,
+    const scalar_t* gaussianMessage,
+    const scalar_t* compatibility,
+    scalar_t* output,
+    int classCount,
+    int elementCount,
+    scalar_t bilateralWeight,
+    scalar_t gaussianWeight,
+    scalar_t updateFactor) {
+  at::parallel_for(0, elementCount, PHL_CPU_SLICE_GRAIN_SIZE, [&](int64_t start, int64_t end) {
+    scalar_t* message = new scalar_t[classCount];
+    scalar_t* logits = new scalar_t[classCount];
+
+    for (int64_t e = start; e < end; e++) {
+      for (int c = 0; c < classCount; c++) {
+        logits[c] = unary[e + c * elementCount];
+      }
+
+      if (bilateralMessage != NULL) {
+        for (int c = 0; c < classCount; c++) {
+          message[c] = bilateralWeight * bilateralMessage[e + c * elementCount] +
+              gaussianWeight * gaussianMessage[e + c * elementCount];
+        }
+
+        // Row vector times matrix, message[k] contributes compatibility[k][c] to class c.
+        if (compatibility != NULL) {
+          for (int c = 0; c < classCount; c++) {
+            scalar_t sum = 0;
+
+            for (int k = 0; k < classCount; k++) {
+              sum += message[k] * compatibility[k * classCount + c];
+            }
+
+            logits[c] += updateFactor * sum;
+          }
+        } else {
+          for (int c = 0; c < classCount; c++) {
+            logits[c] += updateFactor * message[c];
+          }
+        }
+      }
+
+      scalar_t maximum = logits[0];
+      for (int c = 1; c < classCount; c++) {
+        maximum = std::max(maximum, logits[c]);
+      }
+
+      scalar_t sum = 0;
+      for (int c = 0; c < classCount; c++) {
+        logits[c] = exp(logits[c] - maximum);
+        sum += logits[c];
+      }
+
+      for (int c = 0; c < classCount; c++) {
+        output[e + c * elementCount] = logits[c] / sum;
+      }
+    }
+
+    delete[] message;
+    delete[] logits;
+  });
+}
+
+template <typename scalar_t>
+void DenseCrfCpu(
+    torch::Tensor input,
+    torch::Tensor reference,
+    torch::Tensor output,
+    int iterations,
+    float bilateralWeight,
+    float gaussianWeight,
+    float bilateralSpatialSigma,
+    float bilateralColorSigma,
+    float gaussianSpatialSigma,
+    float updateFactor,
+    const scalar_t* compatibility) {
+  TensorDescription desc = TensorDescription(input);
+  int elementCount = desc.channelStride;
+  int classCount = desc.channelCount;
+
+  const scalar_t* inputData = input.data_ptr<scalar_t>();
+  const scalar_t* referenceData = reference.data_ptr<scalar_t>();
+  scalar_t* outputData = output.data_ptr<scalar_t>();
+
+  // Both kernels put the spatial features first, like the feature tensors of the CRF module.
+  // The spatial features are derived from the element index, the bilateral kernel reads the
+  // color features straight from the reference.
+  PermutohedralFeatures<scalar_t> bilateralFeatures;
+  bilateralFeatures.channels = reference.size(1);
+  bilateralFeatures.channelStride = elementCount;
+  bilateralFeatures.scale = 1.0f / bilateralColorSigma;
+  bilateralFeatures.spatialDimensions = desc.dimensions;
+  bilateralFeatures.spatialStrides = desc.strides;
+  bilateralFeatures.spatialScale = 1.0f / bilateralSpatialSigma;
+  bilateralFeatures.spatialFirst = true;
+
+  PermutohedralFeatures<scalar_t> gaussianFeatures;
+  gaussianFeatures.data = NULL;
+  gaussianFeatures.channels = 0;
+  gaussianFeatures.channelStride = elementCount;
+  gaussianFeatures.scale = 1;
+  gaussianFeatures.spatialDimensions = desc.dimensions;
+  gaussianFeatures.spatialStrides = desc.strides;
+  gaussianFeatures.spatialScale = 1.0f / gaussianSpatialSigma;
+  gaussianFeatures.spatialFirst = true;
+
+  PermutohedralBatchCPU(desc.batchCount, elementCount, [&](int b) {
+    const scalar_t* unary = inputData + b * desc.batchStride;
+    scalar_t* estimate = outputData + b * desc.batchStride;
+
+    PermutohedralFeatures<scalar_t> batchFeatures = bilateralFeatures;
+    batchFeatures.data = referenceData + b * reference.stride(0);
+
+    // The lattices are released on every exit, the second one may throw for out of range features.
+    typedef std::unique_ptr<PermutohedralLattice<scalar_t>, void (*)(PermutohedralLattice<scalar_t>*)> LatticePtr;
+    LatticePtr bilateralLattice(
+        PermutohedralLatticeCPUCreate(batchFeatures, elementCount), PermutohedralLatticeCPUDestroy<scalar_t>);
+    LatticePtr gaussianLattice(
+        PermutohedralLatticeCPUCreate(gaussianFeatures, elementCount), PermutohedralLatticeCPUDestroy<scalar_t>);
+
+    // Message buffers, shared by all iterations.
+    std::vector<scalar_t> bilateralMessage(classCount * elementCount);
+    std::vector<scalar_t> gaussianMessage(classCount * elementCount);
+
+    DenseCrfUpdateCpu<scalar_t>(
+        unary, NULL, NULL, NULL, estimate, classCount, elementCount, bilateralWeight, gaussianWeight, updateFactor);
+
+    for (int i = 0; i < iterations; i++) {
+      PermutohedralLatticeCPUFilter(
+          bilateralLattice.get(), estimate, bilateralMessage.data(), classCount, elementCount);
+      PermutohedralLatticeCPUFilter(gaussianLattice.get(), estimate, gaussianMessage.data(), classCount, elementCount);
+
+      DenseCrfUpdateCpu<scalar_t>(
+          unary,
+          bilateralMessage.data(),
+          gaussianMessage.data(),
+          compatibility,
+          estimate,
+          classCount,
+          elementCount,
+          bilateralWeight,
+          gaussianWeight,
+          updateFactor);
+    }
+  });
+}
+
+torch::Tensor DenseCrf(
+    torch::Tensor input,
+    torch::Tensor reference,
+    int iterations,
+    float bilateralWeight,
+    float gaussianWeight,
+    float bilateralSpatialSigma,
+    float bilateralColorSigma,
+    float gaussianSpatialSigma,
+    float updateFactor,
+    c10::optional<torch::Tensor> compatibilityMatrix) {
+  if (input.is_cuda()) {
+    throw std::runtime_error("Dense CRF is only implemented for CPU tensors");
+  }
+
+  input = input.contiguous();
+  reference = reference.to(input.scalar_type()).contiguous();
+
+  bool sizesMatch = reference.dim() == input.dim() && reference.size(0) == input.size(0);
+
+  for (int i = 2; sizesMatch && i < input.dim(); i++) {
+    sizesMatch = reference.size(i) == input.size(i);
+  }
+
+  if (!sizesMatch) {
+    throw std::runtime_error("Dense CRF input and reference must have the same batch and spatial sizes");
+  }
+
+  torch::Tensor compatibility;
+
+  if (compatibilityMatrix.has_value()) {
+    compatibility = compatibilityMatrix.value().to(input.scalar_type()).contiguous();
+
+    if (compatibility.numel() != input.size(1) * input.size(1)) {
+      throw std::runtime_error("Dense CRF compatibility matrix must be classes x classes");
+    }
+  }
+
+  torch::Tensor output = torch::empty_like(input);
+
+  AT_DISPATCH_FLOATING_TYPES(input.scalar_type(), "DenseCrfCpu", ([&] {
+                               DenseCrfCpu<scalar_t>(
+                                   input,
+                                   reference,
+                                   output,
+                                   iterations,
+                                   bilateralWeight,
+                                   gaussianWeight,
+                                   bilateralSpatialSigma,
+                                   bilateralColorSigma,
+                                   gaussianSpatialSigma,
+                                   updateFactor,
+                                   compatibility.defined() ? compatibility.data_ptr<scalar_t>() : NULL);
+                             }));
+
+  return output;
+}
@@ -14,6 +14,8 @@ limitations under the License.
 #pragma once
 
 #include "bilateral/bilateral.h"
+#include "crf/crf.h"
 #include "permutohedral/permutohedral.h"
 #include "trainable_bilateral/trainable_bilateral.h"
 #include "trainable_joint_bilateral/trainable_joint_bilateral.h"
+#include "utils/range_kernel_lut.h"
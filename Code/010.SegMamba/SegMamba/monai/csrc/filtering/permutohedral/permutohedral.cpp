@@ -19,34 +19,51 @@ limitations under the License.
 
 #include "permutohedral.h"
 
+// Position vectors of one batch element of a contiguous (batch, features, spatial...) tensor.
+template <typename scalar_t>
+static PermutohedralFeatures<scalar_t> PermutohedralFeaturesCPU(torch::Tensor features, int batchIndex) {
+  int elementCount = features.stride(1);
+
+  PermutohedralFeatures<scalar_t> positions;
+  positions.data = features.data_ptr<scalar_t>() + batchIndex * features.stride(0);
+  positions.channels = features.size(1);
+  positions.channelStride = elementCount;
+  positions.scale = 1;
+  positions.spatialDimensions = 0;
+  positions.spatialStrides = NULL;
+  positions.spatialScale = 0;
+  positions.spatialFirst = false;
+
+  return positions;
+}
+
 torch::Tensor PermutohedralFilter(torch::Tensor input, torch::Tensor features) {
   input = input.contiguous();
 
   int batchCount = input.size(0);
-  int batchStride = input.stride(0);
+  int64_t batchStride = input.stride(0);
   int elementCount = input.stride(1);
   int channelCount = input.size(1);
   int featureCount = features.size(1);
 
+#ifdef WITH_CUDA
+  if (torch::cuda::is_available() && input.is_cuda()) {
 // movedim not support in torch < 1.7.1
 #if MONAI_TORCH_VERSION >= 10701
-  torch::Tensor data = input.clone().movedim(1, -1).contiguous();
-  features = features.movedim(1, -1).contiguous();
+    torch::Tensor data = input.clone().movedim(1, -1).contiguous();
+    features = features.movedim(1, -1).contiguous();
 #else
-  torch::Tensor data = input.clone();
-  features = features;
+    torch::Tensor data = input.clone();
 
-  for (int i = 1; i < input.dim() - 1; i++) {
-    data = data.transpose(i, i + 1);
-    features = features.transpose(i, i + 1);
-  }
+    for (int i = 1; i < input.dim() - 1; i++) {
+      data = data.transpose(i, i + 1);
+      features = features.transpose(i, i + 1);
+    }
 
-  data = data.contiguous();
-  features = features.contiguous();
+    data = data.contiguous();
+    features = features.contiguous();
 #endif
 
-#ifdef WITH_CUDA
-  if (torch::cuda::is_available() && data.is_cuda()) {
     CHECK_CONTIGUOUS_CUDA(data);
 
     if (channelCount > PHL_CUDA_MAX_CHANNELS) {
@@ -70,28 +87,149 @@ torch::Tensor PermutohedralFilter(torch::Tensor input, torch::Tensor features) {
                              }));
     SWITCH_AB(CASE, PHL_CUDA_MAX_CHANNELS, PHL_CUDA_MAX_FEATURES, channelCount, featureCount);
 
-  } else {
-#endif
-    AT_DISPATCH_FLOATING_TYPES(
-        data.scalar_type(), "PermutohedralCPU", ([&] {
-          for (int batchIndex = 0; batchIndex < batchCount; batchIndex++) {
-            scalar_t* offsetData = data.data_ptr<scalar_t>() + batchIndex * batchStride;
-            scalar_t* offsetFeatures = features.data_ptr<scalar_t>() + batchIndex * featureCount * elementCount;
-            PermutohedralCPU<scalar_t>(offsetData, offsetFeatures, channelCount, featureCount, elementCount);
-          }
-        }));
-#ifdef WITH_CUDA
-  }
-#endif
-
 // movedim not support in torch < 1.7.1
 #if MONAI_TORCH_VERSION >= 10701
-  data = data.movedim(-1, 1);
+    data = data.movedim(-1, 1);
 #else
-  for (int i = input.dim() - 1; i > 1; i--) {
-    data = data.transpose(i - 1, i);
+    for (int i = input.dim() - 1; i > 1; i--) {
+      data = data.transpose(i - 1, i);
+    }
+#endif
+
+    return data;
   }
 #endif
 
-  return data;
+  // The CPU lattice reads values and features channel first, no permuted copies are needed.
+  features = features.contiguous();
+  torch::Tensor output = torch::empty_like(input);
+
+  AT_DISPATCH_FLOATING_TYPES(input.scalar_type(), "PermutohedralCPU", ([&] {
+                               PermutohedralBatchCPU(batchCount, elementCount, [&](int batchIndex) {
+                                 PermutohedralCPU<scalar_t>(
+                                     input.data_ptr<scalar_t>() + batchIndex * batchStride,
+                                     output.data_ptr<scalar_t>() + batchIndex * batchStride,
+                                     channelCount,
+                                     elementCount,
+                                     PermutohedralFeaturesCPU<scalar_t>(features, batchIndex),
+                                     elementCount);
+                               });
+                             }));
+
+  return output;
+}
+
+std::tuple<torch::Tensor, torch::Tensor>
+PermutohedralFilterBackward(torch::Tensor gradOutput, torch::Tensor input, torch::Tensor features) {
+  if (input.is_cuda()) {
+    throw std::runtime_error("PHL filter backward is only implemented for CPU tensors");
+  }
+
+  input = input.contiguous();
+  features = features.contiguous();
+  gradOutput = gradOutput.contiguous();
+
+  int batchCount = input.size(0);
+  int64_t batchStride = input.stride(0);
+  int elementCount = input.stride(1);
+  int channelCount = input.size(1);
+
+  torch::Tensor gradInput = torch::empty_like(input);
+  torch::Tensor gradFeatures = torch::empty_like(features);
+
+  AT_DISPATCH_FLOATING_TYPES(input.scalar_type(), "PermutohedralBackwardCPU", ([&] {
+                               PermutohedralBatchCPU(batchCount, elementCount, [&](int batchIndex) {
+                                 PermutohedralBackwardCPU<scalar_t>(
+                                     input.data_ptr<scalar_t>() + batchIndex * batchStride,
+                                     gradOutput.data_ptr<scalar_t>() + batchIndex * batchStride,
+                                     gradInput.data_ptr<scalar_t>() + batchIndex * batchStride,
+                                     gradFeatures.data_ptr<scalar_t>() + batchIndex * features.stride(0),
+                                     channelCount,
+                                     elementCount,
+                                     PermutohedralFeaturesCPU<scalar_t>(features, batchIndex),
+                                     elementCount);
+                               });
+                             }));
+
+  return {gradInput, gradFeatures};
+}
+
+PermutohedralLatticeHandle::PermutohedralLatticeHandle(torch::Tensor features) {
+  if (features.is_cuda()) {
+    throw std::runtime_error("PermutohedralLattice is only implemented for CPU tensors");
+  }
+
+  scalarType = features.scalar_type();
+  elementCount = features.numel() / (features.size(0) * features.size(1));
+
+  for (int i = 2; i < features.dim(); i++) {
+    spatialSizes.push_back(features.size(i));
+  }
+
+  int batchCount = features.size(0);
+  contiguousFeatures = features.contiguous();
+  lattices.assign(batchCount, NULL);
+
+  // The destructor does not run when the constructor throws, so the lattices built so far
+  // are released here, for instance when the features of a later batch element are out of range.
+  try {
+    AT_DISPATCH_FLOATING_TYPES(scalarType, "PermutohedralLatticeCPUCreate", ([&] {
+                                 PermutohedralBatchCPU(batchCount, elementCount, [&](int batchIndex) {
+                                   lattices[batchIndex] = PermutohedralLatticeCPUCreate<scalar_t>(
+                                       PermutohedralFeaturesCPU<scalar_t>(contiguousFeatures, batchIndex),
+                                       elementCount);
+                                 });
+                               }));
+  } catch (...) {
+    destroyLattices();
+    throw;
+  }
+}
+
+PermutohedralLatticeHandle::~PermutohedralLatticeHandle() {
+  destroyLattices();
+}
+
+void PermutohedralLatticeHandle::destroyLattices() {
+  AT_DISPATCH_FLOATING_TYPES(scalarType, "PermutohedralLatticeCPUDestroy", ([&] {
+                               for (void* lattice : lattices) {
+                                 PermutohedralLatticeCPUDestroy<scalar_t>(
+                                     static_cast<PermutohedralLattice<scalar_t>*>(lattice));
+                               }
+                             }));
+}
+
+torch::Tensor PermutohedralLatticeHandle::filter(torch::Tensor input) {
+  if (input.is_cuda() || input.scalar_type() != scalarType) {
+    throw std::runtime_error("PermutohedralLattice input must be a CPU tensor of the features dtype");
+  }
+
+  bool sizesMatch = input.size(0) == (int64_t)lattices.size() && input.dim() - 2 == (int64_t)spatialSizes.size();
+
+  for (int i = 2; sizesMatch && i < input.dim(); i++) {
+    sizesMatch = input.size(i) == spatialSizes[i - 2];
+  }
+
+  if (!sizesMatch) {
+    throw std::runtime_error("PermutohedralLattice input must match the batch and spatial sizes of the features");
+  }
+
+  int batchCount = input.size(0);
+  int channelCount = input.size(1);
+
+  input = input.contiguous();
+  torch::Tensor output = torch::empty_like(input);
+
+  AT_DISPATCH_FLOATING_TYPES(scalarType, "PermutohedralLatticeCPUFilter", ([&] {
+                               PermutohedralBatchCPU(batchCount, elementCount, [&](int batchIndex) {
+                                 PermutohedralLatticeCPUFilter<scalar_t>(
+                                     static_cast<PermutohedralLattice<scalar_t>*>(lattices[batchIndex]),
+                                     input.data_ptr<scalar_t>() + batchIndex * input.stride(0),
+                                     output.data_ptr<scalar_t>() + batchIndex * output.stride(0),
+                                     channelCount,
+                                     elementCount);
+                               });
+                             }));
+
+  return output;
 }
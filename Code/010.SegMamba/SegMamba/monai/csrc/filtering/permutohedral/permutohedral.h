@@ -14,15 +14,195 @@ limitations under the License.
 #pragma once
 
 #include <torch/extension.h>
+#include <ATen/Parallel.h>
+#include <vector>
 
 #define PHL_CUDA_MAX_CHANNELS 16
 #define PHL_CUDA_MAX_FEATURES 19
 
+// Smallest number of elements per thread-local table in the parallel CPU splat.
+#define PHL_CPU_MIN_SPLAT_SLAB 4096
+
+// CPU lattice hash tables start out sized for one vertex per PHL_CPU_ELEMENTS_PER_VERTEX
+// elements and grow as needed. Smoothing lattices have far fewer vertices than elements.
+#define PHL_CPU_ELEMENTS_PER_VERTEX 16
+
+// Elements per chunk whose weights a compact CPU lattice recomputes concurrently when splatting.
+#define PHL_CPU_SPLAT_CHUNK 65536
+
+// Grain sizes (vertices and elements) of the parallel CPU blur and slice.
+#define PHL_CPU_BLUR_GRAIN_SIZE 2048
+#define PHL_CPU_SLICE_GRAIN_SIZE 4096
+
+// Batch elements with fewer elements than this are always filtered concurrently, their
+// lattices are too small to be split across threads.
+#define PHL_CPU_MIN_PARALLEL_LATTICE 8192
+
+// CPU lattice keys pack every coordinate into a PHL_CPU_KEY_BITS wide field of 64-bit
+// words, PHL_CPU_KEY_FIELDS fields per word, allowing coordinates up to +-2^20.
+#define PHL_CPU_KEY_BITS 21
+#define PHL_CPU_KEY_FIELDS 3
+
+// Position vectors of the CPU lattice, read channel first. The position of element e holds
+// the channels values data[e + f * channelStride] * scale, followed by its spatialDimensions
+// coordinates times spatialScale (preceded by them if spatialFirst is set). The coordinates
+// are derived from e with the spatialStrides of a contiguous volume, so spatial features
+// need not be stored.
+template <typename scalar_t>
+struct PermutohedralFeatures {
+  const scalar_t* data;
+  int channels;
+  int channelStride;
+  scalar_t scale;
+
+  int spatialDimensions;
+  const int* spatialStrides;
+  scalar_t spatialScale;
+  bool spatialFirst;
+
+  int count() const {
+    return channels + spatialDimensions;
+  }
+
+  // Index of the first channel feature within a position.
+  int channelOffset() const {
+    return spatialFirst ? spatialDimensions : 0;
+  }
+
+  inline void position(int element, scalar_t* position) const {
+    scalar_t* channelPosition = position + channelOffset();
+    scalar_t* spatialPosition = spatialFirst ? position : position + channels;
+
+    for (int f = 0; f < channels; f++) {
+      channelPosition[f] = scale * data[element + (int64_t)f * channelStride];
+    }
+
+    int offsetRemainder = element;
+
+    for (int i = 0; i < spatialDimensions; i++) {
+      int coord = offsetRemainder / spatialStrides[i];
+      offsetRemainder -= coord * spatialStrides[i];
+
+      spatialPosition[i] = spatialScale * coord;
+    }
+  }
+};
+
+// Makes CPU lattices built from now on keep only the vertex indices of their replay and
+// recompute the barycentric weights from the features whenever they splat or slice. Per
+// element and simplex vertex this cuts the replay from a 4 byte index plus a float (8) or
+// double (12) weight, and a further 4 bytes of splat index for reusable lattices, to the
+// 4 byte index. The results are unchanged, filtering is slower. Off by default.
+inline bool& PermutohedralCompactReplayStorage() {
+  static bool compact = false;
+  return compact;
+}
+
+inline void SetPermutohedralCompactReplay(bool compact) {
+  PermutohedralCompactReplayStorage() = compact;
+}
+
+inline bool GetPermutohedralCompactReplay() {
+  return PermutohedralCompactReplayStorage();
+}
+
+template <typename scalar_t>
+class PermutohedralLattice;
+
+// Runs filterBatch(batchIndex) for every batch element on the CPU, splitting the threads
+// between batch elements and the lattice of each element. Whole rounds of get_num_threads()
+// elements run concurrently, each with a serial lattice (at::parallel_for runs inline when
+// nested), and the remaining elements run one after another with parallel lattices.
+template <typename Function>
+void PermutohedralBatchCPU(int batchCount, int elementCount, const Function& filterBatch) {
+  int concurrentCount = batchCount;
+
+  if (elementCount >= PHL_CPU_MIN_PARALLEL_LATTICE) {
+    concurrentCount -= batchCount % at::get_num_threads();
+  }
+
+  at::parallel_for(0, concurrentCount, 1, [&](int64_t start, int64_t end) {
+    for (int64_t batchIndex = start; batchIndex < end; batchIndex++) {
+      filterBatch(batchIndex);
+    }
+  });
+
+  for (int batchIndex = concurrentCount; batchIndex < batchCount; batchIndex++) {
+    filterBatch(batchIndex);
+  }
+}
+
+// Values are read from input and written to output channel first, element e of channel c at
+// e + c * channelStride. Input and output may alias.
+template <typename scalar_t>
+void PermutohedralCPU(
+    const scalar_t* input,
+    scalar_t* output,
+    int dataChannels,
+    int channelStride,
+    const PermutohedralFeatures<scalar_t>& features,
+    int elementCount);
+// Gradients of PermutohedralCPU with respect to the values and, unless gradFeatures is NULL,
+// the channel features, both channel first like the forward arrays.
+template <typename scalar_t>
+void PermutohedralBackwardCPU(
+    const scalar_t* input,
+    const scalar_t* gradOutput,
+    scalar_t* gradInput,
+    scalar_t* gradFeatures,
+    int dataChannels,
+    int channelStride,
+    const PermutohedralFeatures<scalar_t>& features,
+    int elementCount);
+// Lattices for repeated filtering, with the splat index of the lattice (see PermutohedralLattice).
 template <typename scalar_t>
-void PermutohedralCPU(scalar_t* data, scalar_t* features, int dataChannels, int featureChannels, int elementCount);
+PermutohedralLattice<scalar_t>* PermutohedralLatticeCPUCreate(
+    const PermutohedralFeatures<scalar_t>& features,
+    int elementCount);
+template <typename scalar_t>
+void PermutohedralLatticeCPUFilter(
+    PermutohedralLattice<scalar_t>* lattice,
+    const scalar_t* input,
+    scalar_t* output,
+    int dataChannels,
+    int channelStride);
+template <typename scalar_t>
+void PermutohedralLatticeCPUDestroy(PermutohedralLattice<scalar_t>* lattice);
 #ifdef WITH_CUDA
 template <typename scalar_t, int dc, int fc>
 void PermutohedralCuda(scalar_t* data, scalar_t* features, int elementCount, bool accurate);
 #endif
 
 torch::Tensor PermutohedralFilter(torch::Tensor input, torch::Tensor features);
+std::tuple<torch::Tensor, torch::Tensor>
+PermutohedralFilterBackward(torch::Tensor gradOutput, torch::Tensor input, torch::Tensor features);
+
+// Permutohedral lattice built once from a (batch, features, spatial...) tensor on the CPU,
+// used to filter any number of (batch, channels, spatial...) tensors with the same features.
+// Besides the replay of a one-shot filter, it keeps a splat index of 4 bytes per element and
+// feature plus 4 bytes per lattice vertex, which lets every filter splat concurrently, unless
+// it is built with a compact replay. It keeps a reference to the features, which must not be
+// modified in place while it is in use.
+class PermutohedralLatticeHandle {
+ public:
+  PermutohedralLatticeHandle(torch::Tensor features);
+  ~PermutohedralLatticeHandle();
+
+  PermutohedralLatticeHandle(const PermutohedralLatticeHandle&) = delete;
+  PermutohedralLatticeHandle& operator=(const PermutohedralLatticeHandle&) = delete;
+
+  torch::Tensor filter(torch::Tensor input);
+
+ private:
+  void destroyLattices();
+
+  torch::ScalarType scalarType;
+  std::vector<int64_t> spatialSizes;
+  int elementCount;
+
+  // Features of the lattices, read again by lattices with a compact replay.
+  torch::Tensor contiguousFeatures;
+
+  // One PermutohedralLattice<scalar_t> per batch element.
+  std::vector<void*> lattices;
+};
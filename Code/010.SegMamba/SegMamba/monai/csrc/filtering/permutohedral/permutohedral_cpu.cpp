@@ -42,6 +42,13 @@ SOFTWARE.
 #include <string.h>
 
 #include <torch/extension.h>
+#include <ATen/Parallel.h>
+#include <stdint.h>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include "permutohedral.h"
 
 using namespace std;
 
@@ -50,23 +57,31 @@ using namespace std;
  *
  * The lattice points are stored sparsely using a hash table.
  * The key for each point is its spatial location in the (d+1)-
- * dimensional space.
+ * dimensional space. The d stored coordinates are biased and packed
+ * into the fields of keyWords 64-bit words (see PHL_CPU_KEY_BITS), so
+ * keys of up to three coordinates compare as one integer and up to six
+ * as two. Vertices are numbered in insertion order.
  */
 /***************************************************************/
-template <typename scalar_t>
 class HashTablePermutohedral {
  public:
   /* Constructor
-   *  kd_: the dimensionality of the position vectors on the hyperplane.
-   *  vd_: the dimensionality of the value vectors
+   *           kd_: the dimensionality of the position vectors on the hyperplane.
+   *  expectedSize: estimate of the number of keys, the table is sized to hold
+   *                them without growing and doubles whenever it is half full.
    */
-  HashTablePermutohedral(int kd_, int vd_) : kd(kd_), vd(vd_) {
-    capacity = 1 << 15;
+  HashTablePermutohedral(int kd_, int expectedSize) : kd(kd_), keyWords(wordCount(kd_)) {
+    capacity = 1 << 10;
+    while (capacity / 2 - 1 <= (size_t)expectedSize)
+      capacity *= 2;
     filled = 0;
-    entries = new Entry[capacity];
-    keys = new short[kd * capacity / 2];
-    values = new scalar_t[vd * capacity / 2];
-    memset(values, 0, sizeof(scalar_t) * vd * capacity / 2);
+    entries.assign(capacity, -1);
+    keys.resize(keyWords * capacity / 2);
+  }
+
+  // Returns the number of 64-bit words of a key with kd coordinates.
+  static int wordCount(int kd) {
+    return (kd + PHL_CPU_KEY_FIELDS - 1) / PHL_CPU_KEY_FIELDS;
   }
 
   // Returns the number of vectors stored.
@@ -75,137 +90,110 @@ class HashTablePermutohedral {
   }
 
   // Returns a pointer to the keys array.
-  short* getKeys() {
-    return keys;
-  }
-
-  // Returns a pointer to the values array.
-  scalar_t* getValues() {
-    return values;
+  uint64_t* getKeys() {
+    return keys.data();
   }
 
-  /* Returns the index into the hash table for a given key.
-   *     key: a pointer to the position vector.
-   *       h: hash of the position vector.
-   *  create: a flag specifying whether an entry should be created,
-   *          should an entry with the given key not found.
+  /* Returns the vertex index of a given key, or -1 if not found.
+   *    key : pointer to the keyWords packed words of the key.
+   * create : true if a non-existing key should be created. Lookups
+   *          without create do not modify the table and may run concurrently.
    */
-  int lookupOffset(short* key, size_t h, bool create = true) {
-    // Double hash table size if necessary
-    if (filled >= (capacity / 2) - 1) {
+  int lookup(const uint64_t* key, bool create = true) {
+    // Double hash table size if necessary. This must happen before hashing, so the
+    // bucket is computed for the final capacity.
+    if (create && (size_t)filled >= (capacity / 2) - 1) {
       grow();
     }
 
+    size_t h = hash(key) & (capacity - 1);
+
     // Find the entry with the given key
     while (1) {
-      Entry e = entries[h];
+      int vertex = entries[h];
       // check if the cell is empty
-      if (e.keyIdx == -1) {
+      if (vertex == -1) {
         if (!create)
           return -1; // Return not found.
         // need to create an entry. Store the given key.
-        for (int i = 0; i < kd; i++)
-          keys[filled * kd + i] = key[i];
-        e.keyIdx = filled * kd;
-        e.valueIdx = filled * vd;
-        entries[h] = e;
-        filled++;
-        return e.valueIdx;
+        memcpy(&keys[(size_t)filled * keyWords], key, sizeof(uint64_t) * keyWords);
+        entries[h] = filled;
+        return filled++;
       }
 
       // check if the cell has a matching key
-      bool match = true;
-      for (int i = 0; i < kd && match; i++)
-        match = keys[e.keyIdx + i] == key[i];
-      if (match)
-        return e.valueIdx;
+      if (equal(&keys[(size_t)vertex * keyWords], key))
+        return vertex;
 
       // increment the bucket with wraparound
-      h++;
-      if (h == capacity)
-        h = 0;
+      h = (h + 1) & (capacity - 1);
     }
   }
 
-  /* Looks up the value vector associated with a given key vector.
-   *        k : pointer to the key vector to be looked up.
-   *   create : true if a non-existing key should be created.
+  /* Hash function used in this implementation. The words are combined multiplicatively
+   * and finalized with a round of the MurmurHash3 mixer, so every coordinate reaches
+   * the low bits used for the bucket.
    */
-  scalar_t* lookup(short* k, bool create = true) {
-    size_t h = hash(k) % capacity;
-    int offset = lookupOffset(k, h, create);
-    if (offset < 0)
-      return NULL;
-    else
-      return values + offset;
-  };
-
-  /* Hash function used in this implementation. A simple base conversion. */
-  size_t hash(const short* key) {
-    size_t k = 0;
-    for (int i = 0; i < kd; i++) {
-      k += key[i];
-      k *= 2531011;
-    }
+  size_t hash(const uint64_t* key) {
+    uint64_t k = key[0];
+    for (int i = 1; i < keyWords; i++)
+      k = k * 0x9e3779b97f4a7c15ULL ^ key[i];
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
     return k;
   }
 
  private:
+  bool equal(const uint64_t* a, const uint64_t* b) {
+    switch (keyWords) {
+      case 1:
+        return a[0] == b[0];
+      case 2:
+        return ((a[0] ^ b[0]) | (a[1] ^ b[1])) == 0;
+      default:
+        return memcmp(a, b, sizeof(uint64_t) * keyWords) == 0;
+    }
+  }
+
   /* Grows the size of the hash table */
   void grow() {
     size_t oldCapacity = capacity;
     capacity *= 2;
 
-    // Migrate the value vectors.
-    scalar_t* newValues = new scalar_t[vd * capacity / 2];
-    memset(newValues, 0, sizeof(scalar_t) * vd * capacity / 2);
-    memcpy(newValues, values, sizeof(scalar_t) * vd * filled);
-    delete[] values;
-    values = newValues;
-
     // Migrate the key vectors.
-    short* newKeys = new short[kd * capacity / 2];
-    memcpy(newKeys, keys, sizeof(short) * kd * filled);
-    delete[] keys;
-    keys = newKeys;
+    keys.resize(keyWords * capacity / 2);
 
-    Entry* newEntries = new Entry[capacity];
+    std::vector<int> newEntries(capacity, -1);
 
     // Migrate the table of indices.
     for (size_t i = 0; i < oldCapacity; i++) {
-      if (entries[i].keyIdx == -1)
+      if (entries[i] == -1)
         continue;
-      size_t h = hash(keys + entries[i].keyIdx) % capacity;
-      while (newEntries[h].keyIdx != -1) {
-        h++;
-        if (h == capacity)
-          h = 0;
+      size_t h = hash(&keys[(size_t)entries[i] * keyWords]) & (capacity - 1);
+      while (newEntries[h] != -1) {
+        h = (h + 1) & (capacity - 1);
       }
       newEntries[h] = entries[i];
     }
-    delete[] entries;
-    entries = newEntries;
+    entries.swap(newEntries);
   }
 
-  // Private struct for the hash table entries.
-  struct Entry {
-    Entry() : keyIdx(-1), valueIdx(-1) {}
-    int keyIdx;
-    int valueIdx;
-  };
-
-  short* keys;
-  scalar_t* values;
-  Entry* entries;
-  size_t capacity, filled;
-  int kd, vd;
+  std::vector<uint64_t> keys;
+  std::vector<int> entries;
+  size_t capacity;
+  int filled;
+  int kd, keyWords;
 };
 
 /***************************************************************/
 /* The algorithm class that performs the filter
  *
- * PermutohedralLattice::filter(...) does all the work.
- *
+ * The lattice is built once from the position (feature) vectors, which
+ * hashes the simplex vertices, records the splat weights and builds the
+ * blur stencil. PermutohedralLattice::filter(...) then filters any number
+ * of value vectors against the same positions. Lattices built to be reused
+ * also index the splat weights by vertex, see buildSplatIndex.
  */
 /***************************************************************/
 template <typename scalar_t>
@@ -215,66 +203,39 @@ class PermutohedralLattice {
    *   im : image to be bilateral-filtered.
    *  ref : reference image whose edges are to be respected.
    */
-  static void filter(scalar_t* data, scalar_t* features, int dataChannels, int featureChannels, int elementCount) {
-    // Create lattice
-    PermutohedralLattice lattice(featureChannels, dataChannels + 1, elementCount);
-
-    // Splat into the lattice
-    scalar_t* col = new scalar_t[dataChannels + 1];
-    col[dataChannels] = 1; // homogeneous coordinate
-
-    for (int i = 0, e = 0; e < elementCount; e++) {
-      for (int c = 0; c < dataChannels; c++, i++) {
-        col[c] = data[i];
-      }
-
-      scalar_t* featureVec = features + e * featureChannels;
-      lattice.splat(featureVec, col);
-    }
-
-    // Blur the lattice
-    lattice.blur();
-
-    // Slice from the lattice
-    lattice.beginSlice();
-
-    for (int i = 0, e = 0; e < elementCount; e++) {
-      lattice.slice(col);
-
-      scalar_t scale = 1.0f / col[dataChannels];
-      for (int c = 0; c < dataChannels; c++, i++) {
-        data[i] = col[c] * scale;
-      }
-    }
+  static void filter(
+      const scalar_t* input,
+      scalar_t* output,
+      int dataChannels,
+      int channelStride,
+      const PermutohedralFeatures<scalar_t>& features,
+      int elementCount) {
+    PermutohedralLattice lattice(features, elementCount, false);
+    lattice.filter(input, output, dataChannels, channelStride);
   }
 
   /* Constructor
-   *     d_ : dimensionality of key vectors
-   *    vd_ : dimensionality of value vectors
-   * nData_ : number of points in the input
+   *  features_ : source of the position vectors, of dimensionality d. With a compact replay
+   *              they are read again by every filter, so they must outlive the lattice.
+   *     nData_ : number of points in the input
+   * splatIndex : index the splat weights by vertex, which splats concurrently at the cost
+   *              of 4 bytes per replay entry (see buildSplatIndex). Worth it for lattices
+   *              that filter several times. Ignored with a compact replay or beyond
+   *              2^32 replay entries.
    */
-  PermutohedralLattice(int d_, int vd_, int nData_) : d(d_), vd(vd_), nData(nData_), hashTable(d_, vd_) {
+  PermutohedralLattice(const PermutohedralFeatures<scalar_t>& features_, int nData_, bool splatIndex)
+      : d(features_.count()),
+        nData(nData_),
+        features(features_),
+        keyWords(HashTablePermutohedral::wordCount(features_.count())),
+        hashTable(features_.count(), nData_ / PHL_CPU_ELEMENTS_PER_VERTEX) {
     // Allocate storage for various arrays
-    elevated = new scalar_t[d + 1];
-    scaleFactor = new scalar_t[d];
-
-    greedy = new short[d + 1];
-    rank = new char[d + 1];
-    barycentric = new scalar_t[d + 2];
-    replay = new ReplayEntry[nData * (d + 1)];
-    nReplay = 0;
-    canonical = new short[(d + 1) * (d + 1)];
-    key = new short[d + 1];
-
-    // compute the coordinates of the canonical simplex, in which
-    // the difference between a contained point and the zero
-    // remainder vertex is always in ascending order. (See pg.4 of paper.)
-    for (int i = 0; i <= d; i++) {
-      for (int j = 0; j <= d - i; j++)
-        canonical[i * (d + 1) + j] = i;
-      for (int j = d - i + 1; j <= d; j++)
-        canonical[i * (d + 1) + j] = i - (d + 1);
-    }
+    scaleFactor.resize(d);
+    keyShift.resize(d);
+
+    replayVertex.resize((size_t)nData * (d + 1));
+    if (!GetPermutohedralCompactReplay())
+      replayWeight.resize((size_t)nData * (d + 1));
 
     // Compute parts of the rotation matrix E. (See pg.4-5 of paper.)
     for (int i = 0; i < d; i++) {
@@ -294,11 +255,280 @@ class PermutohedralLattice {
        * So we need to scale the space by (d+1)sqrt(2/3).
        */
       scaleFactor[i] *= (d + 1) * sqrtf(2.0 / 3);
+
+      keyShift[i] = PHL_CPU_KEY_BITS * (i % PHL_CPU_KEY_FIELDS);
     }
+
+    // Keys and blur neighbor keys stay within their fields as long as the elevated
+    // positions are within keyLimit, see locate.
+    keyBias = 1 << (PHL_CPU_KEY_BITS - 1);
+    keyLimit = keyBias - 4 * (d + 1);
+
+    // 1 in the field of every stored coordinate.
+    keyOnes.assign(keyWords, 0);
+    for (int i = 0; i < d; i++)
+      keyOnes[i / PHL_CPU_KEY_FIELDS] += (uint64_t)1 << keyShift[i];
+
+    // Find the simplex of every element, then index the interactions by vertex for
+    // splatting (if requested) and the lattice neighbors for blurring. A compact lattice
+    // does not index its interactions, the index would double its replay. Neither does a
+    // lattice with more interactions than the 32-bit index can address.
+    splatPositions();
+    if (splatIndex && !replayWeight.empty() && (int64_t)nData * (d + 1) <= UINT32_MAX)
+      buildSplatIndex();
+    buildBlurNeighbors();
+  }
+
+  PermutohedralLattice(const PermutohedralLattice&) = delete;
+  PermutohedralLattice& operator=(const PermutohedralLattice&) = delete;
+
+  // Returns the number of lattice vertices.
+  int size() {
+    return hashTable.size();
   }
 
-  /* Performs splatting with given position and value vectors */
-  void splat(scalar_t* position, scalar_t* value) {
+  /* Filters nData value vectors of dataChannels values each, stored channel first
+   * (see PermutohedralCPU): splat, blur and slice, normalised by the homogeneous weight.
+   */
+  void filter(const scalar_t* input, scalar_t* output, int dataChannels, int channelStride) {
+    int vd = dataChannels + 1;
+    std::vector<scalar_t> values((size_t)size() * vd);
+
+    splat(input, dataChannels, channelStride, values.data());
+    blur(values.data(), vd);
+
+    at::parallel_for(0, nData, PHL_CPU_SLICE_GRAIN_SIZE, [&](int64_t start, int64_t end) {
+      std::vector<scalar_t> col(vd);
+      SplatScratch scratch(d, keyWords);
+
+      for (int64_t e = start; e < end; e++) {
+        slice(values.data(), vd, col.data(), e, scratch);
+
+        scalar_t scale = 1.0f / col[dataChannels];
+        for (int c = 0; c < dataChannels; c++) {
+          output[e + (int64_t)c * channelStride] = col[c] * scale;
+        }
+      }
+    });
+  }
+
+  /* Gradients of filter with respect to the input values, written to gradInput, and to the
+   * channel features of the positions, written to gradFeatures (channel first, see
+   * PermutohedralFeatures) unless it is NULL. The spatial features are not differentiated.
+   * The unnormalised filter is slice * blur * splat, its transpose splats, blurs with the
+   * axes in reverse order and slices. The features enter through the barycentric weights.
+   */
+  void backward(
+      const scalar_t* input,
+      const scalar_t* gradOutput,
+      scalar_t* gradInput,
+      scalar_t* gradFeatures,
+      int dataChannels,
+      int channelStride) {
+    int vd = dataChannels + 1;
+    std::vector<scalar_t> values((size_t)size() * vd);
+    std::vector<scalar_t> gradValues((size_t)size() * vd);
+    std::vector<scalar_t> gradSliced((size_t)nData * vd);
+
+    splat(input, dataChannels, channelStride, values.data());
+    blur(values.data(), vd);
+
+    // Gradient of the sliced values and weight, channel first, from output = values / weight.
+    at::parallel_for(0, nData, PHL_CPU_SLICE_GRAIN_SIZE, [&](int64_t start, int64_t end) {
+      std::vector<scalar_t> col(vd);
+      SplatScratch scratch(d, keyWords);
+
+      for (int64_t e = start; e < end; e++) {
+        slice(values.data(), vd, col.data(), e, scratch);
+
+        scalar_t scale = 1.0f / col[dataChannels];
+        scalar_t gradWeight = 0;
+        for (int c = 0; c < dataChannels; c++) {
+          scalar_t grad = gradOutput[e + (int64_t)c * channelStride] * scale;
+          gradSliced[e + (int64_t)c * nData] = grad;
+          gradWeight -= grad * col[c] * scale;
+        }
+        gradSliced[e + (int64_t)dataChannels * nData] = gradWeight;
+      }
+    });
+
+    splat(gradSliced.data(), vd, nData, gradValues.data(), false);
+    blur(gradValues.data(), vd, true);
+
+    at::parallel_for(0, nData, PHL_CPU_SLICE_GRAIN_SIZE, [&](int64_t start, int64_t end) {
+      std::vector<scalar_t> col(vd);
+      std::vector<scalar_t> gradBarycentric(d + 2);
+      SplatScratch scratch(d, keyWords);
+
+      for (int64_t e = start; e < end; e++) {
+        // A weight scales the element's values into its vertex when splatting, and the vertex
+        // into the element when slicing.
+        if (gradFeatures) {
+          const uint32_t* elementVertices = &replayVertex[e * (d + 1)];
+
+          for (int r = 0; r <= d; r++) {
+            const scalar_t* value = &values[(size_t)elementVertices[r] * vd];
+            const scalar_t* gradValue = &gradValues[(size_t)elementVertices[r] * vd];
+            scalar_t grad =
+                gradValue[dataChannels] + gradSliced[e + (int64_t)dataChannels * nData] * value[dataChannels];
+
+            for (int c = 0; c < dataChannels; c++)
+              grad += input[e + (int64_t)c * channelStride] * gradValue[c] +
+                  gradSliced[e + (int64_t)c * nData] * value[c];
+
+            gradBarycentric[r] = grad;
+          }
+
+          featureGradient(e, gradBarycentric.data(), gradFeatures, scratch);
+        }
+
+        slice(gradValues.data(), vd, col.data(), e, scratch);
+        for (int c = 0; c < dataChannels; c++)
+          gradInput[e + (int64_t)c * channelStride] = col[c];
+      }
+    });
+  }
+
+ private:
+  // Per thread scratch space of the splatting step.
+  struct SplatScratch {
+    SplatScratch(int d, int keyWords)
+        : position(d), elevated(d + 1), barycentric(d + 2), greedy(d + 1), rank(d + 1), order(d + 1), key(keyWords) {}
+
+    std::vector<scalar_t> position, elevated, barycentric;
+    std::vector<int> greedy;
+    std::vector<char> rank;
+    std::vector<int> order;
+    std::vector<uint64_t> key;
+  };
+
+  /* Returns the d + 1 barycentric weights of an element, from the replay or, for a compact
+   * replay, recomputed into the scratch space.
+   */
+  const scalar_t* elementWeights(int64_t element, SplatScratch& splatScratch) {
+    if (!replayWeight.empty())
+      return &replayWeight[element * (d + 1)];
+
+    features.position(element, splatScratch.position.data());
+    simplex(splatScratch.position.data(), splatScratch);
+    return splatScratch.barycentric.data();
+  }
+
+  /* Finds the enclosing simplex and barycentric weights of every position. Slabs of
+   * elements are located concurrently, creating vertices in thread-local hash tables,
+   * which are then merged into the lattice in slab order. Vertices therefore get the
+   * same ids as in a serial pass.
+   */
+  void splatPositions() {
+    int slabCount = std::max<int64_t>(1, std::min<int64_t>(at::get_num_threads(), nData / PHL_CPU_MIN_SPLAT_SLAB));
+
+    if (slabCount == 1) {
+      SplatScratch scratch(d, keyWords);
+      locateSlab(0, nData, hashTable, scratch);
+      return;
+    }
+
+    // Owning the slab tables here releases them when locating a slab throws.
+    std::vector<std::unique_ptr<HashTablePermutohedral>> slabTables(slabCount);
+
+    at::parallel_for(0, slabCount, 1, [&](int64_t start, int64_t end) {
+      SplatScratch scratch(d, keyWords);
+
+      for (int64_t s = start; s < end; s++) {
+        int64_t slabBegin = nData * s / slabCount;
+        int64_t slabEnd = nData * (s + 1) / slabCount;
+        slabTables[s].reset(new HashTablePermutohedral(d, (slabEnd - slabBegin) / PHL_CPU_ELEMENTS_PER_VERTEX));
+        locateSlab(slabBegin, slabEnd, *slabTables[s], scratch);
+      }
+    });
+
+    // Merge the slab tables, remapping their vertex ids to the ids in the lattice.
+    std::vector<std::vector<int>> slabRemap(slabCount);
+
+    for (int s = 0; s < slabCount; s++) {
+      HashTablePermutohedral& slabTable = *slabTables[s];
+      slabRemap[s].resize(slabTable.size());
+
+      for (int v = 0; v < slabTable.size(); v++) {
+        slabRemap[s][v] = hashTable.lookup(slabTable.getKeys() + (size_t)v * keyWords, true);
+      }
+
+      slabTables[s].reset();
+    }
+
+    at::parallel_for(0, slabCount, 1, [&](int64_t start, int64_t end) {
+      for (int64_t s = start; s < end; s++) {
+        for (int64_t e = nData * s / slabCount; e < nData * (s + 1) / slabCount; e++) {
+          for (int r = 0; r <= d; r++) {
+            uint32_t& vertex = replayVertex[e * (d + 1) + r];
+            vertex = slabRemap[s][vertex];
+          }
+        }
+      }
+    });
+  }
+
+  /* Locates elements [begin, end) in the given table. */
+  void locateSlab(int64_t begin, int64_t end, HashTablePermutohedral& table, SplatScratch& scratch) {
+    for (int64_t e = begin; e < end; e++) {
+      features.position(e, scratch.position.data());
+      locate(scratch.position.data(), table, e * (d + 1), scratch);
+    }
+  }
+
+  /* Finds the simplex enclosing the given position vector, creating its vertices in the
+   * given table, and records the d + 1 interactions from replay index elementReplay on.
+   */
+  void locate(
+      scalar_t* position,
+      HashTablePermutohedral& table,
+      int64_t elementReplay,
+      SplatScratch& splatScratch) {
+    simplex(position, splatScratch);
+
+    scalar_t* barycentric = splatScratch.barycentric.data();
+    char* myrank = splatScratch.rank.data();
+    int* mygreedy = splatScratch.greedy.data();
+    uint64_t* key = splatScratch.key.data();
+
+    // Record the vertices of the simplex and their barycentric weights. The key holds all but
+    // the last coordinate - it's redundant because they sum to zero. The vertex of remainder 0
+    // is the greedy point, every following vertex is offset by the next vertex of the canonical
+    // simplex: 1 in all coordinates and 1 - (d + 1) in the coordinate of rank d + 1 - remainder
+    // (See pg.4 of paper.) The packed key is updated in place.
+    int* myorder = splatScratch.order.data();
+    for (int i = 0; i <= d; i++)
+      myorder[(int)myrank[i]] = i;
+
+    for (int w = 0; w < keyWords; w++)
+      key[w] = 0;
+    for (int i = 0; i < d; i++)
+      key[i / PHL_CPU_KEY_FIELDS] += (uint64_t)(mygreedy[i] + keyBias) << keyShift[i];
+
+    for (int remainder = 0; remainder <= d; remainder++) {
+      if (remainder > 0) {
+        int i = myorder[d + 1 - remainder];
+        for (int w = 0; w < keyWords; w++)
+          key[w] += keyOnes[w];
+        if (i < d)
+          key[i / PHL_CPU_KEY_FIELDS] -= (uint64_t)(d + 1) << keyShift[i];
+      }
+
+      // Record this interaction to use later when splatting and slicing
+      replayVertex[elementReplay + remainder] = table.lookup(key, true);
+      if (!replayWeight.empty())
+        replayWeight[elementReplay + remainder] = barycentric[remainder];
+    }
+  }
+
+  /* Computes the elevated position, the zero remainder vertex (greedy), the rank of every
+   * coordinate and the barycentric weights of the simplex enclosing the given position
+   * vector, into the scratch arrays.
+   */
+  void simplex(scalar_t* position, SplatScratch& splatScratch) {
+    scalar_t* elevated = splatScratch.elevated.data();
+    scalar_t* barycentric = splatScratch.barycentric.data();
+
     // first rotate position into the (d+1)-dimensional hyperplane
     elevated[d] = -d * position[d - 1] * scaleFactor[d - 1];
     for (int i = d - 1; i > 0; i--)
@@ -306,10 +536,18 @@ class PermutohedralLattice {
           (elevated[i + 1] - i * position[i - 1] * scaleFactor[i - 1] + (i + 2) * position[i] * scaleFactor[i]);
     elevated[0] = elevated[1] + 2 * position[0] * scaleFactor[0];
 
+    // Coordinates beyond the key fields would alias other vertices once packed.
+    for (int i = 0; i <= d; i++) {
+      if (fabs(elevated[i]) > keyLimit) {
+        throw std::runtime_error(
+            "Permutohedral lattice position out of range, the scaled features exceed the lattice key range");
+      }
+    }
+
     // prepare to find the closest lattice points
     scalar_t scale = 1.0f / (d + 1);
-    char* myrank = rank;
-    short* mygreedy = greedy;
+    char* myrank = splatScratch.rank.data();
+    int* mygreedy = splatScratch.greedy.data();
 
     // greedily search for the closest zero-colored lattice point
     int sum = 0;
@@ -319,9 +557,9 @@ class PermutohedralLattice {
       scalar_t down = floorf(v) * (d + 1);
 
       if (up - elevated[i] < elevated[i] - down)
-        mygreedy[i] = (short)up;
+        mygreedy[i] = (int)up;
       else
-        mygreedy[i] = (short)down;
+        mygreedy[i] = (int)down;
 
       sum += mygreedy[i];
     }
@@ -329,7 +567,8 @@ class PermutohedralLattice {
 
     // rank differential to find the permutation between this simplex and the canonical one.
     // (See pg. 3-4 in paper.)
-    memset(myrank, 0, sizeof(char) * (d + 1));
+    for (int i = 0; i <= d; i++)
+      myrank[i] = 0;
     for (int i = 0; i < d; i++)
       for (int j = i + 1; j <= d; j++)
         if (elevated[i] - mygreedy[i] < elevated[j] - mygreedy[j])
@@ -366,95 +605,177 @@ class PermutohedralLattice {
       barycentric[d + 1 - myrank[i]] -= (elevated[i] - mygreedy[i]) * scale;
     }
     barycentric[0] += 1.0f + barycentric[d + 1];
+  }
 
-    // Splat the value into each vertex of the simplex, with barycentric weights.
-    for (int remainder = 0; remainder <= d; remainder++) {
-      // Compute the location of the lattice point explicitly (all but the last coordinate - it's redundant because they
-      // sum to zero)
-      for (int i = 0; i < d; i++)
-        key[i] = mygreedy[i] + canonical[remainder * (d + 1) + myrank[i]];
-
-      // Retrieve pointer to the value at this vertex.
-      scalar_t* val = hashTable.lookup(key, true);
-
-      // Accumulate values with barycentric weight.
-      for (int i = 0; i < vd; i++)
-        val[i] += barycentric[remainder] * value[i];
-
-      // Record this interaction to use later when slicing
-      replay[nReplay].offset = val - hashTable.getValues();
-      replay[nReplay].weight = barycentric[remainder];
-      nReplay++;
+  /* Backpropagates the gradients of the d + 1 barycentric weights of an element (gradBarycentric,
+   * with room for d + 2 values) to its channel features. Inside the enclosing simplex the
+   * weights are linear in the elevated position, which is linear in the position vector.
+   */
+  void featureGradient(int64_t element, scalar_t* gradBarycentric, scalar_t* gradFeatures, SplatScratch& splatScratch) {
+    features.position(element, splatScratch.position.data());
+    simplex(splatScratch.position.data(), splatScratch);
+
+    char* myrank = splatScratch.rank.data();
+    scalar_t* gradElevated = splatScratch.elevated.data();
+    scalar_t scale = 1.0f / (d + 1);
+
+    // See the barycentric coordinates in simplex, barycentric[d + 1] is folded into barycentric[0].
+    gradBarycentric[d + 1] = gradBarycentric[0];
+    for (int i = 0; i <= d; i++)
+      gradElevated[i] = (gradBarycentric[d - myrank[i]] - gradBarycentric[d + 1 - myrank[i]]) * scale;
+
+    // The rotation in simplex unrolls to elevated[i] = sum(position[k] * scaleFactor[k], k >= i)
+    // - i * position[i - 1] * scaleFactor[i - 1].
+    int channelOffset = features.channelOffset();
+    scalar_t gradPrefix = 0;
+    for (int k = 0; k < channelOffset; k++)
+      gradPrefix += gradElevated[k];
+    for (int f = 0, k = channelOffset; f < features.channels; f++, k++) {
+      gradPrefix += gradElevated[k];
+      gradFeatures[element + (int64_t)f * features.channelStride] =
+          features.scale * scaleFactor[k] * (gradPrefix - (k + 1) * gradElevated[k + 1]);
     }
   }
 
-  // Prepare for slicing
-  void beginSlice() {
-    nReplay = 0;
+  /* Sorts the interactions by vertex (a counting sort, keeping element order within a
+   * vertex), so splatting can gather per vertex instead of scattering per element. The
+   * index holds one 32-bit entry per interaction and one per vertex for the lifetime of the
+   * lattice, and the sort is serial, so it only pays off when the lattice splats several times.
+   */
+  void buildSplatIndex() {
+    int64_t entryCount = (int64_t)nData * (d + 1);
+    splatStart.assign((size_t)size() + 1, 0);
+    splatEntries.resize(entryCount);
+
+    for (int64_t r = 0; r < entryCount; r++)
+      splatStart[replayVertex[r] + 1]++;
+    for (int v = 0; v < size(); v++)
+      splatStart[v + 1] += splatStart[v];
+
+    std::vector<uint32_t> cursor(splatStart.begin(), splatStart.end() - 1);
+
+    for (int64_t r = 0; r < entryCount; r++)
+      splatEntries[cursor[replayVertex[r]]++] = r;
+  }
+
+  /* Splats the value vectors with their barycentric weights into the vertices, followed by the
+   * homogeneous coordinate if homogeneous is set. With a splat index every vertex gathers its
+   * own interactions, so vertices are splatted concurrently. Otherwise the elements are
+   * scattered serially, in chunks whose weights a compact lattice recomputes concurrently.
+   * Both add the interactions of a vertex in element order.
+   */
+  void splat(const scalar_t* input, int dataChannels, int channelStride, scalar_t* values, bool homogeneous = true) {
+    int vd = dataChannels + homogeneous;
+
+    if (splatStart.empty()) {
+      memset(values, 0, sizeof(scalar_t) * size() * vd);
+      std::vector<scalar_t> chunkWeights(replayWeight.empty() ? PHL_CPU_SPLAT_CHUNK * (d + 1) : 0);
+
+      for (int chunkBegin = 0; chunkBegin < nData; chunkBegin += PHL_CPU_SPLAT_CHUNK) {
+        int chunkEnd = std::min(nData, chunkBegin + PHL_CPU_SPLAT_CHUNK);
+        const scalar_t* weights = chunkWeights.data();
+
+        if (replayWeight.empty()) {
+          at::parallel_for(chunkBegin, chunkEnd, PHL_CPU_SLICE_GRAIN_SIZE, [&](int64_t start, int64_t end) {
+            SplatScratch scratch(d, keyWords);
+
+            for (int64_t e = start; e < end; e++) {
+              const scalar_t* elementWeight = elementWeights(e, scratch);
+              for (int i = 0; i <= d; i++)
+                chunkWeights[(e - chunkBegin) * (d + 1) + i] = elementWeight[i];
+            }
+          });
+        } else {
+          weights = &replayWeight[(int64_t)chunkBegin * (d + 1)];
+        }
+
+        for (int64_t e = chunkBegin; e < chunkEnd; e++) {
+          const scalar_t* value = input + e;
+
+          for (int i = 0; i <= d; i++) {
+            scalar_t weight = weights[(e - chunkBegin) * (d + 1) + i];
+            scalar_t* val = values + (size_t)replayVertex[e * (d + 1) + i] * vd;
+
+            for (int k = 0; k < dataChannels; k++)
+              val[k] += weight * value[(int64_t)k * channelStride];
+            if (homogeneous)
+              val[dataChannels] += weight;
+          }
+        }
+      }
+      return;
+    }
+
+    at::parallel_for(0, size(), PHL_CPU_BLUR_GRAIN_SIZE, [&](int64_t start, int64_t end) {
+      for (int64_t v = start; v < end; v++) {
+        scalar_t* val = values + v * vd;
+
+        for (int k = 0; k < vd; k++)
+          val[k] = 0;
+
+        for (uint32_t i = splatStart[v]; i < splatStart[v + 1]; i++) {
+          uint32_t r = splatEntries[i];
+          scalar_t weight = replayWeight[r];
+          const scalar_t* value = input + r / (d + 1);
+
+          for (int k = 0; k < dataChannels; k++)
+            val[k] += weight * value[(int64_t)k * channelStride];
+          if (homogeneous)
+            val[dataChannels] += weight;
+        }
+      }
+    });
   }
 
   /* Performs slicing out of position vectors. Note that the barycentric weights and the simplex
    * containing each position vector were calculated and stored in the splatting step.
    * We may reuse this to accelerate the algorithm. (See pg. 6 in paper.)
+   * Elements only read the lattice, so they can be sliced concurrently.
    */
-  void slice(scalar_t* col) {
-    scalar_t* base = hashTable.getValues();
+  void slice(scalar_t* values, int vd, scalar_t* col, int64_t element, SplatScratch& splatScratch) {
+    int64_t elementReplay = element * (d + 1);
+    const scalar_t* weights = elementWeights(element, splatScratch);
     for (int j = 0; j < vd; j++)
       col[j] = 0;
     for (int i = 0; i <= d; i++) {
-      ReplayEntry r = replay[nReplay++];
+      scalar_t weight = weights[i];
+      const scalar_t* value = values + (size_t)replayVertex[elementReplay + i] * vd;
       for (int j = 0; j < vd; j++) {
-        col[j] += r.weight * base[r.offset + j];
+        col[j] += weight * value[j];
       }
     }
   }
 
-  /* Performs a Gaussian blur along each projected axis in the hyperplane. */
-  void blur() {
+  /* Performs a Gaussian blur along each projected axis in the hyperplane. The blur along one
+   * axis is symmetric, so the transposed blur visits the axes in reverse order.
+   */
+  void blur(scalar_t* values, int vd, bool transposed = false) {
     // Prepare arrays
-    short* neighbor1 = new short[d + 1];
-    short* neighbor2 = new short[d + 1];
-    scalar_t* newValue = new scalar_t[vd * hashTable.size()];
-    scalar_t* oldValue = hashTable.getValues();
-    scalar_t* hashTableBase = oldValue;
+    std::vector<scalar_t> blurred((size_t)vd * size());
+    scalar_t* newValue = blurred.data();
+    scalar_t* oldValue = values;
 
-    scalar_t* zero = new scalar_t[vd];
-    for (int k = 0; k < vd; k++)
-      zero[k] = 0;
+    std::vector<scalar_t> zero(vd, 0);
 
     // For each of d+1 axes,
-    for (int j = 0; j <= d; j++) {
+    for (int axis = 0; axis <= d; axis++) {
+      int j = transposed ? d - axis : axis;
       // For each vertex in the lattice,
-      for (int i = 0; i < hashTable.size(); i++) { // blur point i in dimension j
-        short* key = hashTable.getKeys() + i * (d); // keys to current vertex
-        for (int k = 0; k < d; k++) {
-          neighbor1[k] = key[k] + 1;
-          neighbor2[k] = key[k] - 1;
-        }
-        neighbor1[j] = key[j] - d;
-        neighbor2[j] = key[j] + d; // keys to the neighbors along the given axis.
-
-        scalar_t* oldVal = oldValue + i * vd;
-        scalar_t* newVal = newValue + i * vd;
+      at::parallel_for(0, size(), PHL_CPU_BLUR_GRAIN_SIZE, [&](int64_t start, int64_t end) {
+        for (int64_t i = start; i < end; i++) { // blur point i in dimension j
+          const int* neighbors = &blurNeighbors[(i * (d + 1) + j) * 2];
 
-        scalar_t *vm1, *vp1;
+          const scalar_t* oldVal = oldValue + i * vd;
+          scalar_t* newVal = newValue + i * vd;
 
-        vm1 = hashTable.lookup(neighbor1, false); // look up first neighbor
-        if (vm1)
-          vm1 = vm1 - hashTableBase + oldValue;
-        else
-          vm1 = zero;
-
-        vp1 = hashTable.lookup(neighbor2, false); // look up second neighbor
-        if (vp1)
-          vp1 = vp1 - hashTableBase + oldValue;
-        else
-          vp1 = zero;
+          const scalar_t* vm1 = neighbors[0] >= 0 ? oldValue + (int64_t)neighbors[0] * vd : zero.data();
+          const scalar_t* vp1 = neighbors[1] >= 0 ? oldValue + (int64_t)neighbors[1] * vd : zero.data();
 
-        // Mix values of the three vertices
-        for (int k = 0; k < vd; k++)
-          newVal[k] = (0.25f * vm1[k] + 0.5f * oldVal[k] + 0.25f * vp1[k]);
-      }
+          // Mix values of the three vertices
+          for (int k = 0; k < vd; k++)
+            newVal[k] = (0.25f * vm1[k] + 0.5f * oldVal[k] + 0.25f * vp1[k]);
+        }
+      });
       scalar_t* tmp = newValue;
       newValue = oldValue;
       oldValue = tmp;
@@ -462,41 +783,150 @@ class PermutohedralLattice {
     }
 
     // depending where we ended up, we may have to copy data
-    if (oldValue != hashTableBase) {
-      memcpy(hashTableBase, oldValue, hashTable.size() * vd * sizeof(scalar_t));
-      delete[] oldValue;
-    } else {
-      delete[] newValue;
+    if (oldValue != values) {
+      memcpy(values, oldValue, sizeof(scalar_t) * size() * vd);
     }
-
-    delete[] zero;
-    delete[] neighbor1;
-    delete[] neighbor2;
   }
 
- private:
-  int d, vd, nData;
-  scalar_t *elevated, *scaleFactor, *barycentric;
-  short* canonical;
-  short* key;
-
-  // slicing is done by replaying splatting (ie storing the sparse matrix)
-  struct ReplayEntry {
-    int offset;
-    scalar_t weight;
-  } * replay;
-  int nReplay, nReplaySub;
+  /* Builds the blur stencil: for every vertex and each of the d+1 axes, the indices of the
+   * two neighboring vertices along the axis, or -1 where the neighbor is not in the lattice.
+   * The table is built once and reused by every blur of the lattice.
+   */
+  void buildBlurNeighbors() {
+    blurNeighbors.resize((size_t)size() * (d + 1) * 2);
+
+    // The neighbors along axis j are at key + 1 - (d + 1) * [k == j] and key - 1 + (d + 1) * [k == j]
+    // in every coordinate k. The fields never carry into each other (see locate), so the offsets
+    // are added to the packed words directly.
+    at::parallel_for(0, size(), PHL_CPU_BLUR_GRAIN_SIZE, [&](int64_t start, int64_t end) {
+      std::vector<uint64_t> neighbor1(keyWords);
+      std::vector<uint64_t> neighbor2(keyWords);
+
+      for (int64_t i = start; i < end; i++) {
+        uint64_t* key = hashTable.getKeys() + i * keyWords; // keys to current vertex
+
+        for (int j = 0; j <= d; j++) {
+          for (int w = 0; w < keyWords; w++) {
+            neighbor1[w] = key[w] + keyOnes[w];
+            neighbor2[w] = key[w] - keyOnes[w];
+          }
+          if (j < d) {
+            neighbor1[j / PHL_CPU_KEY_FIELDS] -= (uint64_t)(d + 1) << keyShift[j];
+            neighbor2[j / PHL_CPU_KEY_FIELDS] += (uint64_t)(d + 1) << keyShift[j];
+          } // keys to the neighbors along the given axis.
+
+          int* neighbors = &blurNeighbors[(i * (d + 1) + j) * 2];
+          neighbors[0] = hashTable.lookup(neighbor1.data(), false);
+          neighbors[1] = hashTable.lookup(neighbor2.data(), false);
+        }
+      }
+    });
+  }
 
- public:
-  char* rank;
-  short* greedy;
-  HashTablePermutohedral<scalar_t> hashTable;
+  int d, nData;
+  PermutohedralFeatures<scalar_t> features;
+  std::vector<scalar_t> scaleFactor;
+
+  // Key packing, see HashTablePermutohedral. Coordinate i is stored at bit keyShift[i]
+  // of word i / PHL_CPU_KEY_FIELDS, offset by keyBias.
+  int keyWords;
+  std::vector<int> keyShift;
+  std::vector<uint64_t> keyOnes;
+  int keyBias;
+  scalar_t keyLimit;
+
+  // Slicing is done by replaying splatting (ie storing the sparse matrix). Interaction
+  // r = e * (d + 1) + remainder of element e is with vertex replayVertex[r] and has the
+  // barycentric weight replayWeight[r]. A lattice built with a compact replay (see
+  // SetPermutohedralCompactReplay) leaves replayWeight empty and recomputes the weights
+  // of an element from its position when needed, see elementWeights.
+  std::vector<uint32_t> replayVertex;
+  std::vector<scalar_t> replayWeight;
+
+  // Interactions sorted by vertex, see buildSplatIndex. Empty without a splat index.
+  std::vector<uint32_t> splatStart;
+  std::vector<uint32_t> splatEntries;
+
+  // Blur stencil, see buildBlurNeighbors.
+  std::vector<int> blurNeighbors;
+
+  // Vertex keys, numbered by vertex id.
+  HashTablePermutohedral hashTable;
 };
 
 template <typename scalar_t>
-void PermutohedralCPU(scalar_t* data, scalar_t* features, int dataChannels, int featureChannels, int elementCount) {
-  PermutohedralLattice<scalar_t>::filter(data, features, dataChannels, featureChannels, elementCount);
+void PermutohedralCPU(
+    const scalar_t* input,
+    scalar_t* output,
+    int dataChannels,
+    int channelStride,
+    const PermutohedralFeatures<scalar_t>& features,
+    int elementCount) {
+  PermutohedralLattice<scalar_t>::filter(input, output, dataChannels, channelStride, features, elementCount);
+}
+
+template <typename scalar_t>
+void PermutohedralBackwardCPU(
+    const scalar_t* input,
+    const scalar_t* gradOutput,
+    scalar_t* gradInput,
+    scalar_t* gradFeatures,
+    int dataChannels,
+    int channelStride,
+    const PermutohedralFeatures<scalar_t>& features,
+    int elementCount) {
+  PermutohedralLattice<scalar_t> lattice(features, elementCount, false);
+  lattice.backward(input, gradOutput, gradInput, gradFeatures, dataChannels, channelStride);
+}
+
+template <typename scalar_t>
+PermutohedralLattice<scalar_t>* PermutohedralLatticeCPUCreate(
+    const PermutohedralFeatures<scalar_t>& features,
+    int elementCount) {
+  return new PermutohedralLattice<scalar_t>(features, elementCount, true);
+}
+
+template <typename scalar_t>
+void PermutohedralLatticeCPUFilter(
+    PermutohedralLattice<scalar_t>* lattice,
+    const scalar_t* input,
+    scalar_t* output,
+    int dataChannels,
+    int channelStride) {
+  lattice->filter(input, output, dataChannels, channelStride);
+}
+
+template <typename scalar_t>
+void PermutohedralLatticeCPUDestroy(PermutohedralLattice<scalar_t>* lattice) {
+  delete lattice;
 }
 
-template void PermutohedralCPU(float* data, float* features, int dataChannels, int featureChannels, int elementCount);
-template void PermutohedralCPU(double* data, double* features, int dataChannels, int featureChannels, int elementCount);
+#define PERMUTOHEDRAL_CPU_INSTANTIATE(scalar_t)                                                                   \
+  template void PermutohedralCPU(                                                                                 \
+      const scalar_t* input,                                                                                      \
+      scalar_t* output,                                                                                           \
+      int dataChannels,                                                                                           \
+      int channelStride,                                                                                          \
+      const PermutohedralFeatures<scalar_t>& features,                                                            \
+      int elementCount);                                                                                          \
+  template void PermutohedralBackwardCPU(                                                                         \
+      const scalar_t* input,                                                                                      \
+      const scalar_t* gradOutput,                                                                                 \
+      scalar_t* gradInput,                                                                                        \
+      scalar_t* gradFeatures,                                                                                     \
+      int dataChannels,                                                                                           \
+      int channelStride,                                                                                          \
+      const PermutohedralFeatures<scalar_t>& features,                                                            \
+      int elementCount);                                                                                          \
+  template PermutohedralLattice<scalar_t>* PermutohedralLatticeCPUCreate(                                         \
+      const PermutohedralFeatures<scalar_t>& features, int elementCount);                                         \
+  template void PermutohedralLatticeCPUFilter(                                                                    \
+      PermutohedralLattice<scalar_t>* lattice,                                                                    \
+      const scalar_t* input,                                                                                      \
+      scalar_t* output,                                                                                           \
+      int dataChannels,                                                                                           \
+      int channelStride);                                                                                         \
+  template void PermutohedralLatticeCPUDestroy(PermutohedralLattice<scalar_t>* lattice);
+
+PERMUTOHEDRAL_CPU_INSTANTIATE(float)
+PERMUTOHEDRAL_CPU_INSTANTIATE(double)
@@ -29,6 +29,7 @@ limitations under the License.
 
 #include <cuda.h>
 #include <cuda_runtime.h>
+#include <ATen/AccumulateType.h>
 
 #include "trainable_bilateral.h"
 //#include "../utils/cuda_error_check.h"
@@ -55,14 +56,19 @@ __constant__ float cSigma_yBack;
 __constant__ float cSigma_zBack;
 __constant__ float cColorSigmaBack;
 
+#define BLOCK_SIZE 32
+
+// Filters the gradient of one home element and adds its contributions to the sigma gradients
+// (x, y, z, color) to sigmaSums, see BilateralFilterCpuBackward_nd.
 template <typename scalar_t, int C>
-__global__ void BilateralFilterCudaKernel3DBackward(
+__device__ void BilateralFilterCudaElement3DBackward(
     scalar_t* gradientInputTensor,
     scalar_t* gradientOutputTensor,
     scalar_t* inputTensor,
     scalar_t* outputTensor,
     scalar_t* outputWeightsTensor,
-    scalar_t* dO_dx_ki) {
+    scalar_t* dO_dx_ki,
+    at::acc_type<scalar_t, true>* sigmaSums) {
   int homeOffset = blockIdx.x * blockDim.x + threadIdx.x;
   int batchOffset = blockIdx.y * cBatchStrideBack;
 
@@ -125,6 +131,8 @@ __global__ void BilateralFilterCudaKernel3DBackward(
         // Aggregating values. Only do this if flagNotClamped: Pixels outside the image are disregarded.
         if (flagNotClamped) {
           scalar_t filter_kernel_back;
+          scalar_t gradientSum = 0;
+          scalar_t differenceSum = 0;
 
 #pragma unroll
           for (int c = 0; c < C; c++) {
@@ -145,7 +153,18 @@ __global__ void BilateralFilterCudaKernel3DBackward(
             }
 
             valueSum += gradientInputTensor[batchOffset + neighbourOffset + c * cColorStrideBack] * filter_kernel_back;
+
+            gradientSum += gradientInputTensor[batchOffset + neighbourOffset + c * cColorStrideBack];
+            differenceSum += inputTensor[batchOffset + homeOffset + c * cColorStrideBack] -
+                outputTensor[batchOffset + neighbourOffset + c * cColorStrideBack];
           }
+
+          scalar_t sigmaWeight =
+              totalWeight * gradientSum * differenceSum / outputWeightsTensor[batchOffset + neighbourOffset];
+          sigmaSums[0] += sigmaWeight * cXDistanceSquaredBack[kernelX];
+          sigmaSums[1] += sigmaWeight * cYDistanceSquaredBack[kernelY];
+          sigmaSums[2] += sigmaWeight * cZDistanceSquaredBack[kernelZ];
+          sigmaSums[3] += sigmaWeight * colorDistanceSquared;
         }
       }
     }
@@ -157,10 +176,59 @@ __global__ void BilateralFilterCudaKernel3DBackward(
   }
 }
 
+template <typename scalar_t, int C>
+__global__ void BilateralFilterCudaKernel3DBackward(
+    scalar_t* gradientInputTensor,
+    scalar_t* gradientOutputTensor,
+    scalar_t* inputTensor,
+    scalar_t* outputTensor,
+    scalar_t* outputWeightsTensor,
+    scalar_t* dO_dx_ki,
+    at::acc_type<scalar_t, true>* gradientSigmaBlocks) {
+  using accscalar_t = at::acc_type<scalar_t, true>;
+  accscalar_t sigmaSums[4] = {0, 0, 0, 0};
+
+  BilateralFilterCudaElement3DBackward<scalar_t, C>(
+      gradientInputTensor,
+      gradientOutputTensor,
+      inputTensor,
+      outputTensor,
+      outputWeightsTensor,
+      dO_dx_ki,
+      sigmaSums);
+
+  // Reducing the sigma gradient sums over the block, threads past the last element add zeros.
+  // The host adds up the partial sums of all blocks.
+  __shared__ accscalar_t blockSums[4][BLOCK_SIZE];
+
+  for (int j = 0; j < 4; j++) {
+    blockSums[j][threadIdx.x] = sigmaSums[j];
+  }
+  __syncthreads();
+
+  for (int stride = BLOCK_SIZE / 2; stride > 0; stride /= 2) {
+    if (threadIdx.x < stride) {
+      for (int j = 0; j < 4; j++) {
+        blockSums[j][threadIdx.x] += blockSums[j][threadIdx.x + stride];
+      }
+    }
+    __syncthreads();
+  }
+
+  if (threadIdx.x == 0) {
+    accscalar_t* blockSigmaGradients = gradientSigmaBlocks + 4 * (blockIdx.y * gridDim.x + blockIdx.x);
+    blockSigmaGradients[0] = blockSums[0][0] / abs(cSigma_xBack * cSigma_xBack * cSigma_xBack);
+    blockSigmaGradients[1] = blockSums[1][0] / abs(cSigma_yBack * cSigma_yBack * cSigma_yBack);
+    blockSigmaGradients[2] = blockSums[2][0] / abs(cSigma_zBack * cSigma_zBack * cSigma_zBack);
+    blockSigmaGradients[3] = blockSums[3][0] / abs(cColorSigmaBack * cColorSigmaBack * cColorSigmaBack);
+  }
+}
+
 template <int C, int D>
 void BilateralFilterCudaBackwardFunction(
     torch::Tensor gradientInputTensor,
     torch::Tensor gradientOutputTensor,
+    torch::Tensor gradientSigmaTensor,
     torch::Tensor inputTensor,
     torch::Tensor outputTensor,
     torch::Tensor outputWeightsTensor,
@@ -234,7 +302,9 @@ void BilateralFilterCudaBackwardFunction(
 
   //  cuda_error_check("Cuda check before kernel call.");
 
-#define BLOCK_SIZE 32
+  int blockCount = (int(desc.channelStride / BLOCK_SIZE) + 1) * desc.batchCount;
+  torch::ScalarType accumulateType = inputTensor.scalar_type() == torch::kDouble ? torch::kDouble : torch::kFloat;
+  torch::Tensor gradientSigmaBlocks = torch::empty({blockCount, 4}, inputTensor.options().dtype(accumulateType));
 
   AT_DISPATCH_FLOATING_TYPES_AND_HALF(
       inputTensor.scalar_type(), "BilateralFilterCudaKernel3DBackward", ([&] {
@@ -245,9 +315,12 @@ void BilateralFilterCudaBackwardFunction(
                 inputTensor.data_ptr<scalar_t>(),
                 outputTensor.data_ptr<scalar_t>(),
                 outputWeightsTensor.data_ptr<scalar_t>(),
-                dO_dx_ki.data_ptr<scalar_t>());
+                dO_dx_ki.data_ptr<scalar_t>(),
+                gradientSigmaBlocks.data_ptr<at::acc_type<scalar_t, true>>());
       }));
 
+  gradientSigmaTensor.copy_(gradientSigmaBlocks.sum(0));
+
   //  cuda_error_check("Cuda check after kernel call.");
   //  delete[] kernel;
   delete[] kernelSizes;
@@ -260,7 +333,7 @@ void BilateralFilterCudaBackwardFunction(
 }
 
 // Function to choose template implementation based on dynamic, channels and dimensions
-torch::Tensor BilateralFilterCudaBackward(
+std::tuple<torch::Tensor, torch::Tensor> BilateralFilterCudaBackward(
     torch::Tensor gradientInputTensor,
     torch::Tensor inputTensor,
     torch::Tensor outputTensor,
@@ -271,12 +344,14 @@ torch::Tensor BilateralFilterCudaBackward(
     float sigma_z,
     float colorSigma) {
   torch::Tensor gradientOutputTensor = torch::zeros_like(gradientInputTensor);
+  torch::Tensor gradientSigmaTensor = torch::zeros({4}, gradientInputTensor.options());
   //  cuda_error_check("beginning");
 
 #define CASE(c, d)                           \
   BilateralFilterCudaBackwardFunction<c, d>( \
       gradientInputTensor,                   \
       gradientOutputTensor,                  \
+      gradientSigmaTensor,                   \
       inputTensor,                           \
       outputTensor,                          \
       outputWeightsTensor,                   \
@@ -292,5 +367,5 @@ torch::Tensor BilateralFilterCudaBackward(
       gradientInputTensor.size(1),
       gradientInputTensor.dim() - 2);
 
-  return gradientOutputTensor;
+  return {gradientOutputTensor, gradientSigmaTensor};
 }
@@ -34,15 +34,14 @@ limitations under the License.
 #include "trainable_bilateral.h"
 #include "utils/common_utils.h"
 
-std::tuple<torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor>
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor>
 TrainableBilateralFilterForward(
     torch::Tensor inputTensor,
     float sigma_x,
     float sigma_y,
     float sigma_z,
     float colorSigma) {
-  std::tuple<torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor> (
-      *filterFunction)(torch::Tensor, float, float, float, float);
+  std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> (*filterFunction)(torch::Tensor, float, float, float, float);
 
 #ifdef WITH_CUDA
 
@@ -71,7 +70,42 @@ TrainableBilateralFilterForward(
   return filterFunction(inputTensor, sigma_x, sigma_y, sigma_z, colorSigma);
 }
 
-torch::Tensor TrainableBilateralFilterBackward(
+torch::Tensor TrainableBilateralFilterInference(
+    torch::Tensor inputTensor,
+    float sigma_x,
+    float sigma_y,
+    float sigma_z,
+    float colorSigma) {
+  torch::Tensor (*filterFunction)(torch::Tensor, float, float, float, float);
+
+#ifdef WITH_CUDA
+
+  if (torch::cuda::is_available() && inputTensor.is_cuda()) {
+    CHECK_CONTIGUOUS_CUDA(inputTensor);
+
+    if (inputTensor.size(1) > BF_CUDA_MAX_CHANNELS) {
+      throw std::runtime_error(
+          "Bilateral filtering not implemented for channel count > " + std::to_string(BF_CUDA_MAX_CHANNELS));
+    }
+
+    if (inputTensor.dim() - 2 > BF_CUDA_MAX_SPATIAL_DIMENSION) {
+      throw std::runtime_error(
+          "Bilateral filtering not implemented for spatial dimension > " +
+          std::to_string(BF_CUDA_MAX_SPATIAL_DIMENSION));
+    }
+
+    filterFunction = &BilateralFilterCudaInference;
+  } else {
+    filterFunction = &BilateralFilterCpuInference;
+  }
+#else
+  filterFunction = &BilateralFilterCpuInference;
+#endif
+
+  return filterFunction(inputTensor, sigma_x, sigma_y, sigma_z, colorSigma);
+}
+
+std::tuple<torch::Tensor, torch::Tensor> TrainableBilateralFilterBackward(
     torch::Tensor gradientInputTensor,
     torch::Tensor inputTensor,
     torch::Tensor outputTensor,
@@ -81,7 +115,7 @@ torch::Tensor TrainableBilateralFilterBackward(
     float sigma_y,
     float sigma_z,
     float colorSigma) {
-  torch::Tensor (*filterFunction)(
+  std::tuple<torch::Tensor, torch::Tensor> (*filterFunction)(
       torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, float, float, float, float);
 
 #ifdef WITH_CUDA
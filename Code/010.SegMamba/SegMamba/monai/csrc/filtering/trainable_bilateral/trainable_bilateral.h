@@ -40,9 +40,9 @@ limitations under the License.
 #define BF_CUDA_MAX_SPATIAL_DIMENSION 3
 
 #ifdef WITH_CUDA
-std::tuple<torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor>
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor>
 BilateralFilterCudaForward(torch::Tensor inputTensor, float sigma_x, float sigma_y, float sigma_z, float colorSigma);
-torch::Tensor BilateralFilterCudaBackward(
+std::tuple<torch::Tensor, torch::Tensor> BilateralFilterCudaBackward(
     torch::Tensor gradientInputTensor,
     torch::Tensor inputTensor,
     torch::Tensor outputTensor,
@@ -52,12 +52,25 @@ torch::Tensor BilateralFilterCudaBackward(
     float sigma_y,
     float sigma_z,
     float colorSigma);
+torch::Tensor BilateralFilterCudaInference(
+    torch::Tensor inputTensor,
+    float sigma_x,
+    float sigma_y,
+    float sigma_z,
+    float colorSigma);
 #endif
 
-std::tuple<torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor>
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor>
 BilateralFilterCpuForward(torch::Tensor inputTensor, float sigma_x, float sigma_y, float sigma_z, float colorSigma);
 
-torch::Tensor BilateralFilterCpuBackward(
+torch::Tensor BilateralFilterCpuInference(
+    torch::Tensor inputTensor,
+    float sigma_x,
+    float sigma_y,
+    float sigma_z,
+    float colorSigma);
+
+std::tuple<torch::Tensor, torch::Tensor> BilateralFilterCpuBackward(
     torch::Tensor gradientInputTensor,
     torch::Tensor inputTensor,
     torch::Tensor outputTensor,
@@ -68,7 +81,7 @@ torch::Tensor BilateralFilterCpuBackward(
     float sigma_z,
     float colorSigma);
 
-std::tuple<torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor>
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor>
 TrainableBilateralFilterForward(
     torch::Tensor inputTensor,
     float sigma_x,
@@ -76,7 +89,15 @@ TrainableBilateralFilterForward(
     float sigma_z,
     float colorSigma);
 
-torch::Tensor TrainableBilateralFilterBackward(
+// Filtered output only, for inference: skips the weights and derivatives of the forward.
+torch::Tensor TrainableBilateralFilterInference(
+    torch::Tensor inputTensor,
+    float sigma_x,
+    float sigma_y,
+    float sigma_z,
+    float colorSigma);
+
+std::tuple<torch::Tensor, torch::Tensor> TrainableBilateralFilterBackward(
     torch::Tensor gradientInputTensor,
     torch::Tensor inputTensor,
     torch::Tensor outputTensor,
@@ -27,27 +27,36 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
+#include <ATen/AccumulateType.h>
+#include <ATen/Parallel.h>
+
 #include "trainable_joint_bilateral.h"
+#include "utils/filter_window.h"
+#include "utils/meta_macros.h"
+#include "utils/range_kernel_lut.h"
 #include "utils/tensor_description.h"
 #include "utils/tensor_indexing.h"
 
-template <typename scalar_t>
-void JointBilateralFilterCpuBackward_3d(
+template <typename scalar_t, int D>
+void JointBilateralFilterCpuBackward_nd(
     torch::Tensor gradientInputTensor,
     torch::Tensor gradientGuidanceTensor,
     torch::Tensor gradientOutputTensor,
+    torch::Tensor gradientSigmaTensor,
     torch::Tensor inputTensor,
     torch::Tensor guidanceTensor,
     torch::Tensor outputTensor,
     torch::Tensor outputWeightsTensor,
     torch::Tensor dO_dz_ki,
-    float sigma_x,
-    float sigma_y,
-    float sigma_z,
+    const FilterWindow<at::acc_type<scalar_t, true>>& window,
     float colorSigma) {
   // Getting tensor description.
   TensorDescription desc = TensorDescription(gradientInputTensor);
 
+  // Values are stored as scalar_t (possibly half or bfloat16) and accumulated as accscalar_t. The
+  // CUDA accumulation types are used as they keep float sums in float (the CPU ones use double).
+  using accscalar_t = at::acc_type<scalar_t, true>;
+
   // Raw tensor data pointers.
   scalar_t* gradientInputTensorData = gradientInputTensor.data_ptr<scalar_t>();
   scalar_t* gradientGuidanceTensorData = gradientGuidanceTensor.data_ptr<scalar_t>();
@@ -57,161 +66,173 @@ void JointBilateralFilterCpuBackward_3d(
   scalar_t* outputTensorData = outputTensor.data_ptr<scalar_t>();
   scalar_t* outputWeightsTensorData = outputWeightsTensor.data_ptr<scalar_t>();
   scalar_t* dO_dz_kiData = dO_dz_ki.data_ptr<scalar_t>();
+  accscalar_t* gradientSigmaTensorData = gradientSigmaTensor.data_ptr<accscalar_t>();
   //    scalar_t* dw_dx_kiData = dw_dx_ki_Tensor.data_ptr<scalar_t>();
   //    scalar_t* dfilter_dx_kiData = dfilter_dx_ki_Tensor.data_ptr<scalar_t>();
 
-  // Pre-calculate common values
-  int windowSize_x = std::max(((int)ceil(5.0f * sigma_x) | 1), 5); // ORing last bit to ensure odd window size
-  int windowSize_y = std::max(((int)ceil(5.0f * sigma_y) | 1), 5); // ORing last bit to ensure odd window size
-  int windowSize_z = std::max(((int)ceil(5.0f * sigma_z) | 1), 5); // ORing last bit to ensure odd window size
-  int halfWindowSize_x = floor(0.5f * windowSize_x);
-  int halfWindowSize_y = floor(0.5f * windowSize_y);
-  int halfWindowSize_z = floor(0.5f * windowSize_z);
-  int halfWindowSize_arr[] = {halfWindowSize_x, halfWindowSize_y, halfWindowSize_z};
-  scalar_t spatialExpConstant_x = -1.0f / (2 * sigma_x * sigma_x);
-  scalar_t spatialExpConstant_y = -1.0f / (2 * sigma_y * sigma_y);
-  scalar_t spatialExpConstant_z = -1.0f / (2 * sigma_z * sigma_z);
-  scalar_t colorExpConstant = -1.0f / (2 * colorSigma * colorSigma);
-
-  // Set kernel sizes with respect to the defined spatial sigmas.
-  int* kernelSizes = new int[desc.dimensions];
-
-  kernelSizes[0] = windowSize_x;
-  kernelSizes[1] = windowSize_y;
-  kernelSizes[2] = windowSize_z;
-
-  // Pre-calculate gaussian kernel and distance map in 1D.
-  scalar_t* gaussianKernel_x = new scalar_t[windowSize_x];
-  scalar_t* gaussianKernel_y = new scalar_t[windowSize_y];
-  scalar_t* gaussianKernel_z = new scalar_t[windowSize_z];
-  scalar_t* xDistanceSquared = new scalar_t[windowSize_x];
-  scalar_t* yDistanceSquared = new scalar_t[windowSize_y];
-  scalar_t* zDistanceSquared = new scalar_t[windowSize_z];
-
-  for (int i = 0; i < windowSize_x; i++) {
-    int distance = i - halfWindowSize_x;
-    gaussianKernel_x[i] = exp(distance * distance * spatialExpConstant_x);
-    xDistanceSquared[i] = distance * distance;
-  }
-  for (int i = 0; i < windowSize_y; i++) {
-    int distance = i - halfWindowSize_y;
-    gaussianKernel_y[i] = exp(distance * distance * spatialExpConstant_y);
-    yDistanceSquared[i] = distance * distance;
-  }
-  for (int i = 0; i < windowSize_z; i++) {
-    int distance = i - halfWindowSize_z;
-    gaussianKernel_z[i] = exp(distance * distance * spatialExpConstant_z);
-    zDistanceSquared[i] = distance * distance;
-  }
+  accscalar_t colorExpConstant = -1.0f / (2 * colorSigma * colorSigma);
+  RangeKernelLut<accscalar_t> rangeKernel(colorExpConstant, GetRangeKernelLutMaxError());
 
-  // Looping over the batches
-  for (int b = 0; b < desc.batchCount; b++) {
-    int batchOffset = b * desc.batchStride;
-
-    // Looping over all dimensions for the home element
-    for (int z = 0; z < desc.sizes[2]; z++)
-#pragma omp parallel for
-      for (int y = 0; y < desc.sizes[1]; y++) {
-        for (int x = 0; x < desc.sizes[0]; x++) {
-          // Calculating indexing offset for the home element
-          int homeOffset = batchOffset;
-
-          int homeIndex[] = {x, y, z};
-          homeOffset += x * desc.strides[0];
-          homeOffset += y * desc.strides[1];
-          homeOffset += z * desc.strides[2];
-
-          // Zero kernel aggregates.
-          scalar_t filter_kernel_guidance = 0;
-          scalar_t valueSumGuidance = 0;
-          scalar_t valueSumInput = 0;
-
-          // Looping over all dimensions for the neighbour element
-          Indexer kernelIndex = Indexer(desc.dimensions, kernelSizes);
-          do // while(kernelIndex++)
-          {
-            // Calculating buffer offset for the neighbour element
-            // Index is clamped to the border in each dimension.
-            int neighbourOffset = batchOffset;
-            bool flagNotClamped = true;
-
-            for (int i = 0; i < desc.dimensions; i++) {
-              int neighbourIndex = homeIndex[i] + kernelIndex[i] - halfWindowSize_arr[i];
-              int neighbourIndexClamped = std::min(desc.sizes[i] - 1, std::max(0, neighbourIndex));
-              neighbourOffset += neighbourIndexClamped * desc.strides[i];
-              if (neighbourIndex != neighbourIndexClamped) {
-                flagNotClamped = false;
-              }
+  // Partial sums of the sigma gradients (x, y, z, color) per row of home elements. The weights
+  // are symmetric, so the neighbour loop of home element k visits every output i that X_k
+  // contributes to and dL/dsigma = sum_i dL/dO_i * dO_i/dsigma can be gathered here.
+  using sigmascalar_t = at::acc_type<scalar_t, false>;
+  int rowCount = window.rowCount(desc.batchCount);
+  sigmascalar_t* sigmaGradientRows = new sigmascalar_t[rowCount * 4]();
+
+  // Looping over the rows of home elements. The batch index and all window axes but the last are
+  // collapsed into one range, so that a single parallel region spreads the rows of all batch
+  // elements and slices over the threads. The innermost loop walks the last (contiguous) axis.
+  at::parallel_for(0, rowCount, 1, [&](int64_t start, int64_t end) {
+    for (int64_t row = start; row < end; row++) {
+      int homeIndex[D];
+      int rowOffset = 0;
+      int64_t rowRemainder = row;
+
+      for (int i = D - 2; i >= 0; i--) {
+        homeIndex[i] = rowRemainder % window.sizes[i];
+        rowRemainder /= window.sizes[i];
+        rowOffset += homeIndex[i] * window.strides[i];
+      }
+
+      int batchOffset = rowRemainder * desc.batchStride;
+      sigmascalar_t* rowSigmaGradients = sigmaGradientRows + 4 * row;
+
+      for (homeIndex[D - 1] = 0; homeIndex[D - 1] < window.sizes[D - 1]; homeIndex[D - 1]++) {
+        // Calculating indexing offset for the home element
+        int homeOffset = batchOffset + rowOffset + homeIndex[D - 1] * window.strides[D - 1];
+
+        // Zero kernel aggregates.
+        accscalar_t filter_kernel_guidance = 0;
+        accscalar_t valueSumGuidance = 0;
+        accscalar_t valueSumInput = 0;
+        accscalar_t spatialSums[D] = {};
+        accscalar_t colorSum = 0;
+
+        // Looping over all dimensions for the neighbour element
+        StaticIndexer<D> kernelIndex(window.kernelSizes);
+        do // while(kernelIndex++)
+        {
+          // Calculating buffer offset for the neighbour element
+          // Index is clamped to the border in each dimension.
+          int neighbourOffset = batchOffset;
+          bool flagNotClamped = true;
+          bool flagCenter = true;
+
+          for (int i = 0; i < D; i++) {
+            int neighbourIndex = homeIndex[i] + kernelIndex[i] - window.halfWindowSizes[i];
+            int neighbourIndexClamped = std::min(window.sizes[i] - 1, std::max(0, neighbourIndex));
+            neighbourOffset += neighbourIndexClamped * window.strides[i];
+            if (neighbourIndex != neighbourIndexClamped) {
+              flagNotClamped = false;
             }
+            if (kernelIndex[i] != window.halfWindowSizes[i]) {
+              flagCenter = false;
+            }
+          }
+
+          // Euclidean color distance.
+          accscalar_t colorDistance = 0;
+          accscalar_t colorDistanceSquared = 0;
 
-            // Euclidean color distance.
-            scalar_t colorDistance = 0;
-            scalar_t colorDistanceSquared = 0;
+          for (int i = 0; i < desc.channelCount; i++) {
+            accscalar_t diff = static_cast<accscalar_t>(guidanceTensorData[neighbourOffset + i * desc.channelStride]) -
+                guidanceTensorData[homeOffset + i * desc.channelStride]; // Be careful: Here it is (Z_k - Z_i) and not
+                                                                         // (Z_i - Z_q)
+            colorDistance += diff; // Do not take the absolute value here. Be careful with the signs.
+            colorDistanceSquared += diff * diff;
+          }
+
+          // Calculating and combining the spatial
+          // and color weights.
+          accscalar_t spatialWeight = 1;
+
+          for (int i = 0; i < D; i++) {
+            spatialWeight *= window.gaussianKernels[i][kernelIndex[i]];
+          }
+
+          accscalar_t colorWeight = rangeKernel(colorDistanceSquared);
+          accscalar_t totalWeight = spatialWeight * colorWeight;
+
+          // Aggregating values. Only do this if flagNotClamped: Pixels outside the image are disregarded.
+          if (flagNotClamped) {
+            accscalar_t gradientSum = 0;
+            accscalar_t differenceSum = 0;
 
             for (int i = 0; i < desc.channelCount; i++) {
-              scalar_t diff = guidanceTensorData[neighbourOffset + i * desc.channelStride] -
-                  guidanceTensorData[homeOffset + i * desc.channelStride]; // Be careful: Here it is (Z_k - Z_i) and not
-                                                                           // (Z_i - Z_q)
-              colorDistance += diff; // Do not take the absolute value here. Be careful with the signs.
-              colorDistanceSquared += diff * diff;
-            }
+              accscalar_t neighbourWeightSum = outputWeightsTensorData[neighbourOffset + i * desc.channelStride];
 
-            // Calculating and combining the spatial
-            // and color weights.
-            scalar_t spatialWeight = 1;
-
-            spatialWeight =
-                gaussianKernel_x[kernelIndex[0]] * gaussianKernel_y[kernelIndex[1]] * gaussianKernel_z[kernelIndex[2]];
-
-            scalar_t colorWeight = exp(colorDistanceSquared * colorExpConstant);
-            scalar_t totalWeight = spatialWeight * colorWeight;
-
-            // Aggregating values. Only do this if flagNotClamped: Pixels outside the image are disregarded.
-            if (flagNotClamped) {
-              for (int i = 0; i < desc.channelCount; i++) {
-                // Distinguish cases for k!=i (calculation is done here)
-                // and k==i (partial derivatives are precalculated).
-                // If statement replaces center element of neighborhood/kernel.
-                if (kernelIndex[0] != halfWindowSize_x || kernelIndex[1] != halfWindowSize_y ||
-                    kernelIndex[2] != halfWindowSize_z) {
-                  filter_kernel_guidance = -(1 / outputWeightsTensorData[neighbourOffset + i * desc.channelStride]) *
-                          outputTensorData[neighbourOffset + i * desc.channelStride] * totalWeight * colorDistance /
-                          (colorSigma * colorSigma) +
-                      (1 / outputWeightsTensorData[neighbourOffset + i * desc.channelStride]) * totalWeight *
-                          (inputTensorData[homeOffset + i * desc.channelStride] * colorDistance /
-                           (colorSigma * colorSigma)); // inputTensorData[homeOffset] !!, no +1!!
-                } else {
-                  filter_kernel_guidance = dO_dz_kiData[homeOffset + i * desc.channelStride];
-                }
-
-                valueSumGuidance +=
-                    gradientInputTensorData[neighbourOffset + i * desc.channelStride] * filter_kernel_guidance;
-                valueSumInput += gradientInputTensorData[neighbourOffset + i * desc.channelStride] *
-                    (1 / outputWeightsTensorData[neighbourOffset + i * desc.channelStride]) * totalWeight;
+              // Distinguish cases for k!=i (calculation is done here)
+              // and k==i (partial derivatives are precalculated).
+              // If statement replaces center element of neighborhood/kernel.
+              if (!flagCenter) {
+                filter_kernel_guidance = -(1 / neighbourWeightSum) *
+                        outputTensorData[neighbourOffset + i * desc.channelStride] * totalWeight * colorDistance /
+                        (colorSigma * colorSigma) +
+                    (1 / neighbourWeightSum) * totalWeight *
+                        (inputTensorData[homeOffset + i * desc.channelStride] * colorDistance /
+                         (colorSigma * colorSigma)); // inputTensorData[homeOffset] !!, no +1!!
+              } else {
+                filter_kernel_guidance = dO_dz_kiData[homeOffset + i * desc.channelStride];
               }
+
+              valueSumGuidance +=
+                  gradientInputTensorData[neighbourOffset + i * desc.channelStride] * filter_kernel_guidance;
+              valueSumInput += gradientInputTensorData[neighbourOffset + i * desc.channelStride] *
+                  (1 / neighbourWeightSum) * totalWeight;
+
+              gradientSum += gradientInputTensorData[neighbourOffset + i * desc.channelStride];
+              differenceSum += static_cast<accscalar_t>(inputTensorData[homeOffset + i * desc.channelStride]) -
+                  outputTensorData[neighbourOffset + i * desc.channelStride];
             }
-          } while (kernelIndex++);
 
-          // Do the filtering and calculate the values for the backward pass.
-          for (int i = 0; i < desc.channelCount; i++) {
-            // Filtering:
-            gradientGuidanceTensorData[homeOffset + i * desc.channelStride] = valueSumGuidance;
-            gradientOutputTensorData[homeOffset + i * desc.channelStride] = valueSumInput;
+            // dO_i/dsigma = sum_k w_ik * d_ik^2 * (X_k - O_i) / (W_i * sigma^3), with d_ik the distance
+            // along the axis of sigma or in color. The sigma^3 is divided out after the reduction.
+            accscalar_t sigmaWeight =
+                totalWeight * gradientSum * differenceSum / outputWeightsTensorData[neighbourOffset];
+            for (int i = 0; i < D; i++) {
+              spatialSums[i] += sigmaWeight * window.distancesSquared[i][kernelIndex[i]];
+            }
+            colorSum += sigmaWeight * colorDistanceSquared;
           }
+        } while (kernelIndex++);
+
+        for (int i = 0; i < D; i++) {
+          rowSigmaGradients[window.axes[i]] += spatialSums[i];
+        }
+        rowSigmaGradients[3] += colorSum;
+
+        // Do the filtering and calculate the values for the backward pass.
+        for (int i = 0; i < desc.channelCount; i++) {
+          // Filtering:
+          gradientGuidanceTensorData[homeOffset + i * desc.channelStride] = valueSumGuidance;
+          gradientOutputTensorData[homeOffset + i * desc.channelStride] = valueSumInput;
         }
       }
+    }
+  });
+
+  // Reducing the rows in a fixed order keeps the sigma gradients deterministic.
+  sigmascalar_t sigmaGradients[4] = {0, 0, 0, 0};
+
+  for (int r = 0; r < rowCount; r++) {
+    for (int j = 0; j < 4; j++) {
+      sigmaGradients[j] += sigmaGradientRows[4 * r + j];
+    }
+  }
+
+  // The sigmas of dropped axes keep a zero gradient, their window only holds the home element.
+  for (int i = 0; i < D; i++) {
+    float sigma = window.sigmas[i];
+    gradientSigmaTensorData[window.axes[i]] = sigmaGradients[window.axes[i]] / std::abs(sigma * sigma * sigma);
   }
 
-  delete[] kernelSizes;
-  delete[] gaussianKernel_x;
-  delete[] gaussianKernel_y;
-  delete[] gaussianKernel_z;
-  delete[] xDistanceSquared;
-  delete[] yDistanceSquared;
-  delete[] zDistanceSquared;
+  gradientSigmaTensorData[3] = sigmaGradients[3] / std::abs(colorSigma * colorSigma * colorSigma);
+
+  delete[] sigmaGradientRows;
 }
 
-std::tuple<torch::Tensor, torch::Tensor> JointBilateralFilterCpuBackward(
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> JointBilateralFilterCpuBackward(
     torch::Tensor gradientInputTensor,
     torch::Tensor inputTensor,
     torch::Tensor guidanceTensor,
@@ -226,21 +247,35 @@ std::tuple<torch::Tensor, torch::Tensor> JointBilateralFilterCpuBackward(
   torch::Tensor gradientOutputTensor = torch::zeros_like(gradientInputTensor);
   torch::Tensor gradientGuidanceTensor = torch::zeros_like(gradientInputTensor);
 
-  AT_DISPATCH_FLOATING_TYPES_AND_HALF(gradientInputTensor.scalar_type(), "JointBilateralFilterCpuBackward_3d", ([&] {
-                                        JointBilateralFilterCpuBackward_3d<scalar_t>(
-                                            gradientInputTensor,
-                                            gradientGuidanceTensor,
-                                            gradientOutputTensor,
-                                            inputTensor,
-                                            guidanceTensor,
-                                            outputTensor,
-                                            outputWeightsTensor,
-                                            dO_dz_ki,
-                                            sigma_x,
-                                            sigma_y,
-                                            sigma_z,
-                                            colorSigma);
-                                      }));
-
-  return {gradientOutputTensor, gradientGuidanceTensor};
+  // The sigma gradients keep the accumulation precision, float for half and bfloat16 gradients.
+  torch::ScalarType sigmaType = gradientInputTensor.scalar_type() == torch::kDouble ? torch::kDouble : torch::kFloat;
+  torch::Tensor gradientSigmaTensor = torch::zeros({4}, gradientInputTensor.options().dtype(sigmaType));
+
+  float sigmas[] = {sigma_x, sigma_y, sigma_z};
+
+#define CASE(d)                                    \
+  JointBilateralFilterCpuBackward_nd<scalar_t, d>( \
+      gradientInputTensor,                         \
+      gradientGuidanceTensor,                      \
+      gradientOutputTensor,                        \
+      gradientSigmaTensor,                         \
+      inputTensor,                                 \
+      guidanceTensor,                              \
+      outputTensor,                                \
+      outputWeightsTensor,                         \
+      dO_dz_ki,                                    \
+      window,                                      \
+      colorSigma);
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      gradientInputTensor.scalar_type(),
+      "JointBilateralFilterCpuBackward_nd",
+      ([&] {
+        FilterWindow<at::acc_type<scalar_t, true>> window(TensorDescription(gradientInputTensor), sigmas);
+        SWITCH_A(CASE, 3, window.dimensions);
+      }));
+#undef CASE
+
+  return {gradientOutputTensor, gradientGuidanceTensor, gradientSigmaTensor};
 }
@@ -27,159 +27,120 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
+#include <ATen/AccumulateType.h>
+#include <ATen/Parallel.h>
+
 #include "trainable_joint_bilateral.h"
+#include "utils/filter_window.h"
+#include "utils/meta_macros.h"
+#include "utils/range_kernel_lut.h"
 #include "utils/tensor_description.h"
 #include "utils/tensor_indexing.h"
 
-template <typename scalar_t>
-void JointBilateralFilterCpuForward_3d(
+// Filters inputTensor into outputTensor. The weights and the derivatives needed by the backward
+// pass are only computed (and their tensors only accessed) if withDerivatives is set.
+template <typename scalar_t, int D, bool withDerivatives>
+void JointBilateralFilterCpuForward_nd(
     torch::Tensor inputTensor,
     torch::Tensor guidanceTensor,
     torch::Tensor outputTensor,
     torch::Tensor outputWeightsTensor,
     torch::Tensor dO_dz_ki,
-    torch::Tensor dO_dsig_r,
-    torch::Tensor dO_dsig_x,
-    torch::Tensor dO_dsig_y,
-    torch::Tensor dO_dsig_z,
-    float sigma_x,
-    float sigma_y,
-    float sigma_z,
+    const FilterWindow<at::acc_type<scalar_t, true>>& window,
     float colorSigma) {
   // Getting tensor description.
   TensorDescription desc = TensorDescription(inputTensor);
 
+  // Values are stored as scalar_t (possibly half or bfloat16) and accumulated as accscalar_t. The
+  // CUDA accumulation types are used as they keep float sums in float (the CPU ones use double).
+  using accscalar_t = at::acc_type<scalar_t, true>;
+
   // Raw tensor data pointers.
   scalar_t* inputTensorData = inputTensor.data_ptr<scalar_t>();
   scalar_t* guidanceTensorData = guidanceTensor.data_ptr<scalar_t>();
   scalar_t* outputTensorData = outputTensor.data_ptr<scalar_t>();
-  scalar_t* outputWeightsTensorData = outputWeightsTensor.data_ptr<scalar_t>();
-  scalar_t* dO_dz_kiData = dO_dz_ki.data_ptr<scalar_t>();
-  scalar_t* dO_dsig_rData = dO_dsig_r.data_ptr<scalar_t>();
-  scalar_t* dO_dsig_xData = dO_dsig_x.data_ptr<scalar_t>();
-  scalar_t* dO_dsig_yData = dO_dsig_y.data_ptr<scalar_t>();
-  scalar_t* dO_dsig_zData = dO_dsig_z.data_ptr<scalar_t>();
-
-  // Pre-calculate common values
-  int windowSize_x = std::max(((int)ceil(5.0f * sigma_x) | 1), 5); // ORing last bit to ensure odd window size
-  int windowSize_y = std::max(((int)ceil(5.0f * sigma_y) | 1), 5); // ORing last bit to ensure odd window size
-  int windowSize_z = std::max(((int)ceil(5.0f * sigma_z) | 1), 5); // ORing last bit to ensure odd window size
-  int halfWindowSize_x = floor(0.5f * windowSize_x);
-  int halfWindowSize_y = floor(0.5f * windowSize_y);
-  int halfWindowSize_z = floor(0.5f * windowSize_z);
-  int halfWindowSize_arr[] = {halfWindowSize_x, halfWindowSize_y, halfWindowSize_z};
-  scalar_t spatialExpConstant_x = -1.0f / (2 * sigma_x * sigma_x);
-  scalar_t spatialExpConstant_y = -1.0f / (2 * sigma_y * sigma_y);
-  scalar_t spatialExpConstant_z = -1.0f / (2 * sigma_z * sigma_z);
-  scalar_t colorExpConstant = -1.0f / (2 * colorSigma * colorSigma);
-
-  // Set kernel sizes with respect to the defined spatial sigmas.
-  int* kernelSizes = new int[desc.dimensions];
-
-  kernelSizes[0] = windowSize_x;
-  kernelSizes[1] = windowSize_y;
-  kernelSizes[2] = windowSize_z;
-
-  // Pre-calculate gaussian kernel and distance map in 1D.
-  scalar_t* gaussianKernel_x = new scalar_t[windowSize_x];
-  scalar_t* gaussianKernel_y = new scalar_t[windowSize_y];
-  scalar_t* gaussianKernel_z = new scalar_t[windowSize_z];
-  scalar_t* xDistanceSquared = new scalar_t[windowSize_x];
-  scalar_t* yDistanceSquared = new scalar_t[windowSize_y];
-  scalar_t* zDistanceSquared = new scalar_t[windowSize_z];
-
-  for (int i = 0; i < windowSize_x; i++) {
-    int distance = i - halfWindowSize_x;
-    gaussianKernel_x[i] = exp(distance * distance * spatialExpConstant_x);
-    xDistanceSquared[i] = distance * distance;
-  }
-  for (int i = 0; i < windowSize_y; i++) {
-    int distance = i - halfWindowSize_y;
-    gaussianKernel_y[i] = exp(distance * distance * spatialExpConstant_y);
-    yDistanceSquared[i] = distance * distance;
-  }
-  for (int i = 0; i < windowSize_z; i++) {
-    int distance = i - halfWindowSize_z;
-    gaussianKernel_z[i] = exp(distance * distance * spatialExpConstant_z);
-    zDistanceSquared[i] = distance * distance;
-  }
-
-  // Looping over the batches
-  for (int b = 0; b < desc.batchCount; b++) {
-    int batchOffset = b * desc.batchStride;
-
-    // Looping over all dimensions for the home element
-    for (int z = 0; z < desc.sizes[2]; z++)
-#pragma omp parallel for
-      for (int y = 0; y < desc.sizes[1]; y++) {
-        for (int x = 0; x < desc.sizes[0]; x++) {
-          // Calculating indexing offset for the home element
-          int homeOffset = batchOffset;
-
-          int homeIndex[] = {x, y, z};
-          homeOffset += x * desc.strides[0];
-          homeOffset += y * desc.strides[1];
-          homeOffset += z * desc.strides[2];
-
-          // Zero kernel aggregates.
-          scalar_t valueSum = 0;
-          scalar_t dw_dz_ki = 0;
-          scalar_t dfilter_dz_ki = 0;
-          scalar_t colorSum_w = 0;
-          scalar_t colorSum_alpha = 0;
-          scalar_t xSum_w = 0;
-          scalar_t xSum_alpha = 0;
-          scalar_t ySum_w = 0;
-          scalar_t ySum_alpha = 0;
-          scalar_t zSum_w = 0;
-          scalar_t zSum_alpha = 0;
-
-          scalar_t weightSum = 0.0f;
-
-          // Looping over all dimensions for the neighbour element
-          Indexer kernelIndex = Indexer(desc.dimensions, kernelSizes);
-          do // while(kernelIndex++)
-          {
-            // Calculating buffer offset for the neighbour element
-            // Index is clamped to the border in each dimension.
-            int neighbourOffset = batchOffset;
-            bool flagNotClamped = true;
-
-            for (int i = 0; i < desc.dimensions; i++) {
-              int neighbourIndex = homeIndex[i] + kernelIndex[i] - halfWindowSize_arr[i];
-              int neighbourIndexClamped = std::min(desc.sizes[i] - 1, std::max(0, neighbourIndex));
-              neighbourOffset += neighbourIndexClamped * desc.strides[i];
-              if (neighbourIndex != neighbourIndexClamped) {
-                flagNotClamped = false;
-              }
+  scalar_t* outputWeightsTensorData = withDerivatives ? outputWeightsTensor.data_ptr<scalar_t>() : NULL;
+  scalar_t* dO_dz_kiData = withDerivatives ? dO_dz_ki.data_ptr<scalar_t>() : NULL;
+
+  accscalar_t colorExpConstant = -1.0f / (2 * colorSigma * colorSigma);
+  RangeKernelLut<accscalar_t> rangeKernel(colorExpConstant, GetRangeKernelLutMaxError());
+
+  // Looping over the rows of home elements. The batch index and all window axes but the last are
+  // collapsed into one range, so that a single parallel region spreads the rows of all batch
+  // elements and slices over the threads. The innermost loop walks the last (contiguous) axis.
+  int rowCount = window.rowCount(desc.batchCount);
+
+  at::parallel_for(0, rowCount, 1, [&](int64_t start, int64_t end) {
+    for (int64_t row = start; row < end; row++) {
+      int homeIndex[D];
+      int rowOffset = 0;
+      int64_t rowRemainder = row;
+
+      for (int i = D - 2; i >= 0; i--) {
+        homeIndex[i] = rowRemainder % window.sizes[i];
+        rowRemainder /= window.sizes[i];
+        rowOffset += homeIndex[i] * window.strides[i];
+      }
+
+      int batchOffset = rowRemainder * desc.batchStride;
+
+      for (homeIndex[D - 1] = 0; homeIndex[D - 1] < window.sizes[D - 1]; homeIndex[D - 1]++) {
+        // Calculating indexing offset for the home element
+        int homeOffset = batchOffset + rowOffset + homeIndex[D - 1] * window.strides[D - 1];
+
+        // Zero kernel aggregates.
+        accscalar_t valueSum = 0;
+        accscalar_t dw_dz_ki = 0;
+        accscalar_t dfilter_dz_ki = 0;
+
+        accscalar_t weightSum = 0.0f;
+
+        // Looping over all dimensions for the neighbour element
+        StaticIndexer<D> kernelIndex(window.kernelSizes);
+        do // while(kernelIndex++)
+        {
+          // Calculating buffer offset for the neighbour element
+          // Index is clamped to the border in each dimension.
+          int neighbourOffset = batchOffset;
+          bool flagNotClamped = true;
+
+          for (int i = 0; i < D; i++) {
+            int neighbourIndex = homeIndex[i] + kernelIndex[i] - window.halfWindowSizes[i];
+            int neighbourIndexClamped = std::min(window.sizes[i] - 1, std::max(0, neighbourIndex));
+            neighbourOffset += neighbourIndexClamped * window.strides[i];
+            if (neighbourIndex != neighbourIndexClamped) {
+              flagNotClamped = false;
             }
+          }
 
-            // Euclidean color distance.
-            scalar_t colorDistance = 0;
-            scalar_t colorDistanceSquared = 0;
+          // Euclidean color distance.
+          accscalar_t colorDistance = 0;
+          accscalar_t colorDistanceSquared = 0;
 
-            for (int i = 0; i < desc.channelCount; i++) {
-              scalar_t diff = guidanceTensorData[homeOffset + i * desc.channelStride] -
-                  guidanceTensorData[neighbourOffset + i * desc.channelStride];
-              colorDistance += diff; // Do not take the absolute value here. Be careful with the signs.
-              colorDistanceSquared += diff * diff;
-            }
+          for (int i = 0; i < desc.channelCount; i++) {
+            accscalar_t diff = static_cast<accscalar_t>(guidanceTensorData[homeOffset + i * desc.channelStride]) -
+                guidanceTensorData[neighbourOffset + i * desc.channelStride];
+            colorDistance += diff; // Do not take the absolute value here. Be careful with the signs.
+            colorDistanceSquared += diff * diff;
+          }
 
-            // Calculating and combining the spatial
-            // and color weights.
-            scalar_t spatialWeight = 1;
+          // Calculating and combining the spatial
+          // and color weights.
+          accscalar_t spatialWeight = 1;
 
-            spatialWeight =
-                gaussianKernel_x[kernelIndex[0]] * gaussianKernel_y[kernelIndex[1]] * gaussianKernel_z[kernelIndex[2]];
+          for (int i = 0; i < D; i++) {
+            spatialWeight *= window.gaussianKernels[i][kernelIndex[i]];
+          }
 
-            scalar_t colorWeight = exp(colorDistanceSquared * colorExpConstant);
-            scalar_t totalWeight = spatialWeight * colorWeight;
+          accscalar_t colorWeight = rangeKernel(colorDistanceSquared);
+          accscalar_t totalWeight = spatialWeight * colorWeight;
 
-            // Aggregating values. Only do this if flagNotClamped: Pixels outside the image are disregarded.
-            if (flagNotClamped) {
-              for (int i = 0; i < desc.channelCount; i++) {
-                valueSum += inputTensorData[neighbourOffset + i * desc.channelStride] * totalWeight;
+          // Aggregating values. Only do this if flagNotClamped: Pixels outside the image are disregarded.
+          if (flagNotClamped) {
+            for (int i = 0; i < desc.channelCount; i++) {
+              valueSum += inputTensorData[neighbourOffset + i * desc.channelStride] * totalWeight;
 
+              if (withDerivatives) {
                 // Derivative of weights with respect to X_i while i=k.
                 dw_dz_ki += (-1) * totalWeight * colorDistance / (colorSigma * colorSigma);
                 // Derivative of convolved image with respect to X_i while i=k.
@@ -187,60 +148,31 @@ void JointBilateralFilterCpuForward_3d(
                     colorDistance /
                     (colorSigma *
                      colorSigma); // Be careful, the +1 is missing here -> Added before filling dfilter_dx_kiData
-
-                colorSum_w += totalWeight * colorDistanceSquared / std::abs(colorSigma * colorSigma * colorSigma);
-                colorSum_alpha += totalWeight * inputTensorData[neighbourOffset + i * desc.channelStride] *
-                    colorDistanceSquared / std::abs(colorSigma * colorSigma * colorSigma);
-
-                xSum_w += totalWeight * xDistanceSquared[kernelIndex[0]] / std::abs(sigma_x * sigma_x * sigma_x);
-                xSum_alpha += totalWeight * inputTensorData[neighbourOffset + i * desc.channelStride] *
-                    xDistanceSquared[kernelIndex[0]] / std::abs(sigma_x * sigma_x * sigma_x);
-
-                ySum_w += totalWeight * yDistanceSquared[kernelIndex[1]] / std::abs(sigma_y * sigma_y * sigma_y);
-                ySum_alpha += totalWeight * inputTensorData[neighbourOffset + i * desc.channelStride] *
-                    yDistanceSquared[kernelIndex[1]] / std::abs(sigma_y * sigma_y * sigma_y);
-
-                zSum_w += totalWeight * zDistanceSquared[kernelIndex[2]] / std::abs(sigma_z * sigma_z * sigma_z);
-                zSum_alpha += totalWeight * inputTensorData[neighbourOffset + i * desc.channelStride] *
-                    zDistanceSquared[kernelIndex[2]] / std::abs(sigma_z * sigma_z * sigma_z);
               }
-
-              weightSum += totalWeight;
             }
-          } while (kernelIndex++);
 
-          // Do the filtering and calculate the values for the backward pass.
-          for (int i = 0; i < desc.channelCount; i++) {
-            // Filtering:
-            outputTensorData[homeOffset + i * desc.channelStride] = valueSum / weightSum;
+            weightSum += totalWeight;
+          }
+        } while (kernelIndex++);
+
+        // Do the filtering and calculate the values for the backward pass.
+        for (int i = 0; i < desc.channelCount; i++) {
+          // Filtering:
+          outputTensorData[homeOffset + i * desc.channelStride] = valueSum / weightSum;
 
+          if (withDerivatives) {
             // Pre-computations for the backward pass:
             outputWeightsTensorData[homeOffset + i * desc.channelStride] = weightSum;
             dO_dz_kiData[homeOffset + i * desc.channelStride] = -(1 / weightSum) * (valueSum / weightSum) * dw_dz_ki +
                 (1 / weightSum) * (dfilter_dz_ki); // no +1 for dfilter_dz_ki for JBF added here!
-            dO_dsig_rData[homeOffset + i * desc.channelStride] =
-                -(1 / weightSum) * (valueSum / weightSum) * colorSum_w + (1 / weightSum) * colorSum_alpha;
-            dO_dsig_xData[homeOffset + i * desc.channelStride] =
-                -(1 / weightSum) * (valueSum / weightSum) * xSum_w + (1 / weightSum) * xSum_alpha;
-            dO_dsig_yData[homeOffset + i * desc.channelStride] =
-                -(1 / weightSum) * (valueSum / weightSum) * ySum_w + (1 / weightSum) * ySum_alpha;
-            dO_dsig_zData[homeOffset + i * desc.channelStride] =
-                -(1 / weightSum) * (valueSum / weightSum) * zSum_w + (1 / weightSum) * zSum_alpha;
           }
         }
       }
-  }
-
-  delete[] kernelSizes;
-  delete[] gaussianKernel_x;
-  delete[] gaussianKernel_y;
-  delete[] gaussianKernel_z;
-  delete[] xDistanceSquared;
-  delete[] yDistanceSquared;
-  delete[] zDistanceSquared;
+    }
+  });
 }
 
-std::tuple<torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor>
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor>
 JointBilateralFilterCpuForward(
     torch::Tensor inputTensor,
     torch::Tensor guidanceTensor,
@@ -252,27 +184,199 @@ JointBilateralFilterCpuForward(
   torch::Tensor outputTensor = torch::zeros_like(inputTensor);
   torch::Tensor outputWeightsTensor = torch::zeros_like(inputTensor);
   torch::Tensor dO_dz_ki = torch::zeros_like(inputTensor);
-  torch::Tensor dO_dsig_r = torch::zeros_like(inputTensor);
-  torch::Tensor dO_dsig_x = torch::zeros_like(inputTensor);
-  torch::Tensor dO_dsig_y = torch::zeros_like(inputTensor);
-  torch::Tensor dO_dsig_z = torch::zeros_like(inputTensor);
-
-  AT_DISPATCH_FLOATING_TYPES_AND_HALF(inputTensor.scalar_type(), "JointBilateralFilterCpuForward_3d", ([&] {
-                                        JointBilateralFilterCpuForward_3d<scalar_t>(
-                                            inputTensor,
-                                            guidanceTensor,
-                                            outputTensor,
-                                            outputWeightsTensor,
-                                            dO_dz_ki,
-                                            dO_dsig_r,
-                                            dO_dsig_x,
-                                            dO_dsig_y,
-                                            dO_dsig_z,
-                                            sigma_x,
-                                            sigma_y,
-                                            sigma_z,
-                                            colorSigma);
-                                      }));
-
-  return {outputTensor, outputWeightsTensor, dO_dz_ki, dO_dsig_r, dO_dsig_x, dO_dsig_y, dO_dsig_z};
+
+  float sigmas[] = {sigma_x, sigma_y, sigma_z};
+
+#define CASE(d)                                         \
+  JointBilateralFilterCpuForward_nd<scalar_t, d, true>( \
+      inputTensor,                                      \
+      guidanceTensor,                                   \
+      outputTensor,                                     \
+      outputWeightsTensor,                              \
+      dO_dz_ki,                                         \
+      window,                                           \
+      colorSigma);
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      inputTensor.scalar_type(),
+      "JointBilateralFilterCpuForward_nd",
+      ([&] {
+        FilterWindow<at::acc_type<scalar_t, true>> window(TensorDescription(inputTensor), sigmas);
+        SWITCH_A(CASE, 3, window.dimensions);
+      }));
+#undef CASE
+
+  return {outputTensor, outputWeightsTensor, dO_dz_ki};
+}
+
+torch::Tensor JointBilateralFilterCpuInference(
+    torch::Tensor inputTensor,
+    torch::Tensor guidanceTensor,
+    float sigma_x,
+    float sigma_y,
+    float sigma_z,
+    float colorSigma) {
+  // Only the filtered output, the derivative tensors are neither allocated nor computed.
+  torch::Tensor outputTensor = torch::zeros_like(inputTensor);
+  torch::Tensor undefinedTensor;
+
+  float sigmas[] = {sigma_x, sigma_y, sigma_z};
+
+#define CASE(d)                                          \
+  JointBilateralFilterCpuForward_nd<scalar_t, d, false>( \
+      inputTensor,                                       \
+      guidanceTensor,                                    \
+      outputTensor,                                      \
+      undefinedTensor,                                   \
+      undefinedTensor,                                   \
+      window,                                            \
+      colorSigma);
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      inputTensor.scalar_type(),
+      "JointBilateralFilterCpuForward_nd",
+      ([&] {
+        FilterWindow<at::acc_type<scalar_t, true>> window(TensorDescription(inputTensor), sigmas);
+        SWITCH_A(CASE, 3, window.dimensions);
+      }));
+#undef CASE
+
+  return outputTensor;
+}
+
+// Filters every channel of inputTensor separately with the weights of the joint filter. The
+// weight of a neighbour only depends on the guidance (the color distance is taken over all its
+// channels), so it is computed once and applied to all input channels. Neighbours outside the
+// image are disregarded before their weight is computed.
+template <typename scalar_t, int D>
+void JointBilateralFilterCpuMultiChannel_nd(
+    torch::Tensor inputTensor,
+    torch::Tensor guidanceTensor,
+    torch::Tensor outputTensor,
+    const FilterWindow<at::acc_type<scalar_t, true>>& window,
+    float colorSigma) {
+  // Getting tensor descriptions. Both tensors are contiguous with the same spatial sizes, so they
+  // only differ in the channel count and batch stride.
+  TensorDescription inputDesc = TensorDescription(inputTensor);
+  TensorDescription guidanceDesc = TensorDescription(guidanceTensor);
+
+  using accscalar_t = at::acc_type<scalar_t, true>;
+
+  // Raw tensor data pointers.
+  scalar_t* inputTensorData = inputTensor.data_ptr<scalar_t>();
+  scalar_t* guidanceTensorData = guidanceTensor.data_ptr<scalar_t>();
+  scalar_t* outputTensorData = outputTensor.data_ptr<scalar_t>();
+
+  accscalar_t colorExpConstant = -1.0f / (2 * colorSigma * colorSigma);
+  RangeKernelLut<accscalar_t> rangeKernel(colorExpConstant, GetRangeKernelLutMaxError());
+
+  int rowCount = window.rowCount(inputDesc.batchCount);
+
+  at::parallel_for(0, rowCount, 1, [&](int64_t start, int64_t end) {
+    // Per channel sums of the weighted neighbour values of the current home element.
+    accscalar_t* valueSums = new accscalar_t[inputDesc.channelCount];
+
+    for (int64_t row = start; row < end; row++) {
+      int homeIndex[D];
+      int rowOffset = 0;
+      int64_t rowRemainder = row;
+
+      for (int i = D - 2; i >= 0; i--) {
+        homeIndex[i] = rowRemainder % window.sizes[i];
+        rowRemainder /= window.sizes[i];
+        rowOffset += homeIndex[i] * window.strides[i];
+      }
+
+      scalar_t* inputBatchData = inputTensorData + rowRemainder * inputDesc.batchStride;
+      scalar_t* guidanceBatchData = guidanceTensorData + rowRemainder * guidanceDesc.batchStride;
+      scalar_t* outputBatchData = outputTensorData + rowRemainder * inputDesc.batchStride;
+
+      for (homeIndex[D - 1] = 0; homeIndex[D - 1] < window.sizes[D - 1]; homeIndex[D - 1]++) {
+        int homeOffset = rowOffset + homeIndex[D - 1] * window.strides[D - 1];
+
+        // Zero kernel aggregates.
+        for (int c = 0; c < inputDesc.channelCount; c++) {
+          valueSums[c] = 0;
+        }
+
+        accscalar_t weightSum = 0;
+
+        StaticIndexer<D> kernelIndex(window.kernelSizes);
+        do // while(kernelIndex++)
+        {
+          int neighbourOffset = 0;
+          bool flagNotClamped = true;
+
+          for (int i = 0; i < D; i++) {
+            int neighbourIndex = homeIndex[i] + kernelIndex[i] - window.halfWindowSizes[i];
+            flagNotClamped = flagNotClamped && neighbourIndex >= 0 && neighbourIndex < window.sizes[i];
+            neighbourOffset += neighbourIndex * window.strides[i];
+          }
+
+          if (flagNotClamped) {
+            accscalar_t colorDistanceSquared = 0;
+
+            for (int g = 0; g < guidanceDesc.channelCount; g++) {
+              accscalar_t diff =
+                  static_cast<accscalar_t>(guidanceBatchData[homeOffset + g * guidanceDesc.channelStride]) -
+                  guidanceBatchData[neighbourOffset + g * guidanceDesc.channelStride];
+              colorDistanceSquared += diff * diff;
+            }
+
+            accscalar_t spatialWeight = 1;
+
+            for (int i = 0; i < D; i++) {
+              spatialWeight *= window.gaussianKernels[i][kernelIndex[i]];
+            }
+
+            accscalar_t totalWeight = spatialWeight * rangeKernel(colorDistanceSquared);
+
+            for (int c = 0; c < inputDesc.channelCount; c++) {
+              valueSums[c] += inputBatchData[neighbourOffset + c * inputDesc.channelStride] * totalWeight;
+            }
+
+            weightSum += totalWeight;
+          }
+        } while (kernelIndex++);
+
+        for (int c = 0; c < inputDesc.channelCount; c++) {
+          outputBatchData[homeOffset + c * inputDesc.channelStride] = valueSums[c] / weightSum;
+        }
+      }
+    }
+
+    delete[] valueSums;
+  });
+}
+
+torch::Tensor JointBilateralFilterCpuMultiChannelInference(
+    torch::Tensor inputTensor,
+    torch::Tensor guidanceTensor,
+    float sigma_x,
+    float sigma_y,
+    float sigma_z,
+    float colorSigma) {
+  inputTensor = inputTensor.contiguous();
+  guidanceTensor = guidanceTensor.contiguous();
+
+  torch::Tensor outputTensor = torch::empty_like(inputTensor);
+
+  float sigmas[] = {sigma_x, sigma_y, sigma_z};
+
+#define CASE(d) \
+  JointBilateralFilterCpuMultiChannel_nd<scalar_t, d>(inputTensor, guidanceTensor, outputTensor, window, colorSigma);
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      inputTensor.scalar_type(),
+      "JointBilateralFilterCpuMultiChannel_nd",
+      ([&] {
+        FilterWindow<at::acc_type<scalar_t, true>> window(TensorDescription(guidanceTensor), sigmas);
+        SWITCH_A(CASE, 3, window.dimensions);
+      }));
+#undef CASE
+
+  return outputTensor;
 }
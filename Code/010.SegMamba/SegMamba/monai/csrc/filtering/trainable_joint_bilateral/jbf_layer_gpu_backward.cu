@@ -29,6 +29,7 @@ limitations under the License.
 
 #include <cuda.h>
 #include <cuda_runtime.h>
+#include <ATen/AccumulateType.h>
 
 #include "trainable_joint_bilateral.h"
 //#include "../utils/cuda_error_check.h"
@@ -55,8 +56,12 @@ __constant__ float cSigma_yBack;
 __constant__ float cSigma_zBack;
 __constant__ float cColorSigmaBack;
 
+#define BLOCK_SIZE 32
+
+// Filters the gradient of one home element and adds its contributions to the sigma gradients
+// (x, y, z, color) to sigmaSums, see JointBilateralFilterCpuBackward_nd.
 template <typename scalar_t, int C>
-__global__ void JointBilateralFilterCudaKernel3DBackward(
+__device__ void JointBilateralFilterCudaElement3DBackward(
     scalar_t* gradientInputTensor,
     scalar_t* gradientGuidanceTensor,
     scalar_t* gradientOutputTensor,
@@ -64,7 +69,8 @@ __global__ void JointBilateralFilterCudaKernel3DBackward(
     scalar_t* guidanceTensor,
     scalar_t* outputTensor,
     scalar_t* outputWeightsTensor,
-    scalar_t* dO_dz_ki) {
+    scalar_t* dO_dz_ki,
+    at::acc_type<scalar_t, true>* sigmaSums) {
   int homeOffset = blockIdx.x * blockDim.x + threadIdx.x;
   int batchOffset = blockIdx.y * cBatchStrideBack;
 
@@ -128,6 +134,8 @@ __global__ void JointBilateralFilterCudaKernel3DBackward(
         // Aggregating values. Only do this if flagNotClamped: Pixels outside the image are disregarded.
         if (flagNotClamped) {
           scalar_t filter_kernel_guidance_back;
+          scalar_t gradientSum = 0;
+          scalar_t differenceSum = 0;
 
 #pragma unroll
           for (int c = 0; c < C; c++) {
@@ -151,7 +159,18 @@ __global__ void JointBilateralFilterCudaKernel3DBackward(
                 gradientInputTensor[batchOffset + neighbourOffset + c * cColorStrideBack] * filter_kernel_guidance_back;
             valueSumInput += gradientInputTensor[batchOffset + neighbourOffset + c * cColorStrideBack] *
                 (1 / outputWeightsTensor[batchOffset + neighbourOffset + c * cColorStrideBack]) * totalWeight;
+
+            gradientSum += gradientInputTensor[batchOffset + neighbourOffset + c * cColorStrideBack];
+            differenceSum += inputTensor[batchOffset + homeOffset + c * cColorStrideBack] -
+                outputTensor[batchOffset + neighbourOffset + c * cColorStrideBack];
           }
+
+          scalar_t sigmaWeight =
+              totalWeight * gradientSum * differenceSum / outputWeightsTensor[batchOffset + neighbourOffset];
+          sigmaSums[0] += sigmaWeight * cXDistanceSquaredBack[kernelX];
+          sigmaSums[1] += sigmaWeight * cYDistanceSquaredBack[kernelY];
+          sigmaSums[2] += sigmaWeight * cZDistanceSquaredBack[kernelZ];
+          sigmaSums[3] += sigmaWeight * colorDistanceSquared;
         }
       }
     }
@@ -164,11 +183,64 @@ __global__ void JointBilateralFilterCudaKernel3DBackward(
   }
 }
 
+template <typename scalar_t, int C>
+__global__ void JointBilateralFilterCudaKernel3DBackward(
+    scalar_t* gradientInputTensor,
+    scalar_t* gradientGuidanceTensor,
+    scalar_t* gradientOutputTensor,
+    scalar_t* inputTensor,
+    scalar_t* guidanceTensor,
+    scalar_t* outputTensor,
+    scalar_t* outputWeightsTensor,
+    scalar_t* dO_dz_ki,
+    at::acc_type<scalar_t, true>* gradientSigmaBlocks) {
+  using accscalar_t = at::acc_type<scalar_t, true>;
+  accscalar_t sigmaSums[4] = {0, 0, 0, 0};
+
+  JointBilateralFilterCudaElement3DBackward<scalar_t, C>(
+      gradientInputTensor,
+      gradientGuidanceTensor,
+      gradientOutputTensor,
+      inputTensor,
+      guidanceTensor,
+      outputTensor,
+      outputWeightsTensor,
+      dO_dz_ki,
+      sigmaSums);
+
+  // Reducing the sigma gradient sums over the block, threads past the last element add zeros.
+  // The host adds up the partial sums of all blocks.
+  __shared__ accscalar_t blockSums[4][BLOCK_SIZE];
+
+  for (int j = 0; j < 4; j++) {
+    blockSums[j][threadIdx.x] = sigmaSums[j];
+  }
+  __syncthreads();
+
+  for (int stride = BLOCK_SIZE / 2; stride > 0; stride /= 2) {
+    if (threadIdx.x < stride) {
+      for (int j = 0; j < 4; j++) {
+        blockSums[j][threadIdx.x] += blockSums[j][threadIdx.x + stride];
+      }
+    }
+    __syncthreads();
+  }
+
+  if (threadIdx.x == 0) {
+    accscalar_t* blockSigmaGradients = gradientSigmaBlocks + 4 * (blockIdx.y * gridDim.x + blockIdx.x);
+    blockSigmaGradients[0] = blockSums[0][0] / abs(cSigma_xBack * cSigma_xBack * cSigma_xBack);
+    blockSigmaGradients[1] = blockSums[1][0] / abs(cSigma_yBack * cSigma_yBack * cSigma_yBack);
+    blockSigmaGradients[2] = blockSums[2][0] / abs(cSigma_zBack * cSigma_zBack * cSigma_zBack);
+    blockSigmaGradients[3] = blockSums[3][0] / abs(cColorSigmaBack * cColorSigmaBack * cColorSigmaBack);
+  }
+}
+
 template <int C, int D>
 void JointBilateralFilterCudaBackwardFunction(
     torch::Tensor gradientInputTensor,
     torch::Tensor gradientGuidanceTensor,
     torch::Tensor gradientOutputTensor,
+    torch::Tensor gradientSigmaTensor,
     torch::Tensor inputTensor,
     torch::Tensor guidanceTensor,
     torch::Tensor outputTensor,
@@ -243,7 +315,9 @@ void JointBilateralFilterCudaBackwardFunction(
 
   //  cuda_error_check("Cuda check before kernel call.");
 
-#define BLOCK_SIZE 32
+  int blockCount = (int(desc.channelStride / BLOCK_SIZE) + 1) * desc.batchCount;
+  torch::ScalarType accumulateType = inputTensor.scalar_type() == torch::kDouble ? torch::kDouble : torch::kFloat;
+  torch::Tensor gradientSigmaBlocks = torch::empty({blockCount, 4}, inputTensor.options().dtype(accumulateType));
 
   AT_DISPATCH_FLOATING_TYPES_AND_HALF(
       inputTensor.scalar_type(), "JointBilateralFilterCudaKernel3DBackward", ([&] {
@@ -256,9 +330,12 @@ void JointBilateralFilterCudaBackwardFunction(
                 guidanceTensor.data_ptr<scalar_t>(),
                 outputTensor.data_ptr<scalar_t>(),
                 outputWeightsTensor.data_ptr<scalar_t>(),
-                dO_dz_ki.data_ptr<scalar_t>());
+                dO_dz_ki.data_ptr<scalar_t>(),
+                gradientSigmaBlocks.data_ptr<at::acc_type<scalar_t, true>>());
       }));
 
+  gradientSigmaTensor.copy_(gradientSigmaBlocks.sum(0));
+
   //  cuda_error_check("Cuda check after kernel call.");
   //  delete[] kernel;
   delete[] kernelSizes;
@@ -271,7 +348,7 @@ void JointBilateralFilterCudaBackwardFunction(
 }
 
 // Function to choose template implementation based on dynamic, channels and dimensions
-std::tuple<torch::Tensor, torch::Tensor> JointBilateralFilterCudaBackward(
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> JointBilateralFilterCudaBackward(
     torch::Tensor gradientInputTensor,
     torch::Tensor inputTensor,
     torch::Tensor guidanceTensor,
@@ -283,6 +360,7 @@ std::tuple<torch::Tensor, torch::Tensor> JointBilateralFilterCudaBackward(
     float sigma_z,
     float colorSigma) {
   torch::Tensor gradientOutputTensor = torch::zeros_like(gradientInputTensor);
+  torch::Tensor gradientSigmaTensor = torch::zeros({4}, gradientInputTensor.options());
   torch::Tensor gradientGuidanceTensor = torch::zeros_like(gradientInputTensor);
   //  cuda_error_check("beginning");
 
@@ -291,6 +369,7 @@ std::tuple<torch::Tensor, torch::Tensor> JointBilateralFilterCudaBackward(
       gradientInputTensor,                        \
       gradientGuidanceTensor,                     \
       gradientOutputTensor,                       \
+      gradientSigmaTensor,                        \
       inputTensor,                                \
       guidanceTensor,                             \
       outputTensor,                               \
@@ -307,5 +386,5 @@ std::tuple<torch::Tensor, torch::Tensor> JointBilateralFilterCudaBackward(
       gradientInputTensor.size(1),
       gradientInputTensor.dim() - 2);
 
-  return {gradientOutputTensor, gradientGuidanceTensor};
+  return {gradientOutputTensor, gradientGuidanceTensor, gradientSigmaTensor};
 }
@@ -46,26 +46,16 @@ __constant__ int cHalfWindowSize_arr[3];
 __constant__ float cGaussianKernel_x[256];
 __constant__ float cGaussianKernel_y[256];
 __constant__ float cGaussianKernel_z[256];
-__constant__ float cXDistanceSquared[256];
-__constant__ float cYDistanceSquared[256];
-__constant__ float cZDistanceSquared[256];
 __constant__ float cColorExponentConstant;
-__constant__ float cSigma_x;
-__constant__ float cSigma_y;
-__constant__ float cSigma_z;
 __constant__ float cColorSigma;
 
-template <typename scalar_t, int C>
+template <typename scalar_t, int C, bool withDerivatives>
 __global__ void JointBilateralFilterCudaKernel3DForward(
     scalar_t* input,
     scalar_t* guidance,
     scalar_t* output,
     scalar_t* outputWeightsTensor,
-    scalar_t* dO_dz_ki,
-    scalar_t* dO_dsig_r,
-    scalar_t* dO_dsig_x,
-    scalar_t* dO_dsig_y,
-    scalar_t* dO_dsig_z) {
+    scalar_t* dO_dz_ki) {
   int homeOffset = blockIdx.x * blockDim.x + threadIdx.x;
   int batchOffset = blockIdx.y * cBatchStride;
 
@@ -81,14 +71,6 @@ __global__ void JointBilateralFilterCudaKernel3DForward(
   scalar_t valueSum = 0;
   scalar_t dw_dz_ki = 0;
   scalar_t dfilter_dz_ki = 0;
-  scalar_t colorSum_w = 0;
-  scalar_t colorSum_alpha = 0;
-  scalar_t xSum_w = 0;
-  scalar_t xSum_alpha = 0;
-  scalar_t ySum_w = 0;
-  scalar_t ySum_alpha = 0;
-  scalar_t zSum_w = 0;
-  scalar_t zSum_alpha = 0;
   scalar_t weightSum = 0;
 
   for (int kernelX = 0; kernelX < cKernelSizes[0]; kernelX++) {
@@ -142,29 +124,15 @@ __global__ void JointBilateralFilterCudaKernel3DForward(
           for (int c = 0; c < C; c++) {
             valueSum += input[batchOffset + neighbourOffset + c * cColorStride] * totalWeight;
 
-            // Derivative of weights with respect to X_i while i=k.
-            dw_dz_ki += (-1) * totalWeight * colorDistance / (cColorSigma * cColorSigma);
-            // Derivative of convolved image with respect to X_i while i=k.
-            dfilter_dz_ki += (-1) * totalWeight * input[batchOffset + neighbourOffset + c * cColorStride] *
-                colorDistance /
-                (cColorSigma *
-                 cColorSigma); // Be careful, the +1 is missing here -> Added before filling dfilter_dx_kiData
-
-            colorSum_w += totalWeight * colorDistanceSquared / std::abs(cColorSigma * cColorSigma * cColorSigma);
-            colorSum_alpha += totalWeight * input[batchOffset + neighbourOffset + c * cColorStride] *
-                colorDistanceSquared / std::abs(cColorSigma * cColorSigma * cColorSigma);
-
-            xSum_w += totalWeight * cXDistanceSquared[kernelX] / std::abs(cSigma_x * cSigma_x * cSigma_x);
-            xSum_alpha += totalWeight * input[batchOffset + neighbourOffset + c * cColorStride] *
-                cXDistanceSquared[kernelX] / std::abs(cSigma_x * cSigma_x * cSigma_x);
-
-            ySum_w += totalWeight * cYDistanceSquared[kernelY] / std::abs(cSigma_y * cSigma_y * cSigma_y);
-            ySum_alpha += totalWeight * input[batchOffset + neighbourOffset + c * cColorStride] *
-                cYDistanceSquared[kernelY] / std::abs(cSigma_y * cSigma_y * cSigma_y);
-
-            zSum_w += totalWeight * cZDistanceSquared[kernelZ] / std::abs(cSigma_z * cSigma_z * cSigma_z);
-            zSum_alpha += totalWeight * input[batchOffset + neighbourOffset + c * cColorStride] *
-                cZDistanceSquared[kernelZ] / std::abs(cSigma_z * cSigma_z * cSigma_z);
+            if (withDerivatives) {
+              // Derivative of weights with respect to X_i while i=k.
+              dw_dz_ki += (-1) * totalWeight * colorDistance / (cColorSigma * cColorSigma);
+              // Derivative of convolved image with respect to X_i while i=k.
+              dfilter_dz_ki += (-1) * totalWeight * input[batchOffset + neighbourOffset + c * cColorStride] *
+                  colorDistance /
+                  (cColorSigma *
+                   cColorSigma); // Be careful, the +1 is missing here -> Added before filling dfilter_dx_kiData
+            }
           }
 
           weightSum += totalWeight;
@@ -178,32 +146,22 @@ __global__ void JointBilateralFilterCudaKernel3DForward(
     //    output[batchOffset + homeOffset + c * cColorStride] /= weightSum;
     output[batchOffset + homeOffset + c * cColorStride] = valueSum / weightSum;
 
-    // Pre-computations for the backward pass:
-    outputWeightsTensor[batchOffset + homeOffset + c * cColorStride] = weightSum;
-    dO_dz_ki[batchOffset + homeOffset + c * cColorStride] = -(1 / weightSum) * (valueSum / weightSum) * dw_dz_ki +
-        (1 / weightSum) * (dfilter_dz_ki); // no +1 for dfilter_dz_ki for JBF added here!
-    dO_dsig_r[batchOffset + homeOffset + c * cColorStride] =
-        -(1 / weightSum) * (valueSum / weightSum) * colorSum_w + (1 / weightSum) * colorSum_alpha;
-    dO_dsig_x[batchOffset + homeOffset + c * cColorStride] =
-        -(1 / weightSum) * (valueSum / weightSum) * xSum_w + (1 / weightSum) * xSum_alpha;
-    dO_dsig_y[batchOffset + homeOffset + c * cColorStride] =
-        -(1 / weightSum) * (valueSum / weightSum) * ySum_w + (1 / weightSum) * ySum_alpha;
-    dO_dsig_z[batchOffset + homeOffset + c * cColorStride] =
-        -(1 / weightSum) * (valueSum / weightSum) * zSum_w + (1 / weightSum) * zSum_alpha;
+    if (withDerivatives) {
+      // Pre-computations for the backward pass:
+      outputWeightsTensor[batchOffset + homeOffset + c * cColorStride] = weightSum;
+      dO_dz_ki[batchOffset + homeOffset + c * cColorStride] = -(1 / weightSum) * (valueSum / weightSum) * dw_dz_ki +
+          (1 / weightSum) * (dfilter_dz_ki); // no +1 for dfilter_dz_ki for JBF added here!
+    }
   }
 }
 
-template <int C, int D>
+template <int C, int D, bool withDerivatives>
 void JointBilateralFilterCudaForwardFunction(
     torch::Tensor inputTensor,
     torch::Tensor guidanceTensor,
     torch::Tensor outputTensor,
     torch::Tensor outputWeightsTensor,
     torch::Tensor dO_dz_ki,
-    torch::Tensor dO_dsig_r,
-    torch::Tensor dO_dsig_x,
-    torch::Tensor dO_dsig_y,
-    torch::Tensor dO_dsig_z,
     float sigma_x,
     float sigma_y,
     float sigma_z,
@@ -232,24 +190,18 @@ void JointBilateralFilterCudaForwardFunction(
   auto* gaussianKernel_x = new float[windowSize_x];
   auto* gaussianKernel_y = new float[windowSize_y];
   auto* gaussianKernel_z = new float[windowSize_z];
-  auto* xDistanceSquared = new float[windowSize_x];
-  auto* yDistanceSquared = new float[windowSize_y];
-  auto* zDistanceSquared = new float[windowSize_z];
 
   for (int i = 0; i < windowSize_x; i++) {
     int distance = i - halfWindowSize_x;
     gaussianKernel_x[i] = exp(distance * distance * spatialExpConstant_x);
-    xDistanceSquared[i] = distance * distance;
   }
   for (int i = 0; i < windowSize_y; i++) {
     int distance = i - halfWindowSize_y;
     gaussianKernel_y[i] = exp(distance * distance * spatialExpConstant_y);
-    yDistanceSquared[i] = distance * distance;
   }
   for (int i = 0; i < windowSize_z; i++) {
     int distance = i - halfWindowSize_z;
     gaussianKernel_z[i] = exp(distance * distance * spatialExpConstant_z);
-    zDistanceSquared[i] = distance * distance;
   }
 
   // Writing constant memory.
@@ -262,13 +214,7 @@ void JointBilateralFilterCudaForwardFunction(
   cudaMemcpyToSymbol(cGaussianKernel_x, gaussianKernel_x, sizeof(float) * windowSize_x);
   cudaMemcpyToSymbol(cGaussianKernel_y, gaussianKernel_y, sizeof(float) * windowSize_y);
   cudaMemcpyToSymbol(cGaussianKernel_z, gaussianKernel_z, sizeof(float) * windowSize_z);
-  cudaMemcpyToSymbol(cXDistanceSquared, xDistanceSquared, sizeof(float) * windowSize_x);
-  cudaMemcpyToSymbol(cYDistanceSquared, yDistanceSquared, sizeof(float) * windowSize_y);
-  cudaMemcpyToSymbol(cZDistanceSquared, zDistanceSquared, sizeof(float) * windowSize_z);
   cudaMemcpyToSymbol(cColorExponentConstant, &colorExpConstant, sizeof(float));
-  cudaMemcpyToSymbol(cSigma_x, &sigma_x, sizeof(float));
-  cudaMemcpyToSymbol(cSigma_y, &sigma_y, sizeof(float));
-  cudaMemcpyToSymbol(cSigma_z, &sigma_z, sizeof(float));
   cudaMemcpyToSymbol(cColorSigma, &colorSigma, sizeof(float));
 
   //  cuda_error_check("Cuda check before kernel call.");
@@ -277,17 +223,13 @@ void JointBilateralFilterCudaForwardFunction(
 
   AT_DISPATCH_FLOATING_TYPES_AND_HALF(
       inputTensor.scalar_type(), "JointBilateralFilterCudaKernel3DForward", ([&] {
-        JointBilateralFilterCudaKernel3DForward<scalar_t, C>
+        JointBilateralFilterCudaKernel3DForward<scalar_t, C, withDerivatives>
             <<<dim3(int(desc.channelStride / BLOCK_SIZE) + 1, desc.batchCount), dim3(BLOCK_SIZE, 1)>>>(
                 inputTensor.data_ptr<scalar_t>(),
                 guidanceTensor.data_ptr<scalar_t>(),
                 outputTensor.data_ptr<scalar_t>(),
-                outputWeightsTensor.data_ptr<scalar_t>(),
-                dO_dz_ki.data_ptr<scalar_t>(),
-                dO_dsig_r.data_ptr<scalar_t>(),
-                dO_dsig_x.data_ptr<scalar_t>(),
-                dO_dsig_y.data_ptr<scalar_t>(),
-                dO_dsig_z.data_ptr<scalar_t>());
+                withDerivatives ? outputWeightsTensor.data_ptr<scalar_t>() : NULL,
+                withDerivatives ? dO_dz_ki.data_ptr<scalar_t>() : NULL);
       }));
 
   //  cuda_error_check("Cuda check after kernel call.");
@@ -296,13 +238,10 @@ void JointBilateralFilterCudaForwardFunction(
   delete[] gaussianKernel_x;
   delete[] gaussianKernel_y;
   delete[] gaussianKernel_z;
-  delete[] xDistanceSquared;
-  delete[] yDistanceSquared;
-  delete[] zDistanceSquared;
 }
 
 // Function to choose template implementation based on dynamic, channels and dimensions
-std::tuple<torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor>
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor>
 JointBilateralFilterCudaForward(
     torch::Tensor inputTensor,
     torch::Tensor guidanceTensor,
@@ -313,28 +252,48 @@ JointBilateralFilterCudaForward(
   torch::Tensor outputTensor = torch::zeros_like(inputTensor);
   torch::Tensor outputWeightsTensor = torch::zeros_like(inputTensor);
   torch::Tensor dO_dz_ki = torch::zeros_like(inputTensor);
-  torch::Tensor dO_dsig_r = torch::zeros_like(inputTensor);
-  torch::Tensor dO_dsig_x = torch::zeros_like(inputTensor);
-  torch::Tensor dO_dsig_y = torch::zeros_like(inputTensor);
-  torch::Tensor dO_dsig_z = torch::zeros_like(inputTensor);
   //  cuda_error_check("beginning");
 
-#define CASE(c, d)                               \
-  JointBilateralFilterCudaForwardFunction<c, d>( \
-      inputTensor,                               \
-      guidanceTensor,                            \
-      outputTensor,                              \
-      outputWeightsTensor,                       \
-      dO_dz_ki,                                  \
-      dO_dsig_r,                                 \
-      dO_dsig_x,                                 \
-      dO_dsig_y,                                 \
-      dO_dsig_z,                                 \
-      sigma_x,                                   \
-      sigma_y,                                   \
-      sigma_z,                                   \
+#define CASE(c, d)                                     \
+  JointBilateralFilterCudaForwardFunction<c, d, true>( \
+      inputTensor,                                     \
+      guidanceTensor,                                  \
+      outputTensor,                                    \
+      outputWeightsTensor,                             \
+      dO_dz_ki,                                        \
+      sigma_x,                                         \
+      sigma_y,                                         \
+      sigma_z,                                         \
+      colorSigma);
+  SWITCH_AB(CASE, BF_CUDA_MAX_CHANNELS, BF_CUDA_MAX_SPATIAL_DIMENSION, inputTensor.size(1), inputTensor.dim() - 2);
+
+  return {outputTensor, outputWeightsTensor, dO_dz_ki};
+}
+
+torch::Tensor JointBilateralFilterCudaInference(
+    torch::Tensor inputTensor,
+    torch::Tensor guidanceTensor,
+    float sigma_x,
+    float sigma_y,
+    float sigma_z,
+    float colorSigma) {
+  // Only the filtered output, the derivative tensors are neither allocated nor computed.
+  torch::Tensor outputTensor = torch::zeros_like(inputTensor);
+  torch::Tensor undefinedTensor;
+
+#undef CASE
+#define CASE(c, d)                                      \
+  JointBilateralFilterCudaForwardFunction<c, d, false>( \
+      inputTensor,                                      \
+      guidanceTensor,                                   \
+      outputTensor,                                     \
+      undefinedTensor,                                  \
+      undefinedTensor,                                  \
+      sigma_x,                                          \
+      sigma_y,                                          \
+      sigma_z,                                          \
       colorSigma);
   SWITCH_AB(CASE, BF_CUDA_MAX_CHANNELS, BF_CUDA_MAX_SPATIAL_DIMENSION, inputTensor.size(1), inputTensor.dim() - 2);
 
-  return {outputTensor, outputWeightsTensor, dO_dz_ki, dO_dsig_r, dO_dsig_x, dO_dsig_y, dO_dsig_z};
+  return outputTensor;
 }
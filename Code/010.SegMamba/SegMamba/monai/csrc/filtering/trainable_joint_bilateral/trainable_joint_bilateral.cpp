@@ -34,7 +34,7 @@ limitations under the License.
 #include "trainable_joint_bilateral.h"
 #include "utils/common_utils.h"
 
-std::tuple<torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor>
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor>
 TrainableJointBilateralFilterForward(
     torch::Tensor inputTensor,
     torch::Tensor guidanceTensor,
@@ -42,8 +42,8 @@ TrainableJointBilateralFilterForward(
     float sigma_y,
     float sigma_z,
     float colorSigma) {
-  std::tuple<torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor> (
-      *filterFunction)(torch::Tensor, torch::Tensor, float, float, float, float);
+  std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> (*filterFunction)(
+      torch::Tensor, torch::Tensor, float, float, float, float);
 
 #ifdef WITH_CUDA
 
@@ -72,7 +72,68 @@ TrainableJointBilateralFilterForward(
   return filterFunction(inputTensor, guidanceTensor, sigma_x, sigma_y, sigma_z, colorSigma);
 }
 
-std::tuple<torch::Tensor, torch::Tensor> TrainableJointBilateralFilterBackward(
+torch::Tensor TrainableJointBilateralFilterInference(
+    torch::Tensor inputTensor,
+    torch::Tensor guidanceTensor,
+    float sigma_x,
+    float sigma_y,
+    float sigma_z,
+    float colorSigma) {
+  torch::Tensor (*filterFunction)(torch::Tensor, torch::Tensor, float, float, float, float);
+
+#ifdef WITH_CUDA
+
+  if (torch::cuda::is_available() && inputTensor.is_cuda()) {
+    CHECK_CONTIGUOUS_CUDA(inputTensor);
+
+    if (inputTensor.size(1) > BF_CUDA_MAX_CHANNELS) {
+      throw std::runtime_error(
+          "Bilateral filtering not implemented for channel count > " + std::to_string(BF_CUDA_MAX_CHANNELS));
+    }
+
+    if (inputTensor.dim() - 2 > BF_CUDA_MAX_SPATIAL_DIMENSION) {
+      throw std::runtime_error(
+          "Bilateral filtering not implemented for spatial dimension > " +
+          std::to_string(BF_CUDA_MAX_SPATIAL_DIMENSION));
+    }
+
+    filterFunction = &JointBilateralFilterCudaInference;
+  } else {
+    filterFunction = &JointBilateralFilterCpuInference;
+  }
+#else
+  filterFunction = &JointBilateralFilterCpuInference;
+#endif
+
+  return filterFunction(inputTensor, guidanceTensor, sigma_x, sigma_y, sigma_z, colorSigma);
+}
+
+torch::Tensor TrainableJointBilateralFilterMultiChannelInference(
+    torch::Tensor inputTensor,
+    torch::Tensor guidanceTensor,
+    float sigma_x,
+    float sigma_y,
+    float sigma_z,
+    float colorSigma) {
+  if (inputTensor.is_cuda()) {
+    throw std::runtime_error("Multi-channel joint bilateral filtering is only implemented for CPU tensors");
+  }
+
+  bool sizesMatch = guidanceTensor.dim() == inputTensor.dim() && guidanceTensor.size(0) == inputTensor.size(0);
+
+  for (int i = 2; sizesMatch && i < inputTensor.dim(); i++) {
+    sizesMatch = guidanceTensor.size(i) == inputTensor.size(i);
+  }
+
+  if (!sizesMatch) {
+    throw std::runtime_error("Joint bilateral guidance must match the batch and spatial sizes of the input");
+  }
+
+  return JointBilateralFilterCpuMultiChannelInference(
+      inputTensor, guidanceTensor, sigma_x, sigma_y, sigma_z, colorSigma);
+}
+
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> TrainableJointBilateralFilterBackward(
     torch::Tensor gradientInputTensor,
     torch::Tensor inputTensor,
     torch::Tensor guidanceTensor,
@@ -83,7 +144,7 @@ std::tuple<torch::Tensor, torch::Tensor> TrainableJointBilateralFilterBackward(
     float sigma_y,
     float sigma_z,
     float colorSigma) {
-  std::tuple<torch::Tensor, torch::Tensor> (*filterFunction)(
+  std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> (*filterFunction)(
       torch::Tensor,
       torch::Tensor,
       torch::Tensor,
@@ -40,7 +40,7 @@ limitations under the License.
 #define BF_CUDA_MAX_SPATIAL_DIMENSION 3
 
 #ifdef WITH_CUDA
-std::tuple<torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor>
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor>
 JointBilateralFilterCudaForward(
     torch::Tensor inputTensor,
     torch::Tensor guidanceTensor,
@@ -48,7 +48,7 @@ JointBilateralFilterCudaForward(
     float sigma_y,
     float sigma_z,
     float colorSigma);
-std::tuple<torch::Tensor, torch::Tensor> JointBilateralFilterCudaBackward(
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> JointBilateralFilterCudaBackward(
     torch::Tensor gradientInputTensor,
     torch::Tensor inputTensor,
     torch::Tensor guidanceTensor,
@@ -59,9 +59,16 @@ std::tuple<torch::Tensor, torch::Tensor> JointBilateralFilterCudaBackward(
     float sigma_y,
     float sigma_z,
     float colorSigma);
+torch::Tensor JointBilateralFilterCudaInference(
+    torch::Tensor inputTensor,
+    torch::Tensor guidanceTensor,
+    float sigma_x,
+    float sigma_y,
+    float sigma_z,
+    float colorSigma);
 #endif
 
-std::tuple<torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor>
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor>
 JointBilateralFilterCpuForward(
     torch::Tensor inputTensor,
     torch::Tensor guidanceTensor,
@@ -70,7 +77,23 @@ JointBilateralFilterCpuForward(
     float sigma_z,
     float colorSigma);
 
-std::tuple<torch::Tensor, torch::Tensor> JointBilateralFilterCpuBackward(
+torch::Tensor JointBilateralFilterCpuInference(
+    torch::Tensor inputTensor,
+    torch::Tensor guidanceTensor,
+    float sigma_x,
+    float sigma_y,
+    float sigma_z,
+    float colorSigma);
+
+torch::Tensor JointBilateralFilterCpuMultiChannelInference(
+    torch::Tensor inputTensor,
+    torch::Tensor guidanceTensor,
+    float sigma_x,
+    float sigma_y,
+    float sigma_z,
+    float colorSigma);
+
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> JointBilateralFilterCpuBackward(
     torch::Tensor gradientInputTensor,
     torch::Tensor inputTensor,
     torch::Tensor guidanceTensor,
@@ -82,7 +105,7 @@ std::tuple<torch::Tensor, torch::Tensor> JointBilateralFilterCpuBackward(
     float sigma_z,
     float colorSigma);
 
-std::tuple<torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor>
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor>
 TrainableJointBilateralFilterForward(
     torch::Tensor inputTensor,
     torch::Tensor guidanceTensor,
@@ -91,7 +114,26 @@ TrainableJointBilateralFilterForward(
     float sigma_z,
     float colorSigma);
 
-std::tuple<torch::Tensor, torch::Tensor> TrainableJointBilateralFilterBackward(
+// Filtered output only, for inference: skips the weights and derivatives of the forward.
+torch::Tensor TrainableJointBilateralFilterInference(
+    torch::Tensor inputTensor,
+    torch::Tensor guidanceTensor,
+    float sigma_x,
+    float sigma_y,
+    float sigma_z,
+    float colorSigma);
+
+// Filters each of the C channels of the input separately, with weights computed once per
+// neighbour from all G channels of the guidance: (B, C, ...) input, (B, G, ...) guidance. CPU only.
+torch::Tensor TrainableJointBilateralFilterMultiChannelInference(
+    torch::Tensor inputTensor,
+    torch::Tensor guidanceTensor,
+    float sigma_x,
+    float sigma_y,
+    float sigma_z,
+    float colorSigma);
+
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> TrainableJointBilateralFilterBackward(
     torch::Tensor gradientInputTensor,
     torch::Tensor inputTensor,
     torch::Tensor guidanceTensor,
@@ -55,6 +55,26 @@ std::vector<torch::Tensor> lltm_cpu_backward(
     torch::Tensor gate_weights,
     torch::Tensor weights);
 
+// Runs all timesteps of a (sequence, batch, features) input from the initial state old_h and
+// old_cell. Returns the hidden states and cells of every step and the gate activations needed by
+// lltm_cpu_sequence_backward.
+std::vector<torch::Tensor> lltm_cpu_sequence_forward(
+    torch::Tensor input,
+    torch::Tensor weights,
+    torch::Tensor bias,
+    torch::Tensor old_h,
+    torch::Tensor old_cell);
+
+std::vector<torch::Tensor> lltm_cpu_sequence_backward(
+    torch::Tensor grad_hs,
+    torch::Tensor grad_cells,
+    torch::Tensor input,
+    torch::Tensor old_h,
+    torch::Tensor hs,
+    torch::Tensor cells,
+    torch::Tensor gates,
+    torch::Tensor weights);
+
 std::vector<torch::Tensor> lltm_forward(
     torch::Tensor input,
     torch::Tensor weights,
@@ -108,3 +128,33 @@ std::vector<torch::Tensor> lltm_backward(
   return lltm_cpu_backward(
       grad_h, grad_cell, new_cell, input_gate, output_gate, candidate_cell, X, gate_weights, weights);
 }
+
+std::vector<torch::Tensor> lltm_sequence_forward(
+    torch::Tensor input,
+    torch::Tensor weights,
+    torch::Tensor bias,
+    torch::Tensor old_h,
+    torch::Tensor old_cell) {
+  if (input.is_cuda()) {
+    AT_ERROR("LLTM sequence forward is only implemented for CPU tensors.");
+  }
+  if (input.dim() != 3 || input.size(0) == 0) {
+    AT_ERROR("LLTM sequence input must be a non-empty (sequence, batch, features) tensor.");
+  }
+  return lltm_cpu_sequence_forward(input, weights, bias, old_h, old_cell);
+}
+
+std::vector<torch::Tensor> lltm_sequence_backward(
+    torch::Tensor grad_hs,
+    torch::Tensor grad_cells,
+    torch::Tensor input,
+    torch::Tensor old_h,
+    torch::Tensor hs,
+    torch::Tensor cells,
+    torch::Tensor gates,
+    torch::Tensor weights) {
+  if (input.is_cuda()) {
+    AT_ERROR("LLTM sequence backward is only implemented for CPU tensors.");
+  }
+  return lltm_cpu_sequence_backward(grad_hs, grad_cells, input, old_h, hs, cells, gates, weights);
+}
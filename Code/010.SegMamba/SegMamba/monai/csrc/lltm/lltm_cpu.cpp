@@ -11,25 +11,168 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
+#include <ATen/Parallel.h>
 #include <torch/extension.h>
+#include <cmath>
 #include <vector>
 
-// s'(z) = (1 - s(z)) * s(z)
-torch::Tensor d_sigmoid(torch::Tensor z) {
-  auto s = torch::sigmoid(z);
-  return (1 - s) * s;
+#include "utils/fast_exp.h"
+
+// Smallest number of state elements per task of the parallel gate loops.
+#define LLTM_CPU_GRAIN_SIZE 2048
+
+// The float gate functions avoid library calls and branches so that the gate loops vectorise,
+// see utils/fast_exp.h.
+
+// a where x has its sign bit set, b elsewhere.
+static inline float lltm_select_negative(float x, float a, float b) {
+  int mask = FloatBits(x) >> 31;
+  return BitsFloat((FloatBits(a) & mask) | (FloatBits(b) & ~mask));
+}
+
+// Both signs only take exp() of -|z|, which cannot overflow.
+static inline float lltm_sigmoid(float z) {
+  float e = ExpNegative(std::fabs(z));
+  float s = 1 / (1 + e);
+  return lltm_select_negative(z, e * s, s);
+}
+
+static inline float lltm_elu(float z) {
+  return lltm_select_negative(z, ExpNegative(std::fabs(z)) - 1, z);
+}
+
+// elu'(z) is 1 above zero and exp(z) = elu(z) + 1 below, z being elu(z) here.
+static inline float lltm_d_elu(float z) {
+  return lltm_select_negative(z, z + 1, 1.0f);
+}
+
+// tanh() from exp(-2|x|), and from the odd polynomial of Cephes' tanhf below |x| = 0.625 where
+// 1 - exp(-2|x|) would cancel.
+static inline float lltm_tanh(float x) {
+  float a = std::fabs(x);
+  float e = ExpNegative(2 * a);
+  float t = (1 - e) / (1 + e);
+
+  float z = x * x;
+  float p = -5.70498872745e-3f;
+  p = p * z + 2.06390887954e-2f;
+  p = p * z - 5.37397155531e-2f;
+  p = p * z + 1.33314422036e-1f;
+  p = p * z - 3.33332819422e-1f;
+  p = p * z * a + a;
+
+  // Non-negative floats order like their bits, the difference is negative below 0.625.
+  t = lltm_select_negative(BitsFloat(FloatBits(a) - FloatBits(0.625f)), p, t);
+  return BitsFloat(FloatBits(t) | (FloatBits(x) & (int)0x80000000));
+}
+
+static inline double lltm_sigmoid(double z) {
+  double e = std::exp(-std::fabs(z));
+  double s = 1 / (1 + e);
+  return z < 0 ? e * s : s;
 }
 
-// tanh'(z) = 1 - tanh^2(z)
-torch::Tensor d_tanh(torch::Tensor z) {
-  return 1 - z.tanh().pow(2);
+static inline double lltm_elu(double z) {
+  return z > 0 ? z : std::exp(z) - 1;
 }
 
-// elu'(z) = relu'(z) + { alpha * exp(z) if (alpha * (exp(z) - 1)) < 0, else 0}
-torch::Tensor d_elu(torch::Tensor z, torch::Scalar alpha = 1.0) {
-  auto e = z.exp();
-  auto mask = (alpha * (e - 1)) < 0;
-  return (z > 0).type_as(z) + mask.type_as(z) * (alpha * e);
+static inline double lltm_d_elu(double z) {
+  return z > 0 ? 1 : z + 1;
+}
+
+static inline double lltm_tanh(double x) {
+  return std::tanh(x);
+}
+
+// Fused forward gates of a (batch, 3 * state) block of gate pre-activations: every pre-activation
+// is read once and the activations, new cell and new hidden state are written directly. The
+// activations of row n start at n * gate_stride, which lets them overwrite gate_weights in place
+// (gate_stride = 3 * state with input_gate = gate_weights and the other gates following it).
+template <typename scalar_t>
+static void lltm_cpu_gates_forward(
+    const scalar_t* gate_weights,
+    const scalar_t* old_cell,
+    scalar_t* new_h,
+    scalar_t* new_cell,
+    scalar_t* input_gate,
+    scalar_t* output_gate,
+    scalar_t* candidate_cell,
+    int64_t gate_stride,
+    int64_t batch_size,
+    int64_t state_size) {
+  const int64_t grain_size = std::max<int64_t>(1, LLTM_CPU_GRAIN_SIZE / state_size);
+
+  at::parallel_for(0, batch_size, grain_size, [&](int64_t start, int64_t end) {
+    for (int64_t n = start; n < end; n++) {
+      const scalar_t* gates = gate_weights + n * 3 * state_size;
+      const scalar_t* old_cell_n = old_cell + n * state_size;
+      scalar_t* new_h_n = new_h + n * state_size;
+      scalar_t* new_cell_n = new_cell + n * state_size;
+      scalar_t* input_gate_n = input_gate + n * gate_stride;
+      scalar_t* output_gate_n = output_gate + n * gate_stride;
+      scalar_t* candidate_cell_n = candidate_cell + n * gate_stride;
+
+#pragma omp simd
+      for (int64_t c = 0; c < state_size; c++) {
+        scalar_t i = lltm_sigmoid(gates[c]);
+        scalar_t o = lltm_sigmoid(gates[state_size + c]);
+        scalar_t z = lltm_elu(gates[2 * state_size + c]);
+        scalar_t cell = old_cell_n[c] + z * i;
+
+        input_gate_n[c] = i;
+        output_gate_n[c] = o;
+        candidate_cell_n[c] = z;
+        new_cell_n[c] = cell;
+        new_h_n[c] = lltm_tanh(cell) * o;
+      }
+    }
+  });
+}
+
+// Fused backward gates, the derivatives are recovered from the activations saved by
+// lltm_cpu_gates_forward (with the same gate_stride). Writes the (batch, 3 * state) gate
+// gradients and the gradient of the old cell, which may alias grad_cell.
+template <typename scalar_t>
+static void lltm_cpu_gates_backward(
+    const scalar_t* grad_h,
+    const scalar_t* grad_cell,
+    const scalar_t* new_cell,
+    const scalar_t* input_gate,
+    const scalar_t* output_gate,
+    const scalar_t* candidate_cell,
+    scalar_t* d_gates,
+    scalar_t* d_old_cell,
+    int64_t gate_stride,
+    int64_t batch_size,
+    int64_t state_size) {
+  const int64_t grain_size = std::max<int64_t>(1, LLTM_CPU_GRAIN_SIZE / state_size);
+
+  at::parallel_for(0, batch_size, grain_size, [&](int64_t start, int64_t end) {
+    for (int64_t n = start; n < end; n++) {
+      const scalar_t* grad_h_n = grad_h + n * state_size;
+      const scalar_t* grad_cell_n = grad_cell + n * state_size;
+      const scalar_t* new_cell_n = new_cell + n * state_size;
+      const scalar_t* input_gate_n = input_gate + n * gate_stride;
+      const scalar_t* output_gate_n = output_gate + n * gate_stride;
+      const scalar_t* candidate_cell_n = candidate_cell + n * gate_stride;
+      scalar_t* d_gates_n = d_gates + n * 3 * state_size;
+      scalar_t* d_old_cell_n = d_old_cell + n * state_size;
+
+#pragma omp simd
+      for (int64_t c = 0; c < state_size; c++) {
+        scalar_t i = input_gate_n[c];
+        scalar_t o = output_gate_n[c];
+        scalar_t z = candidate_cell_n[c];
+        scalar_t tanh_new_cell = lltm_tanh(new_cell_n[c]);
+        scalar_t d_new_cell = (1 - tanh_new_cell * tanh_new_cell) * o * grad_h_n[c] + grad_cell_n[c];
+
+        d_gates_n[c] = z * d_new_cell * (1 - i) * i;
+        d_gates_n[state_size + c] = tanh_new_cell * grad_h_n[c] * (1 - o) * o;
+        d_gates_n[2 * state_size + c] = i * d_new_cell * lltm_d_elu(z);
+        d_old_cell_n[c] = d_new_cell;
+      }
+    }
+  });
 }
 
 std::vector<torch::Tensor> lltm_cpu_forward(
@@ -38,17 +181,33 @@ std::vector<torch::Tensor> lltm_cpu_forward(
     torch::Tensor bias,
     torch::Tensor old_h,
     torch::Tensor old_cell) {
-  auto X = torch::cat({old_h, input}, /*dim=*/1);
+  const auto batch_size = old_cell.size(0);
+  const auto state_size = old_cell.size(1);
 
+  auto X = torch::cat({old_h, input}, /*dim=*/1);
   auto gate_weights = torch::addmm(bias, X, weights.transpose(0, 1));
-  auto gates = gate_weights.chunk(3, /*dim=*/1);
 
-  auto input_gate = torch::sigmoid(gates[0]);
-  auto output_gate = torch::sigmoid(gates[1]);
-  auto candidate_cell = torch::elu(gates[2], /*alpha=*/1.0);
+  old_cell = old_cell.contiguous();
+
+  auto new_h = torch::empty_like(old_cell);
+  auto new_cell = torch::empty_like(old_cell);
+  auto input_gate = torch::empty_like(old_cell);
+  auto output_gate = torch::empty_like(old_cell);
+  auto candidate_cell = torch::empty_like(old_cell);
 
-  auto new_cell = old_cell + candidate_cell * input_gate;
-  auto new_h = torch::tanh(new_cell) * output_gate;
+  AT_DISPATCH_FLOATING_TYPES(input.scalar_type(), "lltm_cpu_forward", ([&] {
+                               lltm_cpu_gates_forward<scalar_t>(
+                                   gate_weights.data_ptr<scalar_t>(),
+                                   old_cell.data_ptr<scalar_t>(),
+                                   new_h.data_ptr<scalar_t>(),
+                                   new_cell.data_ptr<scalar_t>(),
+                                   input_gate.data_ptr<scalar_t>(),
+                                   output_gate.data_ptr<scalar_t>(),
+                                   candidate_cell.data_ptr<scalar_t>(),
+                                   state_size,
+                                   batch_size,
+                                   state_size);
+                             }));
 
   return {new_h, new_cell, input_gate, output_gate, candidate_cell, X, gate_weights};
 }
@@ -63,28 +222,157 @@ std::vector<torch::Tensor> lltm_cpu_backward(
     torch::Tensor X,
     torch::Tensor gate_weights,
     torch::Tensor weights) {
-  auto d_output_gate = torch::tanh(new_cell) * grad_h;
-  auto d_tanh_new_cell = output_gate * grad_h;
-  auto d_new_cell = d_tanh(new_cell) * d_tanh_new_cell + grad_cell;
+  const auto batch_size = new_cell.size(0);
+  const auto state_size = new_cell.size(1);
 
-  auto d_old_cell = d_new_cell;
-  auto d_candidate_cell = input_gate * d_new_cell;
-  auto d_input_gate = candidate_cell * d_new_cell;
+  grad_h = grad_h.contiguous();
+  grad_cell = grad_cell.contiguous();
+  new_cell = new_cell.contiguous();
+  input_gate = input_gate.contiguous();
+  output_gate = output_gate.contiguous();
+  candidate_cell = candidate_cell.contiguous();
 
-  auto gates = gate_weights.chunk(3, /*dim=*/1);
-  d_input_gate *= d_sigmoid(gates[0]);
-  d_output_gate *= d_sigmoid(gates[1]);
-  d_candidate_cell *= d_elu(gates[2]);
+  auto d_gates = torch::empty_like(gate_weights);
+  auto d_old_cell = torch::empty_like(new_cell);
 
-  auto d_gates = torch::cat({d_input_gate, d_output_gate, d_candidate_cell}, /*dim=*/1);
+  AT_DISPATCH_FLOATING_TYPES(X.scalar_type(), "lltm_cpu_backward", ([&] {
+                               lltm_cpu_gates_backward<scalar_t>(
+                                   grad_h.data_ptr<scalar_t>(),
+                                   grad_cell.data_ptr<scalar_t>(),
+                                   new_cell.data_ptr<scalar_t>(),
+                                   input_gate.data_ptr<scalar_t>(),
+                                   output_gate.data_ptr<scalar_t>(),
+                                   candidate_cell.data_ptr<scalar_t>(),
+                                   d_gates.data_ptr<scalar_t>(),
+                                   d_old_cell.data_ptr<scalar_t>(),
+                                   state_size,
+                                   batch_size,
+                                   state_size);
+                             }));
 
   auto d_weights = d_gates.t().mm(X);
   auto d_bias = d_gates.sum(/*dim=*/0, /*keepdim=*/true);
 
   auto d_X = d_gates.mm(weights);
-  const auto state_size = grad_h.size(1);
   auto d_old_h = d_X.slice(/*dim=*/1, 0, state_size);
   auto d_input = d_X.slice(/*dim=*/1, state_size);
 
   return {d_old_h, d_input, d_weights, d_bias, d_old_cell};
 }
+
+std::vector<torch::Tensor> lltm_cpu_sequence_forward(
+    torch::Tensor input,
+    torch::Tensor weights,
+    torch::Tensor bias,
+    torch::Tensor old_h,
+    torch::Tensor old_cell) {
+  const auto sequence_length = input.size(0);
+  const auto batch_size = input.size(1);
+  const auto input_features = input.size(2);
+  const auto state_size = old_h.size(1);
+
+  input = input.contiguous();
+  old_h = old_h.contiguous();
+  old_cell = old_cell.contiguous();
+
+  // The weights act on cat(h, input), pack their state and input columns once.
+  auto weights_h = weights.slice(/*dim=*/1, 0, state_size).t().contiguous();
+  auto weights_x = weights.slice(/*dim=*/1, state_size).t().contiguous();
+
+  // Input projections of all timesteps in a single GEMM, the state projections are added per step.
+  auto gates = torch::addmm(bias, input.view({sequence_length * batch_size, input_features}), weights_x)
+                   .view({sequence_length, batch_size, 3 * state_size});
+
+  auto hs = torch::empty({sequence_length, batch_size, state_size}, input.options());
+  auto cells = torch::empty({sequence_length, batch_size, state_size}, input.options());
+
+  AT_DISPATCH_FLOATING_TYPES(input.scalar_type(), "lltm_cpu_sequence_forward", ([&] {
+                               for (int64_t t = 0; t < sequence_length; t++) {
+                                 auto gates_t = gates[t];
+                                 gates_t.addmm_(t == 0 ? old_h : hs[t - 1], weights_h);
+
+                                 scalar_t* gates_data = gates_t.data_ptr<scalar_t>();
+
+                                 // The activations overwrite the pre-activations of the step.
+                                 lltm_cpu_gates_forward<scalar_t>(
+                                     gates_data,
+                                     t == 0 ? old_cell.data_ptr<scalar_t>() : cells[t - 1].data_ptr<scalar_t>(),
+                                     hs[t].data_ptr<scalar_t>(),
+                                     cells[t].data_ptr<scalar_t>(),
+                                     gates_data,
+                                     gates_data + state_size,
+                                     gates_data + 2 * state_size,
+                                     3 * state_size,
+                                     batch_size,
+                                     state_size);
+                               }
+                             }));
+
+  return {hs, cells, gates};
+}
+
+std::vector<torch::Tensor> lltm_cpu_sequence_backward(
+    torch::Tensor grad_hs,
+    torch::Tensor grad_cells,
+    torch::Tensor input,
+    torch::Tensor old_h,
+    torch::Tensor hs,
+    torch::Tensor cells,
+    torch::Tensor gates,
+    torch::Tensor weights) {
+  const auto sequence_length = input.size(0);
+  const auto batch_size = input.size(1);
+  const auto input_features = input.size(2);
+  const auto state_size = old_h.size(1);
+
+  grad_hs = grad_hs.contiguous();
+  grad_cells = grad_cells.contiguous();
+  input = input.contiguous();
+  old_h = old_h.contiguous();
+
+  auto weights_h = weights.slice(/*dim=*/1, 0, state_size).contiguous();
+  auto weights_x = weights.slice(/*dim=*/1, state_size).contiguous();
+
+  auto d_gates = torch::empty_like(gates);
+  auto d_h = torch::zeros_like(old_h);
+  auto d_cell = torch::zeros_like(old_h);
+  auto grad_h = torch::empty_like(old_h);
+
+  AT_DISPATCH_FLOATING_TYPES(input.scalar_type(), "lltm_cpu_sequence_backward", ([&] {
+                               for (int64_t t = sequence_length - 1; t >= 0; t--) {
+                                 // Gradients of h_t and cell_t from the outputs and from the step after them.
+                                 torch::add_out(grad_h, grad_hs[t], d_h);
+                                 d_cell.add_(grad_cells[t]);
+
+                                 const scalar_t* gates_data = gates[t].data_ptr<scalar_t>();
+
+                                 lltm_cpu_gates_backward<scalar_t>(
+                                     grad_h.data_ptr<scalar_t>(),
+                                     d_cell.data_ptr<scalar_t>(),
+                                     cells[t].data_ptr<scalar_t>(),
+                                     gates_data,
+                                     gates_data + state_size,
+                                     gates_data + 2 * state_size,
+                                     d_gates[t].data_ptr<scalar_t>(),
+                                     d_cell.data_ptr<scalar_t>(),
+                                     3 * state_size,
+                                     batch_size,
+                                     state_size);
+
+                                 torch::mm_out(d_h, d_gates[t], weights_h);
+                               }
+                             }));
+
+  // Weight, bias and input gradients of all timesteps in single GEMMs.
+  auto d_gates_2d = d_gates.view({sequence_length * batch_size, 3 * state_size});
+  auto old_hs = torch::cat({old_h.unsqueeze(0), hs.slice(/*dim=*/0, 0, sequence_length - 1)}, /*dim=*/0);
+
+  auto d_weights = torch::cat(
+      {d_gates_2d.t().mm(old_hs.view({sequence_length * batch_size, state_size})),
+       d_gates_2d.t().mm(input.view({sequence_length * batch_size, input_features}))},
+      /*dim=*/1);
+  auto d_bias = d_gates_2d.sum(/*dim=*/0, /*keepdim=*/true);
+  auto d_input = d_gates_2d.mm(weights_x).view({sequence_length, batch_size, input_features});
+
+  return {d_input, d_weights, d_bias, d_h, d_cell};
+}
@@ -0,0 +1,60 @@
+/*
+Copyright (c) MONAI Consortium
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+// Float helpers for CPU loops that have to vectorise. They avoid library calls and branches;
+// selects are made with integer operations on the float bits, which vectorise where float
+// comparisons may not.
+
+inline int FloatBits(float x) {
+  union {
+    float f;
+    int i;
+  } bits;
+  bits.f = x;
+  return bits.i;
+}
+
+inline float BitsFloat(int i) {
+  union {
+    int i;
+    float f;
+  } bits;
+  bits.i = i;
+  return bits.f;
+}
+
+// exp(-a) of a non-negative a with a Cephes style range reduction and polynomial, accurate to a
+// few ulp.
+inline float ExpNegative(float a) {
+  // Clamp a at 87 to stay within normal floats, non-negative floats order like their bits.
+  int aBits = FloatBits(a);
+  int maxBits = FloatBits(87.0f);
+  float x = -BitsFloat(aBits < maxBits ? aBits : maxBits);
+
+  // x = n * ln(2) + r with |r| <= ln(2) / 2 (truncation rounds towards zero here).
+  int n = (int)(x * 1.44269504088896341f - 0.5f);
+  float r = x - n * 0.693359375f + n * 2.12194440e-4f;
+
+  float p = 1.9875691500e-4f;
+  p = p * r + 1.3981999507e-3f;
+  p = p * r + 8.3334519073e-3f;
+  p = p * r + 4.1665795894e-2f;
+  p = p * r + 1.6666665459e-1f;
+  p = p * r + 5.0000001201e-1f;
+  p = p * r * r + r + 1.0f;
+
+  // Scale by 2^n through the exponent bits.
+  return p * BitsFloat((n + 127) << 23);
+}
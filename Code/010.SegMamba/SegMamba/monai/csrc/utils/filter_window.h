@@ -0,0 +1,105 @@
+/*
+Copyright (c) MONAI Consortium
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include <math.h>
+#include <torch/extension.h>
+#include <algorithm>
+#include <stdexcept>
+
+#include "utils/tensor_description.h"
+
+// Spatial window of the CPU trainable bilateral filters, per spatial axis of the tensor a
+// Gaussian of standard deviation sigmas[axis] (x, y, z).
+//
+// Axes of size 1 are dropped: their window only holds the home element, with weight 1. The
+// window along every other axis is clipped to the extent of the axis, neighbours further away
+// are always outside the image and disregarded. Both leave the filter unchanged, and the kernels
+// specialized on the number of kept axes do not loop over degenerate axes of 1D and 2D inputs
+// (also when these are padded to 3D) or over windows larger than thin volumes.
+//
+// Axis i of the window is spatial axis axes[i] of the tensor. At least one axis is kept.
+template <typename scalar_t>
+struct FilterWindow {
+ public:
+  FilterWindow(const TensorDescription& desc, const float* axisSigmas) {
+    if (desc.dimensions < 1 || desc.dimensions > 3) {
+      throw std::runtime_error("Trainable bilateral filtering is only implemented for 1 to 3 spatial dimensions");
+    }
+
+    dimensions = 0;
+
+    for (int axis = 0; axis < desc.dimensions; axis++) {
+      if (desc.sizes[axis] == 1 && (dimensions > 0 || axis < desc.dimensions - 1)) {
+        continue;
+      }
+
+      // ORing last bit to ensure odd window size
+      int windowSize = std::max(((int)ceil(5.0f * axisSigmas[axis]) | 1), 5);
+      int halfWindowSize = std::min((int)floor(0.5f * windowSize), desc.sizes[axis] - 1);
+      scalar_t spatialExpConstant = -1.0f / (2 * axisSigmas[axis] * axisSigmas[axis]);
+
+      axes[dimensions] = axis;
+      sigmas[dimensions] = axisSigmas[axis];
+      sizes[dimensions] = desc.sizes[axis];
+      strides[dimensions] = desc.strides[axis];
+      halfWindowSizes[dimensions] = halfWindowSize;
+      kernelSizes[dimensions] = 2 * halfWindowSize + 1;
+
+      // Pre-calculate gaussian kernel and distance map in 1D.
+      gaussianKernels[dimensions] = new scalar_t[kernelSizes[dimensions]];
+      distancesSquared[dimensions] = new scalar_t[kernelSizes[dimensions]];
+
+      for (int i = 0; i < kernelSizes[dimensions]; i++) {
+        int distance = i - halfWindowSize;
+        gaussianKernels[dimensions][i] = exp(distance * distance * spatialExpConstant);
+        distancesSquared[dimensions][i] = distance * distance;
+      }
+
+      dimensions++;
+    }
+  }
+
+  ~FilterWindow() {
+    for (int i = 0; i < dimensions; i++) {
+      delete[] gaussianKernels[i];
+      delete[] distancesSquared[i];
+    }
+  }
+
+  FilterWindow(const FilterWindow&) = delete;
+  FilterWindow& operator=(const FilterWindow&) = delete;
+
+  // Number of rows of home elements of batchCount batch elements, a row running along the last
+  // axis of the window (the contiguous one for contiguous tensors).
+  int rowCount(int batchCount) const {
+    int count = batchCount;
+
+    for (int i = 0; i < dimensions - 1; i++) {
+      count *= sizes[i];
+    }
+
+    return count;
+  }
+
+  int dimensions;
+  int axes[3];
+  float sigmas[3];
+  int sizes[3];
+  int strides[3];
+  int halfWindowSizes[3];
+  int kernelSizes[3];
+  scalar_t* gaussianKernels[3];
+  scalar_t* distancesSquared[3];
+};
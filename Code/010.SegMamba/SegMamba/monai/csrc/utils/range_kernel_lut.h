@@ -0,0 +1,132 @@
+/*
+Copyright (c) MONAI Consortium
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include <math.h>
+#include <torch/extension.h>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+// Largest table the range kernel lookup will build. Tighter error bounds fall back to exp().
+#define RANGE_KERNEL_LUT_MAX_ENTRIES (1 << 20)
+
+// Maximum absolute error allowed for the range kernel lookup table used by the CPU
+// bilateral filters. Zero (the default) disables the table and evaluates exp() exactly.
+inline float& RangeKernelLutMaxErrorStorage() {
+  static float maxError = 0.0f;
+  return maxError;
+}
+
+inline void SetRangeKernelLutMaxError(float maxError) {
+  if (maxError < 0 || maxError >= 1) {
+    throw std::runtime_error("Range kernel lookup table max error must be in [0, 1), got " + std::to_string(maxError));
+  }
+
+  RangeKernelLutMaxErrorStorage() = maxError;
+}
+
+inline float GetRangeKernelLutMaxError() {
+  return RangeKernelLutMaxErrorStorage();
+}
+
+// Evaluates the range (color) kernel exp(colorExpConstant * distanceSquared).
+//
+// When enabled, the kernel is linearly interpolated from a table sampled on the squared
+// distance. For f(s) = exp(-a * s) the interpolation error is bounded by a^2 * h^2 / 8 for a
+// step h, and the kernel is cut to zero once it drops below the error bound, so the table
+// holds ln(1 / maxError) / sqrt(8 * maxError) entries independent of the color sigma.
+template <typename scalar_t>
+class RangeKernelLut {
+ public:
+  RangeKernelLut(scalar_t colorExpConstant_, float maxError) : colorExpConstant(colorExpConstant_) {
+    table = NULL;
+    entryCount = 0;
+    invStep = 0;
+    maxPosition = 0;
+
+    float rate = -(float)colorExpConstant;
+
+    if (maxError <= 0 || maxError >= 1 || !(rate > 0)) {
+      return;
+    }
+
+    double step = sqrt(8.0 * maxError) / rate;
+    double cutoff = log(1.0 / maxError) / rate;
+    double entries = ceil(cutoff / step) + 2;
+
+    if (entries > RANGE_KERNEL_LUT_MAX_ENTRIES) {
+      return;
+    }
+
+    entryCount = (int)entries;
+    invStep = (scalar_t)(1.0 / step);
+    maxPosition = (scalar_t)(entryCount - 1);
+    table = new scalar_t[entryCount + 1];
+
+    for (int i = 0; i < entryCount - 1; i++) {
+      table[i] = exp(-rate * step * i);
+    }
+
+    // The last entry ends the interpolation range at zero weight, the padding entry keeps
+    // lookups past the cutoff in bounds so they need no branch.
+    table[entryCount - 1] = 0;
+    table[entryCount] = 0;
+  }
+
+  ~RangeKernelLut() {
+    delete[] table;
+  }
+
+  RangeKernelLut(const RangeKernelLut&) = delete;
+  RangeKernelLut& operator=(const RangeKernelLut&) = delete;
+
+  bool enabled() const {
+    return table != NULL;
+  }
+
+  // The table, its inverse step and last position, for callers that interpolate several
+  // distances at once like operator(). The table is padded by one entry past the last position.
+  const scalar_t* data() const {
+    return table;
+  }
+
+  scalar_t inverseStep() const {
+    return invStep;
+  }
+
+  scalar_t lastPosition() const {
+    return maxPosition;
+  }
+
+  inline scalar_t operator()(scalar_t distanceSquared) const {
+    if (table == NULL) {
+      return exp(distanceSquared * colorExpConstant);
+    }
+
+    scalar_t position = distanceSquared * invStep;
+    position = std::min(position, maxPosition);
+    int index = (int)position;
+    scalar_t fraction = position - index;
+
+    return table[index] + fraction * (table[index + 1] - table[index]);
+  }
+
+ private:
+  scalar_t colorExpConstant;
+  scalar_t invStep;
+  scalar_t maxPosition;
+  scalar_t* table;
+  int entryCount;
+};
@@ -11,6 +11,8 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
+#pragma once
+
 #include <torch/extension.h>
 
 // Struct to easily cache descriptive information about a tensor.
@@ -11,6 +11,8 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
+#pragma once
+
 #include <torch/extension.h>
 
 // Struct to easily index input tensors.
@@ -48,3 +50,38 @@ struct Indexer {
   int* m_sizes;
   int* m_index;
 };
+
+// Indexer over a dimension count known at compile time, keeping the index on the stack.
+template <int D>
+struct StaticIndexer {
+ public:
+  StaticIndexer(const int* sizes) {
+    m_sizes = sizes;
+
+    for (int i = 0; i < D; i++) {
+      m_index[i] = 0;
+    }
+  }
+
+  bool operator++(int) {
+    for (int i = 0; i < D; i++) {
+      m_index[i] += 1;
+
+      if (m_index[i] < m_sizes[i]) {
+        return true;
+      } else {
+        m_index[i] = 0;
+      }
+    }
+
+    return false;
+  }
+
+  int& operator[](int dimensionIndex) {
+    return m_index[dimensionIndex];
+  }
+
+ private:
+  const int* m_sizes;
+  int m_index[D];
+};
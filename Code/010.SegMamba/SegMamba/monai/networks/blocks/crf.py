@@ -16,6 +16,9 @@ from torch.nn.functional import softmax
 
 from monai.networks.layers.filtering import PHLFilter
 from monai.networks.utils import meshgrid_ij
+from monai.utils.module import optional_import
+
+_C, _ = optional_import("monai._C")
 
 __all__ = ["CRF"]
 
@@ -31,6 +34,10 @@ class CRF(torch.nn.Module):
     The bilateral term is included to respect existing structure
     within the reference tensor.
 
+    CPU inputs that need no gradient run the whole mean field loop in a single
+    C++ operator, building both permutohedral lattices once instead of every
+    iteration.
+
     See:
         https://arxiv.org/abs/1502.03240
     """
@@ -78,6 +85,20 @@ class CRF(torch.nn.Module):
             output (torch.Tensor): output tensor.
         """
 
+        if not input_tensor.is_cuda and not self._requires_grad(input_tensor, reference_tensor):
+            return _C.dense_crf(
+                input_tensor,
+                reference_tensor,
+                self.iterations,
+                self.bilateral_weight,
+                self.gaussian_weight,
+                self.bilateral_spatial_sigma,
+                self.bilateral_color_sigma,
+                self.gaussian_spatial_sigma,
+                self.update_factor,
+                self.compatibility_matrix,
+            )
+
         # constructing spatial feature tensor
         spatial_features = _create_coordinate_tensor(reference_tensor)
 
@@ -110,6 +131,10 @@ class CRF(torch.nn.Module):
 
         return output_tensor
 
+    def _requires_grad(self, input_tensor: torch.Tensor, reference_tensor: torch.Tensor) -> bool:
+        tensors = [input_tensor, reference_tensor, self.compatibility_matrix]
+        return torch.is_grad_enabled() and any(t is not None and t.requires_grad for t in tensors)
+
 
 # helper methods
 def _create_coordinate_tensor(tensor):
@@ -11,24 +11,133 @@
 
 from __future__ import annotations
 
+import logging
+
 import torch
 
 from monai.utils.module import optional_import
 
 _C, _ = optional_import("monai._C")
 
-__all__ = ["BilateralFilter", "PHLFilter", "TrainableBilateralFilter", "TrainableJointBilateralFilter"]
+logger = logging.getLogger(__name__)
+
+__all__ = [
+    "BilateralFilter",
+    "PHLFilter",
+    "TrainableBilateralFilter",
+    "TrainableJointBilateralFilter",
+    "set_range_lut_max_error",
+    "set_phl_compact_replay",
+    "calibrate_bilateral_filter_cost_model",
+]
+
+
+def set_range_lut_max_error(max_error: float = 0.0) -> None:
+    """
+    Configures the range (color) kernel lookup table used by the CPU implementations of
+    the exact bilateral filter and the trainable (joint) bilateral filters.
+
+    When enabled, ``exp(-d^2 / (2 * color_sigma^2))`` is linearly interpolated from a table
+    on the squared color distance instead of being evaluated for every neighbour, and
+    weights below ``max_error`` are cut to zero. The absolute error of each range weight is
+    bounded by ``max_error``. Every voxel uses the same table, including the vectorised
+    interior of float, half and bfloat16 inputs. The table mostly speeds up double inputs and
+    image borders, which otherwise call ``exp`` per neighbour. Vectorised interiors already
+    evaluate ``exp`` in SIMD and gain little, or lose some speed where gathers are slow.
+
+    Args:
+        max_error: maximum absolute error of the range kernel, in [0, 1).
+            ``0`` (the default) disables the table and evaluates the kernel exactly.
+    """
+    _C.set_range_lut_max_error(max_error)
+
+
+def set_phl_compact_replay(enabled: bool = False) -> None:
+    """
+    Configures how CPU permutohedral lattices (``PHLFilter``, ``BilateralFilter`` with the
+    ``"phl"`` algorithm and ``monai._C.PermutohedralLattice``) store their barycentric weights.
+
+    For every voxel the lattice keeps the ``d + 1`` vertices of its enclosing simplex, where
+    ``d`` is the number of features. By default each entry holds a 4 byte vertex index and a
+    weight in the precision of the input, 8 (float) or 12 (double) bytes, and
+    ``monai._C.PermutohedralLattice`` adds a 4 byte splat index, 12 or 16 bytes. When enabled
+    only the 4 byte vertex index is kept and the weights are recomputed from the features
+    every time the lattice splats or slices, which allows larger volumes to be filtered. The
+    results are unchanged, but filtering is slower: about 1.8x for a one-shot filter and 4x
+    for ``PermutohedralLattice.filter`` in a single-threaded test. The setting applies to
+    lattices built after the call.
+
+    Args:
+        enabled: recompute the weights instead of storing them. ``False`` (the default)
+            stores them.
+    """
+    _C.set_phl_compact_replay(enabled)
+
+
+def calibrate_bilateral_filter_cost_model() -> list[float]:
+    """
+    Runs a short micro-benchmark of the CPU bilateral filter algorithms and fits the cost model
+    used by ``BilateralFilter`` with ``fast_approx="auto"`` to the current machine. The model
+    estimates the runtime of each algorithm as ``overhead + per_work * work``, where the work
+    is derived from the voxel count, dimensionality, channel count and sigmas.
+
+    Returns:
+        the fitted constants, ``[overhead, per_work]`` for the exact, permutohedral and grid
+        algorithms in this order, in seconds. They can be restored on a later run with
+        ``_C.set_bilateral_filter_cost_model``.
+    """
+    return _C.calibrate_bilateral_filter_cost_model()
+
+
+def _bilateral_filter_algorithm(fast_approx, input, spatial_sigma, color_sigma):
+    """Maps the ``fast_approx`` argument of :py:class:`BilateralFilter` to the C++ algorithm enum."""
+    if not isinstance(fast_approx, str):
+        return _C.BilateralFilterAlgorithm.phl if fast_approx else _C.BilateralFilterAlgorithm.exact
+    algorithms = _C.BilateralFilterAlgorithm.__members__
+    if fast_approx not in algorithms:
+        raise ValueError(f"Unknown bilateral filter algorithm {fast_approx!r}, expected one of {list(algorithms)}.")
+    if fast_approx != "auto":
+        return algorithms[fast_approx]
+
+    algorithm = _C.bilateral_filter_select_algorithm(input, spatial_sigma, color_sigma)
+    if logger.isEnabledFor(logging.DEBUG):
+        costs = {
+            name: _C.bilateral_filter_cost(input, spatial_sigma, color_sigma, value)
+            for name, value in algorithms.items()
+            if name != "auto"
+        }
+        logger.debug(
+            f"BilateralFilter auto selected {algorithm.name} for input {tuple(input.shape)}, "
+            f"spatial_sigma={spatial_sigma}, color_sigma={color_sigma} (estimated seconds: {costs})."
+        )
+    return algorithm
+
+
+def _requires_grad(*tensors):
+    """Whether autograd has to track an operation on ``tensors``."""
+    return torch.is_grad_enabled() and any(t.requires_grad for t in tensors)
 
 
 class BilateralFilter(torch.autograd.Function):
     """
     Blurs the input tensor spatially whilst preserving edges. Can run on 1D, 2D, or 3D,
-    tensors (on top of Batch and Channel dimensions). Two implementations are provided,
-    an exact solution and a much faster approximation which uses a permutohedral lattice.
+    tensors (on top of Batch and Channel dimensions). Three implementations are provided,
+    an exact solution, a much faster approximation which uses a permutohedral lattice and,
+    on CPU, a bilateral grid approximation.
+
+    The bilateral grid samples the joint spatial/color space at one cell per sigma, so its
+    cost and memory scale with ``voxels / spatial_sigma^dims * (range / color_sigma)^channels``
+    rather than with the window size. It suits low-channel data (spatial dimension plus
+    channel count of at most 6) with large spatial sigmas. On piecewise-constant test images
+    in [0, 1] (1D to 3D, 1 or 3 channels, spatial_sigma 2-4, color_sigma 0.1-0.3) its mean
+    absolute difference to the exact filter was about 0.2% of the intensity range, with
+    maximal differences of 1.5-4% at edges and image borders. Unlike the exact filter, it
+    does not replicate border voxels.
 
     See:
         https://en.wikipedia.org/wiki/Bilateral_filter
         https://graphics.stanford.edu/papers/permutohedral/
+        https://people.csail.mit.edu/sparis/publi/2006/eccv/Paris_06_Fast_Approximation.pdf
 
     Args:
         input: input tensor.
@@ -38,7 +147,11 @@ class BilateralFilter(torch.autograd.Function):
             edges better whilst higher values tend to a simple gaussian spatial blur.
         fast approx: This flag chooses between two implementations. The approximate method may
             produce artifacts in some scenarios whereas the exact solution may be intolerably
-            slow for high spatial standard deviations.
+            slow for high spatial standard deviations. An algorithm name can also be given:
+            ``"exact"``, ``"phl"`` (permutohedral lattice), ``"grid"`` (bilateral grid, CPU only)
+            or ``"auto"``, which picks the algorithm with the lowest estimated cost (see
+            :py:func:`calibrate_bilateral_filter_cost_model`). The choice is logged at debug level
+            by this module's logger.
 
     Returns:
         output (torch.Tensor): output tensor.
@@ -49,8 +162,8 @@ class BilateralFilter(torch.autograd.Function):
         """autograd forward"""
         ctx.ss = spatial_sigma
         ctx.cs = color_sigma
-        ctx.fa = fast_approx
-        output_data = _C.bilateral_filter(input, spatial_sigma, color_sigma, fast_approx)
+        ctx.fa = _bilateral_filter_algorithm(fast_approx, input, spatial_sigma, color_sigma)
+        output_data = _C.bilateral_filter(input, spatial_sigma, color_sigma, ctx.fa)
         return output_data
 
     @staticmethod
@@ -68,6 +181,17 @@ class PHLFilter(torch.autograd.Function):
     filtering. Complexity is broadly independent of kernel size. Most applicable
     to higher filter dimensions and larger kernel sizes.
 
+    To filter several CPU tensors against the same (scaled) features, for example in
+    CRF mean-field iterations, build ``lattice = monai._C.PermutohedralLattice(features)``
+    once and call ``lattice.filter(input)`` for each of them. This skips the lattice
+    construction (hashing and neighbour search) after the first call. The lattice also keeps
+    an index of its splat weights by vertex, 4 bytes per voxel and feature, so that every
+    filter splats in parallel; one-shot filters do not build it.
+
+    On the CPU the filter is differentiable with respect to both the input and the features,
+    the gradients are those of the lattice approximation (splat, blur and slice transposed,
+    and the barycentric weights for the features). Backpropagation is not supported on CUDA.
+
     See:
         https://graphics.stanford.edu/papers/permutohedral/
 
@@ -84,19 +208,27 @@ class PHLFilter(torch.autograd.Function):
     def forward(ctx, input, features, sigmas=None):
         scaled_features = features
         if sigmas is not None:
+            scaled_features = features.clone()
             for i in range(features.size(1)):
                 scaled_features[:, i, ...] /= sigmas[i]
 
-        ctx.save_for_backward(scaled_features)
+        ctx.save_for_backward(input, scaled_features)
+        ctx.sigmas = sigmas
         output_data = _C.phl_filter(input, scaled_features)
         return output_data
 
     @staticmethod
     def backward(ctx, grad_output):
-        raise NotImplementedError("PHLFilter does not currently support Backpropagation")
-        # scaled_features, = ctx.saved_variables
-        # grad_input = _C.phl_filter(grad_output, scaled_features)
-        # return grad_input
+        input, scaled_features = ctx.saved_tensors
+        if grad_output.is_cuda:
+            raise NotImplementedError("PHLFilter only supports backpropagation on the CPU")
+
+        grad_input, grad_features = _C.phl_filter_backward(grad_output, input, scaled_features)
+        if ctx.sigmas is not None:
+            for i in range(grad_features.size(1)):
+                grad_features[:, i, ...] /= ctx.sigmas[i]
+
+        return grad_input, grad_features, None
 
 
 class TrainableBilateralFilterFunction(torch.autograd.Function):
@@ -121,7 +253,7 @@ class TrainableBilateralFilterFunction(torch.autograd.Function):
 
     @staticmethod
     def forward(ctx, input_img, sigma_x, sigma_y, sigma_z, color_sigma):
-        output_tensor, output_weights_tensor, do_dx_ki, do_dsig_r, do_dsig_x, do_dsig_y, do_dsig_z = _C.tbf_forward(
+        output_tensor, output_weights_tensor, do_dx_ki = _C.tbf_forward(
             input_img, sigma_x, sigma_y, sigma_z, color_sigma
         )
 
@@ -134,10 +266,6 @@ class TrainableBilateralFilterFunction(torch.autograd.Function):
             output_tensor,
             output_weights_tensor,
             do_dx_ki,
-            do_dsig_r,
-            do_dsig_x,
-            do_dsig_y,
-            do_dsig_z,
         )
 
         return output_tensor
@@ -152,18 +280,9 @@ class TrainableBilateralFilterFunction(torch.autograd.Function):
         output_tensor = ctx.saved_tensors[5]  # filtered image
         output_weights_tensor = ctx.saved_tensors[6]  # weights
         do_dx_ki = ctx.saved_tensors[7]  # derivative of output with respect to input, while k==i
-        do_dsig_r = ctx.saved_tensors[8]  # derivative of output with respect to range sigma
-        do_dsig_x = ctx.saved_tensors[9]  # derivative of output with respect to sigma x
-        do_dsig_y = ctx.saved_tensors[10]  # derivative of output with respect to sigma y
-        do_dsig_z = ctx.saved_tensors[11]  # derivative of output with respect to sigma z
-
-        # calculate gradient with respect to the sigmas
-        grad_color_sigma = torch.sum(grad_output * do_dsig_r)
-        grad_sig_x = torch.sum(grad_output * do_dsig_x)
-        grad_sig_y = torch.sum(grad_output * do_dsig_y)
-        grad_sig_z = torch.sum(grad_output * do_dsig_z)
-
-        grad_output_tensor = _C.tbf_backward(
+
+        # the gradients with respect to the sigmas (x, y, z, color) are reduced in the backward pass
+        grad_output_tensor, grad_sigma = _C.tbf_backward(
             grad_output,
             input_img,
             output_tensor,
@@ -175,7 +294,7 @@ class TrainableBilateralFilterFunction(torch.autograd.Function):
             color_sigma,
         )
 
-        return grad_output_tensor, grad_sig_x, grad_sig_y, grad_sig_z, grad_color_sigma
+        return grad_output_tensor, grad_sigma[0], grad_sigma[1], grad_sigma[2], grad_sigma[3]
 
 
 class TrainableBilateralFilter(torch.nn.Module):
@@ -196,12 +315,20 @@ class TrainableBilateralFilter(torch.nn.Module):
             spatial input dimensions.
         color_sigma: trainable standard deviation of the intensity range kernel. This filter
             parameter determines the degree of edge preservation.
+        storage_dtype: optional reduced precision dtype (``torch.float16`` or ``torch.bfloat16``) in
+            which the input, the output and the tensors saved for the backward pass are stored, halving
+            their memory. The CPU kernels still accumulate in float32 and the output is returned in the
+            dtype of the input. Only supported for CPU inputs, ``forward`` raises a ``ValueError`` for CUDA
+            inputs. Defaults to None, storing everything in the input dtype.
+
+    Without gradients (e.g. under ``torch.no_grad()``) only the filtered output is computed,
+    skipping the weights and derivatives kept for the backward pass.
 
     Returns:
         output (torch.Tensor): filtered tensor.
     """
 
-    def __init__(self, spatial_sigma, color_sigma):
+    def __init__(self, spatial_sigma, color_sigma, storage_dtype=None):
         super().__init__()
 
         if isinstance(spatial_sigma, float):
@@ -226,6 +353,7 @@ class TrainableBilateralFilter(torch.nn.Module):
         self.sigma_y = torch.nn.Parameter(torch.tensor(spatial_sigma[1]))
         self.sigma_z = torch.nn.Parameter(torch.tensor(spatial_sigma[2]))
         self.sigma_color = torch.nn.Parameter(torch.tensor(color_sigma))
+        self.storage_dtype = storage_dtype
 
     def forward(self, input_tensor):
         if input_tensor.shape[1] != 1:
@@ -235,7 +363,15 @@ class TrainableBilateralFilter(torch.nn.Module):
                 "to filter multiple channels."
             )
 
+        if self.storage_dtype is not None and input_tensor.is_cuda:
+            raise ValueError(
+                f"storage_dtype ({self.storage_dtype}) is only supported for CPU inputs, got {input_tensor.device}."
+            )
+
         len_input = len(input_tensor.shape)
+        input_dtype = input_tensor.dtype
+        if self.storage_dtype is not None:
+            input_tensor = input_tensor.to(self.storage_dtype)
 
         # C++ extension so far only supports 5-dim inputs.
         if len_input == 3:
@@ -246,9 +382,11 @@ class TrainableBilateralFilter(torch.nn.Module):
         if self.len_spatial_sigma != len_input:
             raise ValueError(f"Spatial dimension ({len_input}) must match initialized len(spatial_sigma).")
 
-        prediction = TrainableBilateralFilterFunction.apply(
-            input_tensor, self.sigma_x, self.sigma_y, self.sigma_z, self.sigma_color
-        )
+        sigmas = (self.sigma_x, self.sigma_y, self.sigma_z, self.sigma_color)
+        if _requires_grad(input_tensor, *sigmas):
+            prediction = TrainableBilateralFilterFunction.apply(input_tensor, *sigmas)
+        else:
+            prediction = _C.tbf_inference(input_tensor, *sigmas)
 
         # Make sure to return tensor of the same shape as the input.
         if len_input == 3:
@@ -256,7 +394,7 @@ class TrainableBilateralFilter(torch.nn.Module):
         elif len_input == 4:
             prediction = prediction.squeeze(4)
 
-        return prediction
+        return prediction.to(input_dtype)
 
 
 class TrainableJointBilateralFilterFunction(torch.autograd.Function):
@@ -282,7 +420,7 @@ class TrainableJointBilateralFilterFunction(torch.autograd.Function):
 
     @staticmethod
     def forward(ctx, input_img, guidance_img, sigma_x, sigma_y, sigma_z, color_sigma):
-        output_tensor, output_weights_tensor, do_dx_ki, do_dsig_r, do_dsig_x, do_dsig_y, do_dsig_z = _C.tjbf_forward(
+        output_tensor, output_weights_tensor, do_dx_ki = _C.tjbf_forward(
             input_img, guidance_img, sigma_x, sigma_y, sigma_z, color_sigma
         )
 
@@ -295,10 +433,6 @@ class TrainableJointBilateralFilterFunction(torch.autograd.Function):
             output_tensor,
             output_weights_tensor,
             do_dx_ki,
-            do_dsig_r,
-            do_dsig_x,
-            do_dsig_y,
-            do_dsig_z,
             guidance_img,
         )
 
@@ -314,19 +448,10 @@ class TrainableJointBilateralFilterFunction(torch.autograd.Function):
         output_tensor = ctx.saved_tensors[5]  # filtered image
         output_weights_tensor = ctx.saved_tensors[6]  # weights
         do_dx_ki = ctx.saved_tensors[7]  # derivative of output with respect to input, while k==i
-        do_dsig_r = ctx.saved_tensors[8]  # derivative of output with respect to range sigma
-        do_dsig_x = ctx.saved_tensors[9]  # derivative of output with respect to sigma x
-        do_dsig_y = ctx.saved_tensors[10]  # derivative of output with respect to sigma y
-        do_dsig_z = ctx.saved_tensors[11]  # derivative of output with respect to sigma z
-        guidance_img = ctx.saved_tensors[12]  # guidance image
-
-        # calculate gradient with respect to the sigmas
-        grad_color_sigma = torch.sum(grad_output * do_dsig_r)
-        grad_sig_x = torch.sum(grad_output * do_dsig_x)
-        grad_sig_y = torch.sum(grad_output * do_dsig_y)
-        grad_sig_z = torch.sum(grad_output * do_dsig_z)
-
-        grad_output_tensor, grad_guidance_tensor = _C.tjbf_backward(
+        guidance_img = ctx.saved_tensors[8]  # guidance image
+
+        # the gradients with respect to the sigmas (x, y, z, color) are reduced in the backward pass
+        grad_output_tensor, grad_guidance_tensor, grad_sigma = _C.tjbf_backward(
             grad_output,
             input_img,
             guidance_img,
@@ -339,7 +464,7 @@ class TrainableJointBilateralFilterFunction(torch.autograd.Function):
             color_sigma,
         )
 
-        return grad_output_tensor, grad_guidance_tensor, grad_sig_x, grad_sig_y, grad_sig_z, grad_color_sigma
+        return grad_output_tensor, grad_guidance_tensor, grad_sigma[0], grad_sigma[1], grad_sigma[2], grad_sigma[3]
 
 
 class TrainableJointBilateralFilter(torch.nn.Module):
@@ -351,6 +476,10 @@ class TrainableJointBilateralFilter(torch.nn.Module):
     Can run on 1D, 2D, or 3D tensors (on top of Batch and Channel dimensions). Input tensor shape must match
     guidance tensor shape.
 
+    Without gradients on the CPU, inputs with several channels (e.g. class probabilities) are also supported:
+    every input channel is filtered separately with weights computed once from the guidance, whose channel
+    count may differ from the input's.
+
     See:
         F. Wagner, et al., Trainable joint bilateral filters for enhanced prediction stability in
         low-dose CT, Scientific Reports (2022), https://doi.org/10.1038/s41598-022-22530-4
@@ -363,12 +492,20 @@ class TrainableJointBilateralFilter(torch.nn.Module):
             spatial input dimensions.
         color_sigma: trainable standard deviation of the intensity range kernel. This filter
             parameter determines the degree of edge preservation.
+        storage_dtype: optional reduced precision dtype (``torch.float16`` or ``torch.bfloat16``) in
+            which the input, the output and the tensors saved for the backward pass are stored, halving
+            their memory. The CPU kernels still accumulate in float32 and the output is returned in the
+            dtype of the input. Only supported for CPU inputs, ``forward`` raises a ``ValueError`` for CUDA
+            inputs. Defaults to None, storing everything in the input dtype.
+
+    Without gradients (e.g. under ``torch.no_grad()``) only the filtered output is computed,
+    skipping the weights and derivatives kept for the backward pass.
 
     Returns:
         output (torch.Tensor): filtered tensor.
     """
 
-    def __init__(self, spatial_sigma, color_sigma):
+    def __init__(self, spatial_sigma, color_sigma, storage_dtype=None):
         super().__init__()
 
         if isinstance(spatial_sigma, float):
@@ -393,21 +530,33 @@ class TrainableJointBilateralFilter(torch.nn.Module):
         self.sigma_y = torch.nn.Parameter(torch.tensor(spatial_sigma[1]))
         self.sigma_z = torch.nn.Parameter(torch.tensor(spatial_sigma[2]))
         self.sigma_color = torch.nn.Parameter(torch.tensor(color_sigma))
+        self.storage_dtype = storage_dtype
 
     def forward(self, input_tensor, guidance_tensor):
-        if input_tensor.shape[1] != 1:
+        sigmas = (self.sigma_x, self.sigma_y, self.sigma_z, self.sigma_color)
+        multi_channel = input_tensor.shape[1] != 1 or guidance_tensor.shape[1] != 1
+        if multi_channel and (input_tensor.is_cuda or _requires_grad(input_tensor, guidance_tensor, *sigmas)):
             raise ValueError(
-                f"Currently channel dimensions >1 ({input_tensor.shape[1]}) are not supported. "
-                "Please use multiple parallel filter layers if you want "
+                f"Currently channel dimensions >1 ({input_tensor.shape[1]}) are only supported for CPU "
+                "inference without gradients. Please use multiple parallel filter layers if you want "
                 "to filter multiple channels."
             )
-        if input_tensor.shape != guidance_tensor.shape:
+        if input_tensor.shape[:1] + input_tensor.shape[2:] != guidance_tensor.shape[:1] + guidance_tensor.shape[2:]:
             raise ValueError(
-                "Shape of input image must equal shape of guidance image."
+                "Shape of input image must equal shape of guidance image, apart from the channels. "
                 f"Got {input_tensor.shape} and {guidance_tensor.shape}."
             )
 
+        if self.storage_dtype is not None and input_tensor.is_cuda:
+            raise ValueError(
+                f"storage_dtype ({self.storage_dtype}) is only supported for CPU inputs, got {input_tensor.device}."
+            )
+
         len_input = len(input_tensor.shape)
+        input_dtype = input_tensor.dtype
+        if self.storage_dtype is not None:
+            input_tensor = input_tensor.to(self.storage_dtype)
+            guidance_tensor = guidance_tensor.to(self.storage_dtype)
 
         # C++ extension so far only supports 5-dim inputs.
         if len_input == 3:
@@ -420,9 +569,12 @@ class TrainableJointBilateralFilter(torch.nn.Module):
         if self.len_spatial_sigma != len_input:
             raise ValueError(f"Spatial dimension ({len_input}) must match initialized len(spatial_sigma).")
 
-        prediction = TrainableJointBilateralFilterFunction.apply(
-            input_tensor, guidance_tensor, self.sigma_x, self.sigma_y, self.sigma_z, self.sigma_color
-        )
+        if multi_channel:
+            prediction = _C.tjbf_multichannel_inference(input_tensor, guidance_tensor, *sigmas)
+        elif _requires_grad(input_tensor, guidance_tensor, *sigmas):
+            prediction = TrainableJointBilateralFilterFunction.apply(input_tensor, guidance_tensor, *sigmas)
+        else:
+            prediction = _C.tjbf_inference(input_tensor, guidance_tensor, *sigmas)
 
         # Make sure to return tensor of the same shape as the input.
         if len_input == 3:
@@ -430,4 +582,4 @@ class TrainableJointBilateralFilter(torch.nn.Module):
         elif len_input == 4:
             prediction = prediction.squeeze(4)
 
-        return prediction
+        return prediction.to(input_dtype)
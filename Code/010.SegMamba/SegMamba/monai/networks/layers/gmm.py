@@ -36,8 +36,6 @@ class GaussianMixtureModel:
             mixture_size: The number Gaussian components per class distribution.
             verbose_build: If ``True``, turns on verbose logging of load steps.
         """
-        if not torch.cuda.is_available():
-            raise NotImplementedError("GaussianMixtureModel is currently implemented for CUDA.")
         self.channel_count = channel_count
         self.mixture_count = mixture_count
         self.mixture_size = mixture_size
@@ -62,6 +60,9 @@ class GaussianMixtureModel:
             features (torch.Tensor): features for each element.
             labels (torch.Tensor): initial labeling for each element.
         """
+        if self.params.device != features.device:
+            self.params = self.params.to(features.device)
+            self.scratch = self.scratch.to(features.device)
         self.compiled_extension.learn(self.params, self.scratch, features, labels)
 
     def apply(self, features):
@@ -74,7 +75,7 @@ class GaussianMixtureModel:
         Returns:
             output (torch.Tensor): class assignment probabilities for each element.
         """
-        return _ApplyFunc.apply(self.params, features, self.compiled_extension)
+        return _ApplyFunc.apply(self.params.to(features.device), features, self.compiled_extension)
 
 
 class _ApplyFunc(torch.autograd.Function):
@@ -626,6 +626,23 @@ class LLTMFunction(Function):
         return d_input, d_weights, d_bias, d_old_h, d_old_cell
 
 
+class LLTMSequenceFunction(Function):
+
+    @staticmethod
+    def forward(ctx, input, weights, bias, old_h, old_cell):
+        hs, cells, gates = _C.lltm_sequence_forward(input, weights, bias, old_h, old_cell)
+        ctx.save_for_backward(input, old_h, hs, cells, gates, weights)
+
+        return hs, cells
+
+    @staticmethod
+    def backward(ctx, grad_hs, grad_cells):
+        outputs = _C.lltm_sequence_backward(grad_hs, grad_cells, *ctx.saved_tensors)
+        d_input, d_weights, d_bias, d_old_h, d_old_cell = outputs[:5]
+
+        return d_input, d_weights, d_bias, d_old_h, d_old_cell
+
+
 class LLTM(nn.Module):
     """
     This recurrent unit is similar to an LSTM, but differs in that it lacks a forget
@@ -657,6 +674,21 @@ class LLTM(nn.Module):
     def forward(self, input, state):
         return LLTMFunction.apply(input, self.weights, self.bias, *state)
 
+    def forward_sequence(self, input, state):
+        """
+        Runs the unit over all timesteps of `input`, in shape [Seq, Batch, input_features], from the
+        initial `state` (h, cell). Returns the hidden states and cells of every step, each in shape
+        [Seq, Batch, state_size]. On the CPU all steps run in a single fused C++ call.
+        """
+        if not input.is_cuda:
+            return LLTMSequenceFunction.apply(input, self.weights, self.bias, *state)
+        hs, cells = [], []
+        for x in input:
+            state = self(x, state)
+            hs.append(state[0])
+            cells.append(state[1])
+        return torch.stack(hs), torch.stack(cells)
+
 
 class ApplyFilter(nn.Module):
     "Wrapper class to apply a filter to an image."